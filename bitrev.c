@@ -0,0 +1,155 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "bitrev.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITREV_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define BITREV_NEON
+#include <arm_neon.h>
+#endif
+
+/* eight bytes at a time with shifts and masks: swap adjacent bits, then pairs, then nibbles */
+static void swapBytesScalar(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    uint64_t w;
+    uint32_t i;
+    uint8_t c;
+
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, src + i, sizeof(w));
+        w = ((w >> 1) & 0x5555555555555555ULL) | ((w & 0x5555555555555555ULL) << 1);
+        w = ((w >> 2) & 0x3333333333333333ULL) | ((w & 0x3333333333333333ULL) << 2);
+        w = ((w >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((w & 0x0f0f0f0f0f0f0f0fULL) << 4);
+        memcpy(dst + i, &w, sizeof(w));
+    }
+    for (; i < len; ++i) {
+        c = src[i];
+        c = ((c >> 1) & 0x55) | ((c & 0x55) << 1);
+        c = ((c >> 2) & 0x33) | ((c & 0x33) << 2);
+        dst[i] = (c >> 4) | (c << 4);
+    }
+}
+
+#ifdef BITREV_X86
+/* each nibble is looked up in a 16 entry table with pshufb: the reversed low nibble
+ * becomes the high one and the other way round */
+#define REV_NIBBLES(p) \
+    p(0x00), p(0x08), p(0x04), p(0x0c), p(0x02), p(0x0a), p(0x06), p(0x0e), \
+    p(0x01), p(0x09), p(0x05), p(0x0d), p(0x03), p(0x0b), p(0x07), p(0x0f)
+#define AS_LOW(x)   (char)(x)
+#define AS_HIGH(x)  (char)((x) << 4)
+
+__attribute__((target("ssse3")))
+static void swapBytesSsse3(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    const __m128i hi_tab = _mm_setr_epi8(REV_NIBBLES(AS_HIGH));
+    const __m128i lo_tab = _mm_setr_epi8(REV_NIBBLES(AS_LOW));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i x;
+    uint32_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        x = _mm_loadu_si128((const __m128i *)(src + i));
+        x = _mm_or_si128(_mm_shuffle_epi8(hi_tab, _mm_and_si128(x, mask)),
+                _mm_shuffle_epi8(lo_tab, _mm_and_si128(_mm_srli_epi16(x, 4), mask)));
+        _mm_storeu_si128((__m128i *)(dst + i), x);
+    }
+    swapBytesScalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void swapBytesAvx2(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    /* vpshufb looks up within each 128 bit lane, so both lanes carry the table */
+    const __m256i hi_tab = _mm256_setr_epi8(REV_NIBBLES(AS_HIGH), REV_NIBBLES(AS_HIGH));
+    const __m256i lo_tab = _mm256_setr_epi8(REV_NIBBLES(AS_LOW), REV_NIBBLES(AS_LOW));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i x;
+    uint32_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        x = _mm256_loadu_si256((const __m256i *)(src + i));
+        x = _mm256_or_si256(_mm256_shuffle_epi8(hi_tab, _mm256_and_si256(x, mask)),
+                _mm256_shuffle_epi8(lo_tab, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask)));
+        _mm256_storeu_si256((__m256i *)(dst + i), x);
+    }
+    swapBytesSsse3(dst + i, src + i, len - i);
+}
+
+static int cpuSsse3(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int cpuAvx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef BITREV_NEON
+/* aarch64 reverses the bits of every byte in one instruction */
+static void swapBytesNeon(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+        vst1q_u8(dst + i, vrbitq_u8(vld1q_u8(src + i)));
+    swapBytesScalar(dst + i, src + i, len - i);
+}
+#endif
+
+/* best first */
+const struct bitrev_kernel bitrevKernels[] = {
+#ifdef BITREV_X86
+    { "avx2", swapBytesAvx2, cpuAvx2 },
+    { "ssse3", swapBytesSsse3, cpuSsse3 },
+#endif
+#ifdef BITREV_NEON
+    { "neon", swapBytesNeon, NULL },
+#endif
+    { "scalar", swapBytesScalar, NULL },
+};
+const uint32_t bitrevKernelCount = sizeof(bitrevKernels) / sizeof(bitrevKernels[0]);
+
+static pthread_once_t swapBytesOnce = PTHREAD_ONCE_INIT;
+static void (*swapBytesImpl)(uint8_t *dst, const uint8_t *src, uint32_t len);
+
+static void swapBytesResolve(void)
+{
+    uint32_t k;
+
+    for (k = 0; bitrevKernels[k].supported != NULL && !bitrevKernels[k].supported(); ++k)
+        ;
+    swapBytesImpl = bitrevKernels[k].swap;
+}
+
+void swapBytes(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    /* the once also orders the pointer store before every thread's call */
+    pthread_once(&swapBytesOnce, swapBytesResolve);
+    swapBytesImpl(dst, src, len);
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __BITREV_H__
+#define __BITREV_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* reverse the bit order of every byte of src into dst, which may be src itself; the
+ * widest kernel the cpu supports is picked on the first call */
+void swapBytes(uint8_t *dst, const uint8_t *src, uint32_t len);
+
+/* every kernel built in, for the benchmark; supported() is NULL when always usable */
+struct bitrev_kernel {
+    const char *name;
+    void (*swap)(uint8_t *dst, const uint8_t *src, uint32_t len);
+    int (*supported)(void);
+};
+
+extern const struct bitrev_kernel bitrevKernels[];
+extern const uint32_t bitrevKernelCount;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,116 +23,369 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <string.h>
-#include <signal.h>
+#include <time.h>
 #include "ch341a.h"
+#include "bitrev.h"
+#include "ch341trace.h"
+
+/* what the engines assume until the chip is detected */
+static const struct spi_flash_info flashDefaults = {
+    .page_size = 256,
+    .page_prog_us = 700,
+    .page_prog_max_us = 3000,
+    .chip_erase_ms = 20000,
+    .chip_erase_max_ms = 200000,
+    .read_op = 0x03,
+    .read4_op = 0x13,
+    .fast_read_op = 0x0B,
+    .fast_read4_op = 0x0C,
+    .prog_op = 0x02,
+    .prog4_op = 0x12,
+    .erase = {
+        {  4096, 0x20, 0x21,  45,  400 },
+        { 32768, 0x52, 0x5C, 120, 1600 },
+        { 65536, 0xD8, 0xDC, 150, 2000 },
+    },
+    .erase_types = 3,
+    .secreg_pages = 3,
+    .secreg_size = 256,
+};
+
+/* a context with the default settings, no device and no callbacks */
+struct ch341_ctx *ch341New(void)
+{
+    struct ch341_ctx *ctx = calloc(1, sizeof(*ctx));
+
+    if (ctx == NULL)
+        return NULL;
+    ctx->flash = flashDefaults;
+    ctx->queue_depth = CH341_QUEUE_DEPTH;
+    ctx->read_mode = SPI_READ_AUTO;
+    ctx->log_level = CH341_LOG_INFO;
+    return ctx;
+}
+
+/* release the device if there is one and free the context */
+void ch341Free(struct ch341_ctx *ctx)
+{
+    if (ctx == NULL)
+        return;
+    ch341TraceClose(ctx);
+    ch341Release(ctx);
+    free(ctx);
+}
+
+/* messages up to level go to log; without one they are dropped */
+void ch341SetLog(struct ch341_ctx *ctx, ch341_log_fn log, void *user, int32_t level)
+{
+    ctx->log = log;
+    ctx->log_user = user;
+    ctx->log_level = level;
+}
+
+void ch341SetProgress(struct ch341_ctx *ctx, ch341_progress_fn progress, void *user)
+{
+    ctx->progress = progress;
+    ctx->progress_user = user;
+}
 
-struct libusb_device_handle *devHandle = NULL;
-struct sigaction saold;
-int force_stop = 0;
+/* make the running erase, read or write stop after its current unit; async-signal-safe */
+void ch341Stop(struct ch341_ctx *ctx)
+{
+    ctx->stop = 1;
+}
 
-void v_print(int mode, int len) ;
+void ch341Log(struct ch341_ctx *ctx, int32_t level, const char *fmt, ...)
+{
+    char msg[256];
+    va_list ap;
+
+    if (ctx->log == NULL || level > ctx->log_level)
+        return;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    ctx->log(ctx->log_user, level, msg);
+}
 
-/* SIGINT handler */
-void sig_int(int signo)
+static void spiProgress(struct ch341_ctx *ctx, uint32_t event, uint32_t done, uint32_t total)
 {
-    force_stop = 1;
+    if (ctx->progress)
+        ctx->progress(ctx->progress_user, event, done, total);
+}
+
+/* the libusb transport: ctx->priv */
+struct usb_dev {
+    libusb_context *usb;
+    struct libusb_device_handle *handle;
+};
+
+static int usbBulk(struct ch341_ctx *ctx, uint8_t ep, uint8_t *buf, int len, int *transferred, uint32_t timeout)
+{
+    struct usb_dev *dev = ctx->priv;
+
+    return libusb_bulk_transfer(dev->handle, ep, buf, len, transferred, timeout);
+}
+
+static int usbSubmit(struct ch341_ctx *ctx, struct libusb_transfer *xfer)
+{
+    struct usb_dev *dev = ctx->priv;
+
+    xfer->dev_handle = dev->handle;
+    return libusb_submit_transfer(xfer);
+}
+
+static int usbCancel(struct ch341_ctx *ctx, struct libusb_transfer *xfer)
+{
+    struct usb_dev *dev = ctx->priv;
+
+    if (xfer->dev_handle != dev->handle) // not submitted through this context
+        return LIBUSB_ERROR_NOT_FOUND;
+    return libusb_cancel_transfer(xfer);
+}
+
+static int usbHandleEvents(struct ch341_ctx *ctx, struct timeval *tv)
+{
+    struct usb_dev *dev = ctx->priv;
+
+    return libusb_handle_events_timeout(dev->usb, tv);
+}
+
+static int usbClearHalt(struct ch341_ctx *ctx, uint8_t ep)
+{
+    struct usb_dev *dev = ctx->priv;
+
+    return libusb_clear_halt(dev->handle, ep);
+}
+
+static void usbRelease(struct ch341_ctx *ctx)
+{
+    struct usb_dev *dev = ctx->priv;
+
+    libusb_release_interface(dev->handle, 0);
+    libusb_close(dev->handle);
+    libusb_exit(dev->usb);
+    free(dev);
+}
+
+static const struct ch341_transport usbTransport = {
+    .name = "libusb",
+    .bulk = usbBulk,
+    .submit = usbSubmit,
+    .cancel = usbCancel,
+    .handle_events = usbHandleEvents,
+    .clear_halt = usbClearHalt,
+    .release = usbRelease,
+};
+
+/* the port path of a device, "bus-port[.port...]" as in sysfs */
+static void usbDevicePath(struct libusb_device *dev, char *path, size_t size)
+{
+    uint8_t ports[8];
+    int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    size_t len;
+
+    len = snprintf(path, size, "%u", libusb_get_bus_number(dev));
+    for (int i = 0; i < n && len < size; ++i)
+        len += snprintf(path + len, size - len, "%c%u", i ? '.' : '-', ports[i]);
+}
+
+/* the port path of the configured programmer, or the transport name if it is not on usb */
+int32_t ch341DevicePath(struct ch341_ctx *ctx, char *path, size_t size)
+{
+    struct usb_dev *dev = ctx->priv;
+
+    if (ctx->transport == NULL)
+        return -1;
+    if (ctx->transport == &usbTransport)
+        usbDevicePath(libusb_get_device(dev->handle), path, size);
+    else
+        snprintf(path, size, "%s", ctx->transport->name);
+    return 0;
+}
+
+/* list the port paths of up to max devices with vid:pid, returns how many were found */
+int32_t ch341List(uint16_t vid, uint16_t pid, char (*paths)[CH341_PATH_LENGTH], uint32_t max)
+{
+    struct libusb_device_descriptor desc;
+    struct libusb_device **list;
+    libusb_context *usb;
+    ssize_t n;
+    uint32_t found = 0;
+
+    if (libusb_init(&usb) < 0)
+        return -1;
+    n = libusb_get_device_list(usb, &list);
+    for (ssize_t i = 0; i < n && found < max; ++i) {
+        if (libusb_get_device_descriptor(list[i], &desc) == 0 &&
+                desc.idVendor == vid && desc.idProduct == pid)
+            usbDevicePath(list[i], paths[found++], CH341_PATH_LENGTH);
+    }
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
+    libusb_exit(usb);
+    return found;
+}
+
+static struct libusb_device_handle *usbOpenPath(libusb_context *usb, uint16_t vid, uint16_t pid, const char *path)
+{
+    struct libusb_device_descriptor desc;
+    struct libusb_device_handle *handle = NULL;
+    struct libusb_device **list;
+    char where[CH341_PATH_LENGTH];
+    ssize_t n;
+
+    n = libusb_get_device_list(usb, &list);
+    for (ssize_t i = 0; i < n && handle == NULL; ++i) {
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+                desc.idVendor != vid || desc.idProduct != pid)
+            continue;
+        usbDevicePath(list[i], where, sizeof(where));
+        if (!strcmp(where, path) && libusb_open(list[i], &handle) != 0)
+            handle = NULL;
+    }
+    if (n >= 0)
+        libusb_free_device_list(list, 1);
+    return handle;
 }
 
 /* Configure CH341A, find the device and set the default interface. */
-int32_t ch341Configure(uint16_t vid, uint16_t pid)
+int32_t ch341Configure(struct ch341_ctx *ctx, uint16_t vid, uint16_t pid)
+{
+    return ch341ConfigurePath(ctx, vid, pid, NULL);
+}
+
+/* as ch341Configure, but open the device at a port path; NULL takes the first one */
+int32_t ch341ConfigurePath(struct ch341_ctx *ctx, uint16_t vid, uint16_t pid, const char *path)
 {
-    struct libusb_device *dev;
+    struct libusb_device *usbDev;
+    struct usb_dev *dev;
     int32_t ret;
-    struct sigaction sa;
 
     uint8_t  desc[0x12];
 
-    if (devHandle != NULL) {
-        fprintf(stderr, "Call ch341Release before re-configure\n");
+    if (ctx->transport != NULL) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Call ch341Release before re-configure");
         return -1;
     }
-    ret = libusb_init(NULL);
+    if ((dev = calloc(1, sizeof(*dev))) == NULL)
+        return -1;
+    ret = libusb_init(&dev->usb);
     if(ret < 0) {
-        fprintf(stderr, "Couldn't initialise libusb\n");
+        ch341Log(ctx, CH341_LOG_ERROR, "Couldn't initialise libusb");
+        free(dev);
         return -1;
     }
 
     #if LIBUSB_API_VERSION < 0x01000106
-        libusb_set_debug(NULL, 3);
+        libusb_set_debug(dev->usb, 3);
     #else
-        libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+        libusb_set_option(dev->usb, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
     #endif
 
-    if(!(devHandle = libusb_open_device_with_vid_pid(NULL, vid, pid))) {
-        fprintf(stderr, "Couldn't open device [%04x:%04x].\n", vid, pid);
-        return -1;
+    dev->handle = path ? usbOpenPath(dev->usb, vid, pid, path) : libusb_open_device_with_vid_pid(dev->usb, vid, pid);
+    if (!dev->handle) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Couldn't open device [%04x:%04x]%s%s.", vid, pid, path ? " at " : "", path ? path : "");
+        goto exit_ctx;
     }
 
-    if(!(dev = libusb_get_device(devHandle))) {
-        fprintf(stderr, "Couldn't get bus number and address.\n");
+    if(!(usbDev = libusb_get_device(dev->handle))) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Couldn't get bus number and address.");
         goto close_handle;
     }
 
-    if(libusb_kernel_driver_active(devHandle, 0)) {
-        ret = libusb_detach_kernel_driver(devHandle, 0);
+    if(libusb_kernel_driver_active(dev->handle, 0)) {
+        ret = libusb_detach_kernel_driver(dev->handle, 0);
         if(ret) {
-            fprintf(stderr, "Failed to detach kernel driver: '%s'\n", strerror(-ret));
+            ch341Log(ctx, CH341_LOG_ERROR, "Failed to detach kernel driver: '%s'", strerror(-ret));
             goto close_handle;
         }
     }
 
-    ret = libusb_claim_interface(devHandle, 0);
+    ret = libusb_claim_interface(dev->handle, 0);
 
     if(ret) {
-        fprintf(stderr, "Failed to claim interface 0: '%s'\n", strerror(-ret));
+        ch341Log(ctx, CH341_LOG_ERROR, "Failed to claim interface 0: '%s'", strerror(-ret));
         goto close_handle;
     }
 
-    ret = libusb_get_descriptor(devHandle, LIBUSB_DT_DEVICE, 0x00, desc, 0x12);
+    ret = libusb_get_descriptor(dev->handle, LIBUSB_DT_DEVICE, 0x00, desc, 0x12);
 
     if(ret < 0) {
-        fprintf(stderr, "Failed to get device descriptor: '%s'\n", strerror(-ret));
+        ch341Log(ctx, CH341_LOG_ERROR, "Failed to get device descriptor: '%s'", strerror(-ret));
         goto release_interface;
     }
 
-    printf("Device reported its revision [%d.%02d]\n", desc[12], desc[13]);
-    sa.sa_handler = &sig_int;
-    sa.sa_flags = SA_RESTART;
-    sigfillset(&sa.sa_mask);
-    if (sigaction(SIGINT, &sa, &saold) == -1) {
-        perror("Error: cannot handle SIGINT"); // Should not happen
-    }
-    return 0;
+    ch341Log(ctx, CH341_LOG_INFO, "Device reported its revision [%d.%02d]", desc[12], desc[13]);
+    return ch341Attach(ctx, &usbTransport, dev);
 release_interface:
-    libusb_release_interface(devHandle, 0);
+    libusb_release_interface(dev->handle, 0);
 close_handle:
-    libusb_close(devHandle);
-    devHandle = NULL;
+    libusb_close(dev->handle);
+exit_ctx:
+    libusb_exit(dev->usb);
+    free(dev);
     return -1;
 }
 
-/* release libusb structure and ready to exit */
-int32_t ch341Release(void)
+/* route all traffic of ctx through t, with priv as its state, from now on */
+int32_t ch341Attach(struct ch341_ctx *ctx, const struct ch341_transport *t, void *priv)
+{
+    if (ctx->transport != NULL)
+        return -1;
+    ctx->transport = t;
+    ctx->priv = priv;
+    ctx->stop = 0;
+    return 0;
+}
+
+/* release the transport and ready to exit */
+/* An SPI_ADDR_EN4B chip takes 4-byte addresses after EN4B (B7) and 3-byte ones after
+ * EX4B (E9); switch it to what the next command sends. Other chips pick the width by
+ * opcode and need nothing. */
+static int32_t spiAddrMode(struct ch341_ctx *ctx, bool four)
 {
-    if (devHandle == NULL) return -1;
-    libusb_release_interface(devHandle, 0);
-    libusb_close(devHandle);
-    libusb_exit(NULL);
-    devHandle = NULL;
-    sigaction(SIGINT, &saold, NULL);
+    uint8_t out[1], in[1];
+
+    if (ctx->flash.addr_mode != SPI_ADDR_EN4B || ctx->addr4 == four)
+        return 0;
+    out[0] = four ? 0xB7 : 0xE9;
+    if (ch341SpiStream(ctx, out, in, 1) < 0)
+        return -1;
+    ctx->addr4 = four;
     return 0;
 }
 
-/* Helper function for libusb_bulk_transfer, display error message with the caller name */
-int32_t usbTransfer(const char * func, uint8_t type, uint8_t* buf, int len)
+int32_t ch341Release(struct ch341_ctx *ctx)
+{
+    if (ctx->transport == NULL) return -1;
+    spiAddrMode(ctx, false); // leave the chip as a 3-byte boot loader expects it
+    ctx->transport->release(ctx);
+    ctx->transport = NULL;
+    ctx->priv = NULL;
+    return 0;
+}
+
+/* Helper function for libusb_bulk_transfer, log an error message with the caller name */
+int32_t usbTransfer(struct ch341_ctx *ctx, const char * func, uint8_t type, uint8_t* buf, int len)
 {
     int32_t ret;
     int transfered;
-    if (devHandle == NULL) return -1;
-    ret = libusb_bulk_transfer(devHandle, type, buf, len, &transfered, DEFAULT_TIMEOUT);
+    uint64_t t0 = 0;
+    if (ctx->transport == NULL) return -1;
+    if (ctx->trace)
+        t0 = traceNow();
+    ret = ctx->transport->bulk(ctx, type, buf, len, &transfered, DEFAULT_TIMEOUT);
+    if (ctx->trace)
+        traceSpan(ctx, "usb", func, t0, "ep", type, "len", ret < 0 ? 0 : transfered);
+    if (type == BULK_WRITE_ENDPOINT)
+        ctx->stats.out_transfers++;
+    else
+        ctx->stats.in_transfers++;
     if (ret < 0) {
-        fprintf(stderr, "%s: Failed to %s %d bytes '%s'\n", func,
+        ch341Log(ctx, CH341_LOG_ERROR, "%s: Failed to %s %d bytes '%s'", func,
                 (type == BULK_WRITE_ENDPOINT) ? "write" : "read", len, libusb_error_name(ret));
         return -1;
     }
@@ -141,15 +394,16 @@ int32_t usbTransfer(const char * func, uint8_t type, uint8_t* buf, int len)
 
 /*   set the i2c bus speed (speed(b1b0): 0 = 20kHz; 1 = 100kHz, 2 = 400kHz, 3 = 750kHz)
  *   set the spi bus data width(speed(b2): 0 = Single, 1 = Double)  */
-int32_t ch341SetStream(uint32_t speed) {
+int32_t ch341SetStream(struct ch341_ctx *ctx, uint32_t speed) {
     uint8_t buf[3];
 
-    if (devHandle == NULL) return -1;
+    if (ctx->transport == NULL) return -1;
     buf[0] = CH341A_CMD_I2C_STREAM;
     buf[1] = CH341A_CMD_I2C_STM_SET | (speed & 0x7);
     buf[2] = CH341A_CMD_I2C_STM_END;
+    ctx->stream_speed = speed;
 
-    return usbTransfer(__func__, BULK_WRITE_ENDPOINT, buf, 3);
+    return usbTransfer(ctx, __func__, BULK_WRITE_ENDPOINT, buf, 3);
 }
 
 /* ch341 requres LSB first, swap the bit order before send and after receive  */
@@ -203,16 +457,16 @@ void ch341SpiCs(uint8_t *ptr, bool selected)
 }
 
 /* transfer len bytes of data to the spi device */
-int32_t ch341SpiStream(uint8_t *out, uint8_t *in, uint32_t len)
+int32_t ch341SpiStream(struct ch341_ctx *ctx, uint8_t *out, uint8_t *in, uint32_t len)
 {
     uint8_t inBuf[CH341_PACKET_LENGTH], outBuf[CH341_PACKET_LENGTH], *inPtr, *outPtr;
     int32_t ret, packetLen;
     bool done;
 
-    if (devHandle == NULL) return -1;
+    if (ctx->transport == NULL) return -1;
 
     ch341SpiCs(outBuf, true);
-    ret = usbTransfer(__func__, BULK_WRITE_ENDPOINT, outBuf, 4);
+    ret = usbTransfer(ctx, __func__, BULK_WRITE_ENDPOINT, outBuf, 4);
     if (ret < 0) return -1;
 
     inPtr = in;
@@ -226,33 +480,212 @@ int32_t ch341SpiStream(uint8_t *out, uint8_t *in, uint32_t len)
         }
         outPtr = outBuf;
         *outPtr++ = CH341A_CMD_SPI_STREAM;
-        for (int i = 0; i < packetLen-1; ++i)
-            *outPtr++ = swapByte(*out++);
-        ret = usbTransfer(__func__, BULK_WRITE_ENDPOINT, outBuf, packetLen);
+        swapBytes(outPtr, out, packetLen-1);
+        out += packetLen-1;
+        ret = usbTransfer(ctx, __func__, BULK_WRITE_ENDPOINT, outBuf, packetLen);
         if (ret < 0) return -1;
-        ret = usbTransfer(__func__, BULK_READ_ENDPOINT, inBuf, packetLen-1);
+        ret = usbTransfer(ctx, __func__, BULK_READ_ENDPOINT, inBuf, packetLen-1);
         if (ret < 0) return -1;
         len -= ret;
 
-        for (int i = 0; i < ret; ++i) // swap the buffer
-            *inPtr++ = swapByte(inBuf[i]);
+        swapBytes(inPtr, inBuf, ret); // swap the buffer
+        inPtr += ret;
     } while (!done);
 
     ch341SpiCs(outBuf, false);
-    ret = usbTransfer(__func__, BULK_WRITE_ENDPOINT, outBuf, 3);
+    ret = usbTransfer(ctx, __func__, BULK_WRITE_ENDPOINT, outBuf, 3);
     if (ret < 0) return -1;
     return 0;
 }
 
+#define SFDP_MAX_READ 0x50
+
+/* read len bytes of the SFDP area at add: 0x5A, 3 address bytes and 8 dummy clocks */
+static int32_t spiSfdpRead(struct ch341_ctx *ctx, uint32_t add, uint8_t *buf, uint32_t len)
+{
+    uint8_t out[5 + SFDP_MAX_READ];
+    uint8_t in[5 + SFDP_MAX_READ];
+    int32_t ret;
+
+    memset(out, 0x00, sizeof(out));
+    out[0] = 0x5A; // Read SFDP
+    out[1] = add >> 16;
+    out[2] = add >> 8;
+    out[3] = add;
+    ret = ch341SpiStream(ctx, out, in, 5 + len);
+    if (ret < 0) return ret;
+    memcpy(buf, in + 5, len);
+    return 0;
+}
+
+/* little-endian dword n of an SFDP table */
+static uint32_t sfdpDword(const uint8_t *table, int n)
+{
+    return table[4 * n] | table[4 * n + 1] << 8 | table[4 * n + 2] << 16 | (uint32_t)table[4 * n + 3] << 24;
+}
+
+/* a BFPT fast read field: dummy clocks in bits 4:0, mode clocks in 7:5, opcode in 15:8 */
+static void sfdpFastRead(struct spi_fast_read *fr, bool supported, uint32_t field)
+{
+    fr->opcode = supported ? field >> 8 : 0;
+    fr->dummy_clocks = field & 0x1F;
+    fr->mode_clocks = (field >> 5) & 0x07;
+}
+
+/* Read the SFDP header and the Basic Flash Parameter Table (plus the 4-byte address
+ * instruction table, if any) and take density, page size, erase commands and their
+ * times, address mode and fast read instructions from them into ctx->flash.
+ * Returns 0 if the chip has usable SFDP data, -1 otherwise. */
+int32_t ch341ReadSfdp(struct ch341_ctx *ctx)
+{
+    static const uint32_t erase_unit[] = { 1, 16, 128, 1000 };          // ms
+    static const uint32_t chip_unit[] = { 16, 256, 4000, 64000 };       // ms
+    struct spi_erase_type erase[4];
+    uint8_t hdr[8], bfpt[4 * 20], bait[8];
+    uint32_t bfpt_ptr = 0, bfpt_len = 0, bait_ptr = 0, dw, n, mult;
+    uint32_t count = 0;
+
+    if (ctx->transport == NULL) return -1;
+    if (spiSfdpRead(ctx, 0, hdr, sizeof(hdr)) < 0 || memcmp(hdr, "SFDP", 4) != 0)
+        return -1;
+    for (int i = 0; i <= hdr[6] && i < 16; ++i) { // parameter headers
+        uint8_t ph[8];
+        if (spiSfdpRead(ctx, 8 + 8 * i, ph, sizeof(ph)) < 0)
+            return -1;
+        if (ph[7] == 0xFF && ph[0] == 0x00 && bfpt_ptr == 0) {
+            bfpt_ptr = ph[4] | ph[5] << 8 | ph[6] << 16;
+            bfpt_len = ph[3] > 20 ? 20 : ph[3];
+        } else if (ph[7] == 0xFF && ph[0] == 0x84 && ph[3] >= 2)
+            bait_ptr = ph[4] | ph[5] << 8 | ph[6] << 16;
+    }
+    if (bfpt_len < 9 || spiSfdpRead(ctx, bfpt_ptr, bfpt, bfpt_len * 4) < 0)
+        return -1;
+
+    dw = sfdpDword(bfpt, 1); // density
+    if (dw & 0x80000000) {
+        if ((dw & 0x7FFFFFFF) < 3 || (dw & 0x7FFFFFFF) > 34)
+            return -1;
+        ctx->flash.capacity = 1u << ((dw & 0x7FFFFFFF) - 3);
+    } else
+        ctx->flash.capacity = (dw >> 3) + 1;
+
+    dw = sfdpDword(bfpt, 0);
+    ctx->flash.addr_mode = (dw >> 17) & 0x03;
+    sfdpFastRead(&ctx->flash.fast_read_112, dw & (1 << 16), sfdpDword(bfpt, 3));
+    sfdpFastRead(&ctx->flash.fast_read_122, dw & (1 << 20), sfdpDword(bfpt, 3) >> 16);
+    sfdpFastRead(&ctx->flash.fast_read_144, dw & (1 << 21), sfdpDword(bfpt, 2));
+    sfdpFastRead(&ctx->flash.fast_read_114, dw & (1 << 22), sfdpDword(bfpt, 2) >> 16);
+
+    /* erase types 1-4: size exponent and opcode, typical times from dword 10 if present */
+    for (int t = 0; t < 4; ++t) {
+        dw = sfdpDword(bfpt, 7 + t / 2) >> (16 * (t % 2));
+        erase[t].size = (dw & 0xFF) ? 1u << (dw & 0xFF) : 0;
+        erase[t].opcode = dw >> 8;
+        erase[t].opcode4 = 0;
+        erase[t].typ_ms = erase[t].size / 4096 * 45;  // unless the table says better
+        erase[t].max_ms = erase[t].typ_ms * 8;
+        if (bfpt_len >= 10) {
+            dw = sfdpDword(bfpt, 9);
+            mult = 2 * ((dw & 0x0F) + 1);
+            n = dw >> (4 + 7 * t);
+            erase[t].typ_ms = ((n & 0x1F) + 1) * erase_unit[(n >> 5) & 0x03];
+            erase[t].max_ms = erase[t].typ_ms * mult;
+        }
+    }
+    if (bait_ptr && spiSfdpRead(ctx, bait_ptr, bait, sizeof(bait)) == 0) {
+        dw = sfdpDword(bait, 0);
+        ctx->flash.read4_op = (dw & (1 << 0)) ? 0x13 : ctx->flash.read4_op;
+        ctx->flash.fast_read4_op = (dw & (1 << 1)) ? 0x0C : 0;
+        ctx->flash.prog4_op = (dw & (1 << 6)) ? 0x12 : ctx->flash.prog4_op;
+        for (int t = 0; t < 4; ++t)
+            if (dw & (1 << (9 + t)))
+                erase[t].opcode4 = bait[4 + t];
+    } else if (ctx->flash.addr_mode == SPI_ADDR_3OR4BYTE && ctx->flash.capacity > (1u << 24)) {
+        /* no table of 4-byte opcodes: the 3-byte ones in EN4B mode, which parts of
+         * the SFDP revisions before it have */
+        ctx->flash.addr_mode = SPI_ADDR_EN4B;
+        ctx->flash.read4_op = ctx->flash.read_op;
+        ctx->flash.fast_read4_op = ctx->flash.fast_read_op;
+        ctx->flash.prog4_op = ctx->flash.prog_op;
+        for (int t = 0; t < 4; ++t)
+            erase[t].opcode4 = erase[t].opcode;
+    }
+    for (int t = 0; t < 4; ++t) { // keep the supported ones, smallest first
+        if (erase[t].size == 0 || erase[t].size > ctx->flash.capacity)
+            continue;
+        if (ctx->flash.capacity > (1u << 24) && erase[t].opcode4 == 0) // not above 16 MB
+            continue;
+        for (n = count; n > 0 && ctx->flash.erase[n - 1].size > erase[t].size; --n)
+            ctx->flash.erase[n] = ctx->flash.erase[n - 1];
+        ctx->flash.erase[n] = erase[t];
+        count++;
+    }
+    if (count > 0)
+        ctx->flash.erase_types = count;
+
+    if (bfpt_len >= 11) {
+        dw = sfdpDword(bfpt, 10);
+        n = 1u << ((dw >> 4) & 0x0F);
+        ctx->flash.page_size = n > CH341_MAX_PAGE_LENGTH ? CH341_MAX_PAGE_LENGTH : n;
+        ctx->flash.page_prog_us = (((dw >> 8) & 0x1F) + 1) * ((dw & (1 << 13)) ? 64 : 8);
+        ctx->flash.page_prog_max_us = ctx->flash.page_prog_us * 2 * ((dw & 0x0F) + 1);
+        ctx->flash.chip_erase_ms = (((dw >> 24) & 0x1F) + 1) * chip_unit[(dw >> 29) & 0x03];
+        ctx->flash.chip_erase_max_ms = ctx->flash.chip_erase_ms * 2 * ((dw & 0x0F) + 1);
+    }
+    ctx->flash.sfdp = true;
+    return 0;
+}
+
+/* take geometry and timings of a listed part into ctx->flash */
+static void spiChipApply(struct ch341_ctx *ctx, const struct spi_chip *chip)
+{
+    const struct spi_timing *t[] = { &chip->erase_4k, &chip->erase_32k, &chip->erase_64k };
+    const uint8_t op[] = { 0x20, 0x52, 0xD8 };
+    uint32_t count = 0;
+
+    ctx->flash.name = chip->name;
+    ctx->flash.capacity = chip->capacity;
+    ctx->flash.page_size = chip->page_size;
+    ctx->flash.page_prog_us = chip->page_prog.typ;
+    ctx->flash.page_prog_max_us = chip->page_prog.max;
+    ctx->flash.chip_erase_ms = chip->chip_erase.typ;
+    ctx->flash.chip_erase_max_ms = chip->chip_erase.max;
+    ctx->flash.addr_mode = chip->addr_mode;
+    ctx->flash.fast_read4_op = chip->addr_mode == SPI_ADDR_3BYTE ? 0 : 0x0C;
+    if (chip->addr_mode == SPI_ADDR_EN4B) { // the 3-byte opcodes, in 4-byte mode
+        ctx->flash.read4_op = ctx->flash.read_op;
+        ctx->flash.fast_read4_op = ctx->flash.fast_read_op;
+        ctx->flash.prog4_op = ctx->flash.prog_op;
+    }
+    for (int i = 0; i < 3; ++i) {
+        if (t[i]->max == 0)
+            continue;
+        /* a size the part cannot erase above 16 MB would be silently skipped there */
+        if (chip->capacity > (1u << 24) && chip->erase4_op[i] == 0)
+            continue;
+        ctx->flash.erase[count].size = 4096u << (i == 0 ? 0 : i + 2);
+        ctx->flash.erase[count].opcode = op[i];
+        ctx->flash.erase[count].opcode4 = chip->erase4_op[i];
+        ctx->flash.erase[count].typ_ms = t[i]->typ;
+        ctx->flash.erase[count].max_ms = t[i]->max;
+        count++;
+    }
+    ctx->flash.erase_types = count;
+    ctx->flash.secreg_pages = chip->secreg_pages;
+    ctx->flash.secreg_size = chip->secreg_size;
+}
+
 #define JEDEC_ID_LEN 0x52    // additional byte due to SPI shift
 /* read the JEDEC ID of the SPI Flash */
-int32_t ch341SpiCapacity(void)
+int32_t ch341SpiCapacity(struct ch341_ctx *ctx)
 {
     uint8_t out[JEDEC_ID_LEN];
     uint8_t in[JEDEC_ID_LEN], *ptr, cap;
+    const struct spi_chip *chip;
+    char op4[4];
     int32_t ret;
 
-    if (devHandle == NULL)
+    if (ctx->transport == NULL)
         return -1;
 
     ptr = out;
@@ -261,373 +694,1280 @@ int32_t ch341SpiCapacity(void)
     for (int i = 0; i < JEDEC_ID_LEN - 1; ++i)
         *ptr++ = 0x00;
 
-    ret = ch341SpiStream(out, in, JEDEC_ID_LEN);
+    ret = ch341SpiStream(ctx, out, in, JEDEC_ID_LEN);
 
     if (ret < 0)
         return ret;
 
     if (! (in[1] == 0xFF && in[2] == 0xFF && in[3] == 0xFF))
     {
-        printf("Manufacturer ID: %02x\n", in[1]);
-        printf("Memory Type: %02x%02x\n", in[2], in[3]);
+        ch341Log(ctx, CH341_LOG_INFO, "Manufacturer ID: %02x", in[1]);
+        ch341Log(ctx, CH341_LOG_INFO, "Memory Type: %02x%02x", in[2], in[3]);
 
-        if (in[0x11] == 'Q' && in[0x12] == 'R' && in[0x13] == 'Y')
+        ctx->flash.jedec_id = in[1] << 16 | in[2] << 8 | in[3];
+        ctx->addr4 = false;
+        chip = spiChipLookup(ctx->flash.jedec_id);
+        if (chip != NULL || ch341ReadSfdp(ctx) == 0)
+        {
+            if (chip != NULL)
+                spiChipApply(ctx, chip);
+            for (cap = 0; cap < 31 && (2u << cap) <= ctx->flash.capacity; cap++)
+                ;
+            if (chip != NULL)
+                ch341Log(ctx, CH341_LOG_INFO, "Chip: %s", chip->name);
+            else
+                ch341Log(ctx, CH341_LOG_INFO, "Reading device capacity from SFDP");
+            ch341Log(ctx, CH341_LOG_INFO, "Page size: %u bytes, %s addressing", ctx->flash.page_size,
+                    ctx->flash.addr_mode == SPI_ADDR_3BYTE ? "3-byte" :
+                    ctx->flash.addr_mode == SPI_ADDR_3OR4BYTE ? "3/4-byte" :
+                    ctx->flash.addr_mode == SPI_ADDR_EN4B ? "3/4-byte (EN4B)" : "4-byte");
+            for (uint32_t i = 0; i < ctx->flash.erase_types; ++i) {
+                if (ctx->flash.erase[i].opcode4)
+                    snprintf(op4, sizeof(op4), "/%02x", ctx->flash.erase[i].opcode4);
+                else
+                    op4[0] = 0;
+                ch341Log(ctx, CH341_LOG_INFO, "Erase: %u KB (%02x%s), typ %u ms, max %u ms",
+                        ctx->flash.erase[i].size / 1024, ctx->flash.erase[i].opcode,
+                        op4, ctx->flash.erase[i].typ_ms, ctx->flash.erase[i].max_ms);
+            }
+        }
+        else if (in[0x11] == 'Q' && in[0x12] == 'R' && in[0x13] == 'Y')
         {
             cap = in[0x28];
-            printf("Reading device capacity from CFI structure\n");
+            ch341Log(ctx, CH341_LOG_INFO, "Reading device capacity from CFI structure");
         }
         else
         {
             cap = in[3];
-            printf("No CFI structure found, trying to get capacity from device ID. Set manually if detection fails.\n");
+            ch341Log(ctx, CH341_LOG_INFO, "No CFI structure found, trying to get capacity from device ID. Set manually if detection fails.");
         }
 
-        printf("Capacity: %02x\n", cap);
+        ch341Log(ctx, CH341_LOG_INFO, "Capacity: %02x", cap);
+        ctx->flash.capacity = 1u << cap;
     }
     else
     {
-        fprintf(stderr, "Chip not found or missed in ch341a. Check connection\n");
-        exit(1);
+        ch341Log(ctx, CH341_LOG_ERROR, "Chip not found or missed in ch341a. Check connection");
+        return -1;
     }
 
     return cap;
 }
 
 /* read status register */
-int32_t ch341ReadStatus(void)
+int32_t ch341ReadStatus(struct ch341_ctx *ctx)
 {
     uint8_t out[2];
     uint8_t in[2];
     int32_t ret;
 
-    if (devHandle == NULL) return -1;
+    if (ctx->transport == NULL) return -1;
     out[0] = 0x05; // Read status
-    ret = ch341SpiStream(out, in, 2);
+    ret = ch341SpiStream(ctx, out, in, 2);
     if (ret < 0) return ret;
     return (in[1]);
 }
 
 /* write status register */
-int32_t ch341WriteStatus(uint8_t status)
+int32_t ch341WriteStatus(struct ch341_ctx *ctx, uint8_t status)
 {
     uint8_t out[2];
     uint8_t in[2];
     int32_t ret;
 
-    if (devHandle == NULL) return -1;
+    if (ctx->transport == NULL) return -1;
     out[0] = 0x06; // Write enable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
     out[0] = 0x01; // Write status
     out[1] = status;
-    ret = ch341SpiStream(out, in, 2);
+    ret = ch341SpiStream(ctx, out, in, 2);
     if (ret < 0) return ret;
     out[0] = 0x04; // Write disable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
     return 0;
 }
 
 /* chip erase */
-int32_t ch341EraseChip(void)
+int32_t ch341EraseChip(struct ch341_ctx *ctx)
 {
     uint8_t out[1];
     uint8_t in[1];
     int32_t ret;
 
-    if (devHandle == NULL) return -1;
+    if (ctx->transport == NULL) return -1;
     out[0] = 0x06; // Write enable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
     out[0] = 0xC7; // Chip erase
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
     out[0] = 0x04; // Write disable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
     return 0;
 }
 
-/* callback for bulk out async transfer */
-void cbBulkOut(struct libusb_transfer *transfer)
+/* one erase command chosen by the planner */
+struct spi_erase_block {
+    uint32_t add;
+    const struct spi_erase_type *type;
+};
+
+/* erase the block of the given size holding add and wait for it to finish */
+int32_t ch341EraseBlock(struct ch341_ctx *ctx, uint32_t add, uint32_t size)
 {
-    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-        fprintf(stderr, "\ncbBulkOut: error : %d\n", transfer->status);
+    const struct spi_erase_type *type = NULL;
+    uint8_t out[5];
+    uint8_t in[5];
+    uint32_t idx = 0;
+    uint64_t t0 = 0;
+    int32_t ret;
+
+    if (ctx->transport == NULL) return -1;
+    if (ctx->trace)
+        t0 = traceNow();
+    for (uint32_t i = 0; i < ctx->flash.erase_types; ++i)
+        if (ctx->flash.erase[i].size == size)
+            type = &ctx->flash.erase[i];
+    if (type == NULL) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Chip has no %u bytes erase command", size);
+        return -1;
     }
+    if (spiAddrMode(ctx, add >= (1 << 24)) < 0) return -1;
+    out[0] = 0x06; // Write enable
+    ret = ch341SpiStream(ctx, out, in, 1);
+    if (ret < 0) return ret;
+    out[idx++] = add >= (1 << 24) ? type->opcode4 : type->opcode;
+    if (add >= (1 << 24))
+        out[idx++] = add >> 24;
+    out[idx++] = add >> 16;
+    out[idx++] = add >> 8;
+    out[idx++] = add;
+    ret = ch341SpiStream(ctx, out, in, idx);
+    if (ret < 0) return ret;
+    ret = ch341WaitReady(ctx, type->max_ms > DEFAULT_TIMEOUT ? type->max_ms : DEFAULT_TIMEOUT);
+    if (ctx->trace)
+        traceSpan(ctx, "spi", "erase", t0, "add", add, "size", size);
+    return ret;
 }
 
-struct spi_transfer_in {
-    ssize_t bulk_count;
-    size_t skip_bytes;
-    uint8_t *read_buffer;
-};
+/* Choose erase blocks over count sectors (smallest erase size) from add. Sectors with must[i]
+ * set have to be erased; the others may be erased too at cost[i] ms extra, UINT32_MAX meaning
+ * never (NULL must: all of them, NULL cost: never). Aligned blocks are picked so the total
+ * typical time is least, then so the number of commands is. Returns the number of blocks. */
+static int32_t spiErasePlan(struct ch341_ctx *ctx, uint32_t add, uint32_t count, const bool *must, const uint32_t *cost,
+        struct spi_erase_block **plan)
+{
+    const uint32_t sector = ctx->flash.erase[0].size;
+    uint64_t *best = malloc((count + 1) * sizeof(uint64_t));
+    uint32_t *blocks = malloc((count + 1) * sizeof(uint32_t));
+    int8_t *pick = malloc(count + 1);
+    uint64_t time;
+    uint32_t i, j, k, n = 0;
+    bool ok;
+
+    *plan = NULL;
+    if (best == NULL || blocks == NULL || pick == NULL)
+        goto out;
+    best[count] = 0;
+    blocks[count] = 0;
+    for (i = count; i-- > 0; ) {
+        best[i] = UINT64_MAX;
+        blocks[i] = 0;
+        pick[i] = -1;
+        if (must != NULL && !must[i]) { // leave it alone
+            best[i] = best[i + 1];
+            blocks[i] = blocks[i + 1];
+        }
+        for (int t = 0; t < ctx->flash.erase_types; ++t) {
+            k = ctx->flash.erase[t].size / sector;
+            if ((add + i * sector) % ctx->flash.erase[t].size || i + k > count || best[i + k] == UINT64_MAX)
+                continue;
+            time = ctx->flash.erase[t].typ_ms + best[i + k];
+            for (j = i, ok = true; j < i + k && ok; ++j) {
+                if (must == NULL || must[j])
+                    continue;
+                ok = cost != NULL && cost[j] != UINT32_MAX;
+                if (ok)
+                    time += cost[j];
+            }
+            if (ok && (time < best[i] || (time == best[i] && blocks[i + k] + 1 < blocks[i]))) {
+                best[i] = time;
+                blocks[i] = blocks[i + k] + 1;
+                pick[i] = t;
+            }
+        }
+    }
+    if (best[0] == UINT64_MAX || (*plan = malloc((blocks[0] + 1) * sizeof(**plan))) == NULL)
+        goto out;
+    for (i = 0; i < count; ) {
+        if (pick[i] < 0) {
+            i++;
+            continue;
+        }
+        (*plan)[n].add = add + i * sector;
+        (*plan)[n++].type = &ctx->flash.erase[pick[i]];
+        i += ctx->flash.erase[pick[i]].size / sector;
+    }
+out:
+    free(best);
+    free(blocks);
+    free(pick);
+    if (*plan == NULL) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Failed to plan the erase");
+        return -1;
+    }
+    return n;
+}
 
-/* callback for bulk in async transfer */
-void cbBulkIn(struct libusb_transfer *transfer)
-{
-    struct spi_transfer_in *tf = transfer->user_data;
-    switch(transfer->status) {
-        case LIBUSB_TRANSFER_COMPLETED:
-            /* the first package has cmd and address info, so discard 4 bytes */
-            if (tf->read_buffer != NULL) {
-                int i = tf->bulk_count? 0: tf->skip_bytes;
-                for(; i < transfer->actual_length; ++i) {
-                    *tf->read_buffer++ = swapByte(transfer->buffer[i]);
-                }
+/* run the blocks of an erase plan */
+static int32_t spiEraseBlocks(struct ch341_ctx *ctx, const struct spi_erase_block *plan, int32_t count)
+{
+    uint32_t len = 0, done = 0;
+    int32_t ret = 0;
+
+    for (int32_t i = 0; i < count; ++i)
+        len += plan[i].type->size;
+    ch341Log(ctx, CH341_LOG_INFO, "Erasing %u bytes with %d commands", len, count);
+    spiProgress(ctx, CH341_PROGRESS_BEGIN, 0, len);
+    for (int32_t i = 0; i < count && ret == 0; ++i) {
+        spiProgress(ctx, CH341_PROGRESS_UPDATE, done, len);
+        ret = ch341EraseBlock(ctx, plan[i].add, plan[i].type->size);
+        done += plan[i].type->size;
+        if (ctx->stop) { // ch341Stop, e.g. from a ctrl+C handler
+            ctx->stop = 0;
+            if (done < len) {
+                ch341Log(ctx, CH341_LOG_ERROR, "Stopped, erasing unfinished.");
+                ret = -1;
             }
-            tf->bulk_count++;
             break;
-        default:
-            fprintf(stderr, "\ncbBulkIn: error : %d\n", transfer->status);
-            tf->bulk_count = -1;
+        }
     }
-    return;
+    spiProgress(ctx, CH341_PROGRESS_END, done, len);
+    return ret;
 }
 
-/* read the content of SPI device to buf, make sure the buf is big enough before call  */
-int32_t ch341SpiRead(uint8_t *buf, uint32_t add, uint32_t len)
+/* erase [add, add + len) with the fewest, largest aligned blocks that cover exactly that range */
+int32_t ch341EraseRange(struct ch341_ctx *ctx, uint32_t add, uint32_t len)
 {
+    struct spi_erase_block *plan;
+    int32_t ret;
+
+    if (ctx->transport == NULL) return -1;
+    if ((add | len) % ctx->flash.erase[0].size) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Erase range must be aligned to %u bytes", ctx->flash.erase[0].size);
+        return -1;
+    }
+    ret = spiErasePlan(ctx, add, len / ctx->flash.erase[0].size, NULL, NULL, &plan);
+    if (ret < 0) return ret;
+    ret = spiEraseBlocks(ctx, plan, ret);
+    free(plan);
+    return ret;
+}
+
+/* one queued unit of the spi pipeline: a buffer of CH341 packets sent as one or more bulk-out
+ * transfers (a short stream packet must end its transfer), plus the bulk-in packets it produces */
+struct spi_unit {
+    struct spi_pipe *pipe;
+    struct libusb_transfer *xfer[CH341_UNIT_SEGMENTS];
+    uint32_t seg_end[CH341_UNIT_SEGMENTS]; // end offset of every bulk-out transfer in out
+    uint32_t segments;
     uint8_t out[CH341_MAX_PACKET_LEN];
-    uint8_t in[CH341_PACKET_LENGTH];
-    bool fourbyte = (add + len) > (1 << 24);
+    uint8_t in[CH341_MAX_PACKET_LEN];   // raw response, still in ch341 bit order
+    uint32_t out_len;
+    uint32_t in_packets;                // bulk-in packets expected for this unit
+    uint32_t in_expect;                 // bulk-in bytes expected for this unit
+    uint32_t in_done;                   // bulk-in packets received so far
+    uint32_t in_len;                    // bytes received so far
+    uint32_t out_busy;                  // bulk-out transfers still in flight
+    bool stream_open;                   // the last packet is a short stream packet
+    /* filled in by the producer for the consumer */
+    uint8_t *dest;
+    uint32_t skip_bytes;
+    uint32_t len;
+    uint32_t pages;
+    uint32_t page_end[CH341_UNIT_SEGMENTS];  // data offset after every programmed page
+    uint32_t status_at[CH341_UNIT_SEGMENTS]; // response offset of its first status byte
+    uint32_t status_len;                     // status bytes clocked after every page
+    uint64_t trace_id;
+};
 
-    if (devHandle == NULL) return -1;
-    /* what subtracted is: 1. first cs package, 2. leading command for every other packages,
-     * 3. second package contains read flash command and 3 bytes address */
-    const uint32_t max_payload = CH341_MAX_PACKET_LEN - CH341_PACKET_LENGTH
-        - CH341_MAX_PACKETS + 1 - 4 - (fourbyte? 1: 0);
-    uint32_t pkg_len, pkg_count;
-    struct libusb_transfer *xferBulkIn, *xferBulkOut;
-    uint32_t idx = 0;
-    uint32_t ret;
-    int32_t old_counter;
-    struct timeval tv = {0, 100};
-    struct spi_transfer_in bulk_in = {};
+/* a bulk-in request kept in flight by the spi pipeline */
+struct spi_in_req {
+    struct spi_pipe *pipe;
+    struct libusb_transfer *xfer;
+    bool busy;
+    uint8_t buf[CH341_PACKET_LENGTH];
+};
+
+/* Keeps several bulk-out units and CH341_IN_TRANSFERS bulk-in requests queued at once,
+ * so the bus never idles between units. Units are consumed strictly in order. */
+struct spi_pipe {
+    struct ch341_ctx *ctx;
+    const char *name;       // what a unit does, for the trace
+    struct spi_unit *units;
+    uint32_t depth;
+    uint64_t seq_head;      // oldest unit still holding its slot
+    uint64_t seq_rx;        // unit currently receiving bulk-in data
+    uint64_t seq_tail;      // next unit to be produced
+    struct spi_in_req in_req[CH341_IN_TRANSFERS];
+    uint32_t in_busy;
+    uint64_t in_wanted;     // bulk-in packets expected from all submitted units
+    uint64_t in_asked;      // bulk-in requests submitted so far
+    int32_t error;
+    bool fatal;             // the consumer failed, retrying would not help
+    bool stalled;           // a transfer found its endpoint halted
+    uint32_t slack;         // timeout multiplier, doubled on every retry
+    int32_t (*consume)(struct spi_unit *unit);
+    void *user;
+};
+
+/* set how many bulk-out units the read/write engines keep in flight */
+int32_t ch341SetQueueDepth(struct ch341_ctx *ctx, uint32_t depth)
+{
+    if (depth < 1 || depth > CH341_MAX_QUEUE_DEPTH) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Queue depth must be 1-%d", CH341_MAX_QUEUE_DEPTH);
+        return -1;
+    }
+    ctx->queue_depth = depth;
+    return 0;
+}
+
+/* choose the read instruction ch341SpiRead uses */
+int32_t ch341SetReadMode(struct ch341_ctx *ctx, uint32_t mode)
+{
+    if (mode > SPI_READ_FAST) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Unknown read mode %u", mode);
+        return -1;
+    }
+    ctx->read_mode = mode;
+    return 0;
+}
 
-    v_print( 0, len); // verbose
+/* end the current bulk-out transfer of the unit */
+static void spiUnitCut(struct spi_unit *unit)
+{
+    uint32_t start = unit->segments ? unit->seg_end[unit->segments - 1] : 0;
 
-    memset(out, 0xff, CH341_MAX_PACKET_LEN);
-    for (int i = 1; i < CH341_MAX_PACKETS; ++i) // fill CH341A_CMD_SPI_STREAM for every packet
-        out[i * CH341_PACKET_LENGTH] = CH341A_CMD_SPI_STREAM;
-    memset(in, 0x00, CH341_PACKET_LENGTH);
-    xferBulkIn  = libusb_alloc_transfer(0);
-    xferBulkOut = libusb_alloc_transfer(0);
+    if (unit->out_len > start)
+        unit->seg_end[unit->segments++] = unit->out_len;
+    unit->stream_open = false;
+}
+
+/* start a new packet: pad a command packet, or end the transfer after a short stream packet */
+static uint8_t *spiUnitPacket(struct spi_unit *unit)
+{
+    uint32_t start = unit->segments ? unit->seg_end[unit->segments - 1] : 0;
+    uint32_t used = (unit->out_len - start) % CH341_PACKET_LENGTH;
+
+    if (used) {
+        if (unit->stream_open)
+            spiUnitCut(unit);
+        else {
+            memset(unit->out + unit->out_len, 0xff, CH341_PACKET_LENGTH - used);
+            unit->out_len += CH341_PACKET_LENGTH - used;
+        }
+    }
+    unit->stream_open = false;
+    return unit->out + unit->out_len;
+}
+
+/* room left in the unit for n more packets, counting a possible padding packet */
+static bool spiUnitFits(struct spi_unit *unit, uint32_t packets, uint32_t segments)
+{
+    return unit->out_len + (packets + 1) * CH341_PACKET_LENGTH <= CH341_MAX_PACKET_LEN
+        && unit->segments + segments < CH341_UNIT_SEGMENTS;
+}
 
-    printf("Read started!\n");
+/* deassert and re-assert chip-select in one packet, terminating the previous command */
+static void spiUnitCsPluck(struct spi_unit *unit)
+{
+    uint8_t *ptr = spiUnitPacket(unit);
+
+    *ptr++ = CH341A_CMD_UIO_STREAM;
+    *ptr++ = CH341A_CMD_UIO_STM_OUT | 0x37; // deassert
+    *ptr++ = CH341A_CMD_UIO_STM_OUT | 0x37; // keep it high for a few us
+    *ptr++ = CH341A_CMD_UIO_STM_OUT | 0x36; // assert
+    *ptr++ = CH341A_CMD_UIO_STM_DIR | 0x3F; // pin direction
+    *ptr++ = CH341A_CMD_UIO_STM_END;
+    unit->out_len = ptr - unit->out;
+}
+
+/* clock len bytes of data and then clocks more 0xff bytes out to the chip, starting on a fresh packet */
+static void spiUnitStream(struct spi_unit *unit, const uint8_t *data, uint32_t len, uint32_t clocks)
+{
+    uint8_t *ptr = spiUnitPacket(unit);
+    uint32_t n = CH341_PACKET_LENGTH - 1, d;
+
+    len += clocks;
     while (len > 0) {
-        v_print( 1, len); // verbose
-        fflush(stdout);
-        ch341SpiCs(out, true);
-        idx = CH341_PACKET_LENGTH + 1;
-        out[idx++] = swapByte(fourbyte? 0x13: 0x03);
-        if (fourbyte)
-            out[idx++] = swapByte(add >> 24);
-        out[idx++] = swapByte(add >> 16);
-        out[idx++] = swapByte(add >> 8);
-        out[idx++] = swapByte(add);
-        bulk_in.skip_bytes = fourbyte? 5: 4;
-        if (len > max_payload) {
-            pkg_len = CH341_MAX_PACKET_LEN;
-            pkg_count = CH341_MAX_PACKETS - 1;
-            len -= max_payload;
-            add += max_payload;
-        } else {
-            pkg_count = (len + 4) / (CH341_PACKET_LENGTH - 1);
-            if ((len + 4) % (CH341_PACKET_LENGTH - 1)) pkg_count ++;
-            pkg_len = (pkg_count) * CH341_PACKET_LENGTH + ((len + 4) % (CH341_PACKET_LENGTH - 1)) + 1;
-            len = 0;
+        n = (len > CH341_PACKET_LENGTH - 1) ? CH341_PACKET_LENGTH - 1 : len;
+        d = (len > clocks) ? len - clocks : 0; // data bytes left, the rest is clocks
+        if (d > n)
+            d = n;
+        *ptr++ = CH341A_CMD_SPI_STREAM;
+        swapBytes(ptr, data, d);
+        memset(ptr + d, 0xff, n - d);
+        ptr += n;
+        data += d;
+        unit->in_packets++;
+        unit->in_expect += n;
+        len -= n;
+    }
+    unit->out_len = ptr - unit->out;
+    unit->stream_open = (n < CH341_PACKET_LENGTH - 1);
+}
+
+/* hand completed units to the consumer and release the slots nobody uses any more */
+static void spiPipeAdvance(struct spi_pipe *pipe)
+{
+    struct ch341_ctx *ctx = pipe->ctx;
+    struct spi_unit *unit;
+
+    while (pipe->seq_rx < pipe->seq_tail) {
+        unit = &pipe->units[pipe->seq_rx % pipe->depth];
+        if (unit->in_done < unit->in_packets)
+            break;
+        if (!pipe->error && unit->in_len != unit->in_expect) {
+            ch341Log(ctx, CH341_LOG_ERROR, "spiPipeAdvance: short response from device");
+            pipe->error = -1;
         }
-        bulk_in.bulk_count = 0;
-        bulk_in.read_buffer = buf;
-        libusb_fill_bulk_transfer(xferBulkIn, devHandle, BULK_READ_ENDPOINT, in,
-                CH341_PACKET_LENGTH, cbBulkIn, &bulk_in, DEFAULT_TIMEOUT);
-        buf += max_payload; // advance user's pointer
-        libusb_submit_transfer(xferBulkIn);
-        libusb_fill_bulk_transfer(xferBulkOut, devHandle, BULK_WRITE_ENDPOINT, out,
-                pkg_len, cbBulkOut, NULL, DEFAULT_TIMEOUT);
-        libusb_submit_transfer(xferBulkOut);
-        old_counter = bulk_in.bulk_count;
-        while (bulk_in.bulk_count < pkg_count) {
-            libusb_handle_events_timeout(NULL, &tv);
-            if (bulk_in.bulk_count == -1) { // encountered error
-                len = 0;
-                ret = -1;
-                break;
-            }
-            if (old_counter != bulk_in.bulk_count) { // new package came
-                if (bulk_in.bulk_count != pkg_count)
-                    libusb_submit_transfer(xferBulkIn);  // resubmit bulk in request
-                old_counter = bulk_in.bulk_count;
+        if (!pipe->error && pipe->consume && pipe->consume(unit) < 0) {
+            pipe->error = -1;
+            pipe->fatal = true;
+        }
+        if (ctx->trace)
+            traceAsync(ctx, 'e', "spi", pipe->name, unit->trace_id, "in_bytes", unit->in_len, NULL, 0);
+        pipe->seq_rx++;
+    }
+    while (pipe->seq_head < pipe->seq_rx && !pipe->units[pipe->seq_head % pipe->depth].out_busy)
+        pipe->seq_head++;
+}
+
+#define SPI_PACKET_US          165      // clocking one packet at the ~1.5 MHz SPI clock
+#define SPI_TIMEOUT_MIN_MS     50       // usb round trips and scheduling
+#define SPI_TIMEOUT_MARGIN     2
+#define SPI_FLUSH_MS           50       // quiet time that ends a flush of stale responses
+
+/* A transfer of the pipeline waits at most for the units queued up to it to be clocked
+ * through, with room to spare; a stall then costs a few tens of ms, not DEFAULT_TIMEOUT. */
+static uint32_t spiPipeTimeout(struct spi_pipe *pipe)
+{
+    uint64_t packets = 0;
+
+    for (uint64_t seq = pipe->seq_rx; seq < pipe->seq_tail; ++seq)
+        packets += pipe->units[seq % pipe->depth].out_len / CH341_PACKET_LENGTH + 1;
+    return (packets * SPI_PACKET_US * SPI_TIMEOUT_MARGIN / 1000 + SPI_TIMEOUT_MIN_MS) * pipe->slack;
+}
+
+static void LIBUSB_CALL cbBulkIn(struct libusb_transfer *transfer);
+
+/* keep bulk-in requests queued for every packet the submitted units will produce */
+static void spiPipeFeed(struct spi_pipe *pipe)
+{
+    struct ch341_ctx *ctx = pipe->ctx;
+    struct spi_in_req *req;
+
+    for (int i = 0; i < CH341_IN_TRANSFERS && !pipe->error; ++i) {
+        if (pipe->in_asked >= pipe->in_wanted)
+            break;
+        req = &pipe->in_req[i];
+        if (req->busy)
+            continue;
+        libusb_fill_bulk_transfer(req->xfer, NULL, BULK_READ_ENDPOINT, req->buf,
+                CH341_PACKET_LENGTH, cbBulkIn, req, spiPipeTimeout(pipe));
+        if (ctx->transport->submit(ctx, req->xfer) < 0) {
+            ch341Log(ctx, CH341_LOG_ERROR, "spiPipeFeed: failed to submit bulk in request");
+            pipe->error = -1;
+            break;
+        }
+        if (ctx->trace)
+            traceAsync(ctx, 'b', "usb", "bulk in", (uintptr_t)req->xfer, "len", CH341_PACKET_LENGTH, NULL, 0);
+        req->busy = true;
+        pipe->in_busy++;
+        pipe->in_asked++;
+    }
+}
+
+/* callback for bulk out async transfer */
+static void LIBUSB_CALL cbBulkOut(struct libusb_transfer *transfer)
+{
+    struct spi_unit *unit = transfer->user_data;
+    struct ch341_ctx *ctx = unit->pipe->ctx;
+
+    if (ctx->trace)
+        traceAsync(ctx, 'e', "usb", "bulk out", (uintptr_t)transfer, "status", transfer->status, NULL, 0);
+    unit->out_busy--;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !unit->pipe->error)
+            ch341Log(ctx, CH341_LOG_ERROR, "cbBulkOut: error : %d", transfer->status);
+        if (transfer->status == LIBUSB_TRANSFER_STALL)
+            unit->pipe->stalled = true;
+        unit->pipe->error = -1;
+    }
+    spiPipeAdvance(unit->pipe);
+}
+
+/* callback for bulk in async transfer: append the packet to the unit that is receiving */
+static void LIBUSB_CALL cbBulkIn(struct libusb_transfer *transfer)
+{
+    struct spi_in_req *req = transfer->user_data;
+    struct spi_pipe *pipe = req->pipe;
+    struct ch341_ctx *ctx = pipe->ctx;
+    struct spi_unit *unit;
+
+    if (ctx->trace)
+        traceAsync(ctx, 'e', "usb", "bulk in", (uintptr_t)transfer, "status", transfer->status,
+                "actual", transfer->actual_length);
+    req->busy = false;
+    pipe->in_busy--;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !pipe->error)
+            ch341Log(ctx, CH341_LOG_ERROR, "cbBulkIn: error : %d", transfer->status);
+        if (transfer->status == LIBUSB_TRANSFER_STALL)
+            pipe->stalled = true;
+        pipe->error = -1;
+        return;
+    }
+    if (pipe->error)
+        return;
+    unit = &pipe->units[pipe->seq_rx % pipe->depth];
+    if (pipe->seq_rx >= pipe->seq_tail ||
+            unit->in_len + transfer->actual_length > CH341_MAX_PACKET_LEN) {
+        ch341Log(ctx, CH341_LOG_ERROR, "cbBulkIn: unexpected data from device");
+        pipe->error = -1;
+        return;
+    }
+    ctx->stats.in_transfers++;
+    memcpy(unit->in + unit->in_len, transfer->buffer, transfer->actual_length);
+    unit->in_len += transfer->actual_length;
+    unit->in_done++;
+    spiPipeAdvance(pipe);
+    spiPipeFeed(pipe);
+}
+
+static int32_t spiPipeInit(struct ch341_ctx *ctx, struct spi_pipe *pipe, const char *name, uint32_t depth,
+        int32_t (*consume)(struct spi_unit *unit), void *user)
+{
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->ctx = ctx;
+    pipe->name = name;
+    pipe->depth = depth;
+    pipe->consume = consume;
+    pipe->user = user;
+    pipe->slack = 1;
+    pipe->units = calloc(depth, sizeof(struct spi_unit));
+    if (pipe->units == NULL) {
+        ch341Log(ctx, CH341_LOG_ERROR, "spiPipeInit: out of memory");
+        return -1;
+    }
+    for (uint32_t i = 0; i < depth; ++i) {
+        pipe->units[i].pipe = pipe;
+        for (int j = 0; j < CH341_UNIT_SEGMENTS; ++j)
+            if ((pipe->units[i].xfer[j] = libusb_alloc_transfer(0)) == NULL)
+                return -1;
+    }
+    for (int i = 0; i < CH341_IN_TRANSFERS; ++i) {
+        pipe->in_req[i].pipe = pipe;
+        if ((pipe->in_req[i].xfer = libusb_alloc_transfer(0)) == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+static void spiPipeFree(struct spi_pipe *pipe)
+{
+    if (pipe->units == NULL) return;
+    for (uint32_t i = 0; i < pipe->depth; ++i)
+        for (int j = 0; j < CH341_UNIT_SEGMENTS; ++j)
+            libusb_free_transfer(pipe->units[i].xfer[j]);
+    for (int i = 0; i < CH341_IN_TRANSFERS; ++i)
+        libusb_free_transfer(pipe->in_req[i].xfer);
+    free(pipe->units);
+    pipe->units = NULL;
+}
+
+/* wait for a free slot and return it emptied, NULL on error */
+static struct spi_unit *spiPipeGet(struct spi_pipe *pipe)
+{
+    struct ch341_ctx *ctx = pipe->ctx;
+    struct timeval tv = {0, 100};
+    struct spi_unit *unit;
+
+    while (!pipe->error && pipe->seq_tail - pipe->seq_head >= pipe->depth)
+        ctx->transport->handle_events(ctx, &tv);
+    if (pipe->error)
+        return NULL;
+    unit = &pipe->units[pipe->seq_tail % pipe->depth];
+    unit->out_len = unit->segments = unit->in_packets = unit->in_expect = 0;
+    unit->in_done = unit->in_len = unit->pages = 0;
+    unit->stream_open = false;
+    return unit;
+}
+
+/* queue every bulk-out transfer of a unit filled in after spiPipeGet */
+static int32_t spiPipeSubmit(struct spi_pipe *pipe, struct spi_unit *unit)
+{
+    struct ch341_ctx *ctx = pipe->ctx;
+    uint32_t start = 0;
+
+    spiUnitCut(unit);
+    if (unit->segments == 0) // nothing to send, the slot stays free
+        return 0;
+    pipe->seq_tail++;
+    pipe->in_wanted += unit->in_packets;
+    if (ctx->trace) {
+        unit->trace_id = ++ctx->trace_units;
+        traceAsync(ctx, 'b', "spi", pipe->name, unit->trace_id, "out_bytes", unit->out_len, "pages", unit->pages);
+    }
+    for (uint32_t i = 0; i < unit->segments; ++i) {
+        libusb_fill_bulk_transfer(unit->xfer[i], NULL, BULK_WRITE_ENDPOINT, unit->out + start,
+                unit->seg_end[i] - start, cbBulkOut, unit, spiPipeTimeout(pipe));
+        if (ctx->transport->submit(ctx, unit->xfer[i]) < 0) {
+            ch341Log(ctx, CH341_LOG_ERROR, "spiPipeSubmit: failed to submit bulk out transfer");
+            pipe->error = -1;
+            return -1;
+        }
+        if (ctx->trace)
+            traceAsync(ctx, 'b', "usb", "bulk out", (uintptr_t)unit->xfer[i], "len", unit->seg_end[i] - start, NULL, 0);
+        unit->out_busy++;
+        ctx->stats.out_transfers++;
+        start = unit->seg_end[i];
+    }
+    spiPipeFeed(pipe);
+    return 0;
+}
+
+/* wait until every queued unit is consumed; on error cancel whatever is still in flight */
+static int32_t spiPipeDrain(struct spi_pipe *pipe)
+{
+    struct ch341_ctx *ctx = pipe->ctx;
+    struct timeval tv = {0, 100};
+    bool pending;
+
+    while (!pipe->error && pipe->seq_head < pipe->seq_tail)
+        ctx->transport->handle_events(ctx, &tv);
+    do {
+        pending = false;
+        for (uint32_t i = 0; i < pipe->depth; ++i) {
+            if (pipe->units[i].out_busy == 0)
+                continue;
+            for (uint32_t j = 0; j < pipe->units[i].segments; ++j)
+                ctx->transport->cancel(ctx, pipe->units[i].xfer[j]);
+            pending = true;
+        }
+        for (int i = 0; i < CH341_IN_TRANSFERS; ++i) {
+            if (pipe->in_req[i].busy) {
+                ctx->transport->cancel(ctx, pipe->in_req[i].xfer);
+                pending = true;
             }
         }
-        ch341SpiCs(out, false);
-        ret = usbTransfer(__func__, BULK_WRITE_ENDPOINT, out, 3);
-        if (ret < 0) break;
-        if (force_stop == 1) { // user hit ctrl+C
-            force_stop = 0;
-            if (len > 0)
-                fprintf(stderr, "User hit Ctrl+C, reading unfinished.\n");
+        if (pending)
+            ctx->transport->handle_events(ctx, &tv);
+    } while (pending);
+    pipe->seq_head = pipe->seq_rx = pipe->seq_tail;
+    pipe->in_asked = pipe->in_wanted;
+    return pipe->error;
+}
+
+/* release chip-select after the pipeline has left it asserted */
+static int32_t spiCsRelease(struct ch341_ctx *ctx)
+{
+    uint8_t out[CH341_PACKET_LENGTH];
+
+    ch341SpiCs(out, false);
+    return usbTransfer(ctx, __func__, BULK_WRITE_ENDPOINT, out, 3);
+}
+
+/* After spiPipeDrain failed: decide whether to go again from done, the bytes consumed in
+ * order so far, and bring the device back to a known state for it. Up to CH341_RETRIES
+ * attempts are made from the same place, each with longer timeouts. */
+static int32_t spiPipeRetry(struct spi_pipe *pipe, uint32_t add, uint32_t done, uint32_t *mark, uint32_t *tries)
+{
+    struct ch341_ctx *ctx = pipe->ctx;
+    uint8_t buf[CH341_PACKET_LENGTH];
+    int n;
+
+    if (pipe->fatal)
+        return -1;
+    if (done != *mark) { // got further than last time
+        *mark = done;
+        *tries = 0;
+    }
+    if (++*tries > CH341_RETRIES) {
+        ch341Log(ctx, CH341_LOG_ERROR, "%s at 0x%x failed %d times, giving up", pipe->name, add + done, CH341_RETRIES + 1);
+        return -1;
+    }
+    ch341Log(ctx, CH341_LOG_ERROR, "%s at 0x%x failed, retrying (%u of %d)", pipe->name, add + done, *tries, CH341_RETRIES);
+    ctx->stats.retries++;
+    if (pipe->stalled && ctx->transport->clear_halt) {
+        ctx->transport->clear_halt(ctx, BULK_WRITE_ENDPOINT);
+        ctx->transport->clear_halt(ctx, BULK_READ_ENDPOINT);
+    }
+    /* responses to units that were cancelled would be taken for the new ones */
+    for (int i = 0; i < CH341_MAX_PACKETS * CH341_MAX_QUEUE_DEPTH; ++i)
+        if (ctx->transport->bulk(ctx, BULK_READ_ENDPOINT, buf, sizeof(buf), &n, SPI_FLUSH_MS) < 0 || n == 0)
             break;
+    if (spiCsRelease(ctx) < 0)
+        return -1;
+    pipe->error = 0;
+    pipe->stalled = false;
+    pipe->slack = 1u << *tries;
+    return 0;
+}
+
+#define POLL_PACKETS           8        // status packets clocked per polling unit
+
+/* scan the status bytes of a polling unit for BUSY=0 */
+static int32_t spiPollConsume(struct spi_unit *unit)
+{
+    bool *ready = unit->pipe->user;
+
+    for (uint32_t i = unit->skip_bytes; i < unit->in_len && !*ready; ++i)
+        if (!(swapByte(unit->in[i]) & 0x01))
+            *ready = true;
+    return 0;
+}
+
+/* Wait until the chip is no longer busy. A single read status command is sent and the chip
+ * keeps shifting out its status register for as long as chip-select stays low, so whole
+ * packets of status bytes are clocked in and scanned on the host. */
+int32_t ch341WaitReady(struct ch341_ctx *ctx, uint32_t timeout_ms)
+{
+    struct spi_pipe pipe;
+    struct spi_unit *unit;
+    struct timespec start, now;
+    uint8_t cmd = 0x05; // Read status
+    bool ready = false;
+    uint64_t t0 = 0;
+    int32_t ret;
+
+    if (ctx->transport == NULL) return -1;
+    if (ctx->trace)
+        t0 = traceNow();
+    if (spiPipeInit(ctx, &pipe, "poll", 2, spiPollConsume, &ready) < 0) {
+        spiPipeFree(&pipe);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!ready) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 > timeout_ms) {
+            ch341Log(ctx, CH341_LOG_ERROR, "Timeout waiting for the chip to become ready");
+            pipe.error = -1;
+            break;
+        }
+        if ((unit = spiPipeGet(&pipe)) == NULL)
+            break;
+        if (pipe.seq_tail == 0) {
+            spiUnitCsPluck(unit);
+            spiUnitStream(unit, &cmd, 1, POLL_PACKETS * (CH341_PACKET_LENGTH - 1) - 1);
+            unit->skip_bytes = 1;
+        } else {
+            spiUnitStream(unit, NULL, 0, POLL_PACKETS * (CH341_PACKET_LENGTH - 1));
+            unit->skip_bytes = 0;
         }
+        if (spiPipeSubmit(&pipe, unit) < 0)
+            break;
     }
-    libusb_free_transfer(xferBulkIn);
-    libusb_free_transfer(xferBulkOut);
-    v_print(2, 0);
+    ret = spiPipeDrain(&pipe);
+    spiPipeFree(&pipe);
+    if (spiCsRelease(ctx) < 0)
+        ret = -1;
+    if (ctx->trace)
+        traceSpan(ctx, "spi", "wait ready", t0, "units", pipe.seq_tail, NULL, 0);
     return ret;
 }
 
-#define WRITE_PAYLOAD_LENGTH 301 // 301 is the length of a page(256)'s data with protocol overhead
-/* write buffer(*buf) to SPI flash */
-int32_t ch341SpiWrite(uint8_t *buf, uint32_t add, uint32_t len)
+/* where a read goes: the caller's buffer, or a sink fed chunk by chunk */
+struct spi_read_state {
+    int32_t (*sink)(const uint8_t *data, uint32_t len, void *user);
+    void *user;
+    uint32_t done;          // bytes consumed, in address order
+};
+
+/* unpack a finished read unit into the caller's buffer, or in place for the sink */
+static int32_t spiReadConsume(struct spi_unit *unit)
+{
+    struct spi_read_state *st = unit->pipe->user;
+    uint8_t *data = unit->in + unit->skip_bytes;
+
+    if (unit->dest != NULL)
+        swapBytes(unit->dest, data, unit->len);
+    else {
+        swapBytes(data, data, unit->len);
+        if (st->sink(data, unit->len, st->user) < 0)
+            return -1;
+    }
+    st->done += unit->len;
+    return 0;
+}
+
+/* Pick the read instruction. The plain read has no dummy clocks and is the quickest as long
+ * as the bus stays below the chip's plain read frequency; that is only in doubt in double
+ * speed mode, where the fast read takes over. Dual output reads (0x3B) cannot work: in its
+ * double mode the ch341 drives D4/D5 as two outputs, while the chip would answer on IO0. */
+static uint8_t spiReadOp(struct ch341_ctx *ctx, bool fourbyte, uint32_t *dummy)
+{
+    uint8_t fast = fourbyte ? ctx->flash.fast_read4_op : ctx->flash.fast_read_op;
+    bool use_fast = ctx->read_mode == SPI_READ_FAST ||
+            (ctx->read_mode == SPI_READ_AUTO && (ctx->stream_speed & CH341A_STM_SPI_DBL));
+
+    if (use_fast && fast != 0) {
+        *dummy = 1;
+        return fast;
+    }
+    if (use_fast && ctx->read_mode == SPI_READ_FAST)
+        ch341Log(ctx, CH341_LOG_ERROR, "Fast read is not supported with %s addresses, using normal read",
+                fourbyte ? "4-byte" : "3-byte");
+    *dummy = 0;
+    return fourbyte ? ctx->flash.read4_op : ctx->flash.read_op;
+}
+
+/* read into buf, or through st->sink when buf is NULL */
+static int32_t spiRead(struct ch341_ctx *ctx, uint8_t *buf, uint32_t add, uint32_t len, struct spi_read_state *st)
 {
-    uint8_t out[WRITE_PAYLOAD_LENGTH];
-    uint8_t in[CH341_PACKET_LENGTH];
-    uint32_t tmp, pkg_count;
-    struct libusb_transfer *xferBulkIn, *xferBulkOut;
-    uint32_t idx = 0;
-    uint32_t ret;
-    int32_t old_counter;
-    struct timeval tv = {0, 100};
     bool fourbyte = (add + len) > (1 << 24);
-    struct spi_transfer_in bulk_in = { .read_buffer = NULL };
+    uint32_t dummy;
+    const uint8_t op = spiReadOp(ctx, fourbyte, &dummy);
+    const uint32_t header = (fourbyte? 5: 4) + dummy;
+    /* every unit is one cs packet followed by up to 255 stream packets,
+     * the first of which also carries the read command and address */
+    const uint32_t max_payload = (CH341_MAX_PACKETS - 1) * (CH341_PACKET_LENGTH - 1) - header;
+    struct spi_pipe pipe;
+    struct spi_unit *unit;
+    uint8_t cmd[6];
+    uint8_t *const start = buf;
+    const uint32_t total = len, from = add;
+    uint32_t chunk, idx, mark = 0, tries = 0;
+    bool stopped = false;
+    int32_t ret;
 
-    v_print(0, len); // verbose
+    if (ctx->transport == NULL) return -1;
+    if (spiAddrMode(ctx, fourbyte) < 0)
+        return -1;
+    if (spiPipeInit(ctx, &pipe, "read chunk", ctx->queue_depth, spiReadConsume, st) < 0) {
+        spiPipeFree(&pipe);
+        return -1;
+    }
 
-    if (devHandle == NULL) return -1;
-    memset(out, 0xff, WRITE_PAYLOAD_LENGTH);
-    xferBulkIn  = libusb_alloc_transfer(0);
-    xferBulkOut = libusb_alloc_transfer(0);
+    spiProgress(ctx, CH341_PROGRESS_BEGIN, 0, total);
 
-    printf("Write started!\n");
+    ch341Log(ctx, CH341_LOG_INFO, "Read started!");
+again:
     while (len > 0) {
-        v_print(1, len);
-
-        out[0] = 0x06; // Write enable
-        ret = ch341SpiStream(out, in, 1);
-        ch341SpiCs(out, true);
-        idx = CH341_PACKET_LENGTH;
-        out[idx++] = CH341A_CMD_SPI_STREAM;
-        out[idx++] = swapByte(fourbyte? 0x12: 0x02);
+        spiProgress(ctx, CH341_PROGRESS_UPDATE, total - len, total);
+        if ((unit = spiPipeGet(&pipe)) == NULL)
+            break;
+        chunk = (len > max_payload) ? max_payload : len;
+        idx = 0;
+        cmd[idx++] = op;
         if (fourbyte)
-            out[idx++] = swapByte(add >> 24);
-        out[idx++] = swapByte(add >> 16);
-        out[idx++] = swapByte(add >> 8);
-        out[idx++] = swapByte(add);
-
-        tmp = 0;
-        pkg_count = 1;
-
-        while ((idx < WRITE_PAYLOAD_LENGTH) && (len > tmp)) {
-            if (idx % CH341_PACKET_LENGTH == 0) {
-                out[idx++] = CH341A_CMD_SPI_STREAM;
-                pkg_count ++;
-            } else {
-                out[idx++] = swapByte(*buf++);
-                tmp++;
-                if (((add + tmp) & 0xFF) == 0) // cross page boundary
-                    break;
-            }
+            cmd[idx++] = add >> 24;
+        cmd[idx++] = add >> 16;
+        cmd[idx++] = add >> 8;
+        cmd[idx++] = add;
+        if (dummy)
+            cmd[idx++] = 0x00; // 8 dummy clocks, their response is skipped with the header
+        spiUnitCsPluck(unit);
+        spiUnitStream(unit, cmd, header, chunk);
+        unit->skip_bytes = header;
+        unit->dest = buf;
+        unit->len = chunk;
+        if (spiPipeSubmit(&pipe, unit) < 0)
+            break;
+        if (buf != NULL)
+            buf += chunk;
+        add += chunk;
+        len -= chunk;
+        if (ctx->stop) { // ch341Stop, e.g. from a ctrl+C handler
+            ctx->stop = 0;
+            stopped = true;
+            if (len > 0)
+                ch341Log(ctx, CH341_LOG_ERROR, "Stopped, reading unfinished.");
+            break;
         }
-        len -= tmp;
-        add += tmp;
-        bulk_in.bulk_count = 0;
-        libusb_fill_bulk_transfer(xferBulkIn, devHandle, BULK_READ_ENDPOINT, in,
-                CH341_PACKET_LENGTH, cbBulkIn, &bulk_in, DEFAULT_TIMEOUT);
-        libusb_submit_transfer(xferBulkIn);
-        libusb_fill_bulk_transfer(xferBulkOut, devHandle, BULK_WRITE_ENDPOINT, out,
-                idx, cbBulkOut, NULL, DEFAULT_TIMEOUT);
-        libusb_submit_transfer(xferBulkOut);
-        old_counter = bulk_in.bulk_count;
-        ret = 0;
-        while (bulk_in.bulk_count < pkg_count) {
-            libusb_handle_events_timeout(NULL, &tv);
-            if (bulk_in.bulk_count == -1) { // encountered error
-                ret = -1;
+    }
+    ret = spiPipeDrain(&pipe);
+    if (ret < 0 && !stopped && spiPipeRetry(&pipe, from, st->done, &mark, &tries) == 0) {
+        /* go on after the last unit that arrived in one piece */
+        buf = start ? start + st->done : NULL;
+        add = from + st->done;
+        len = total - st->done;
+        goto again;
+    }
+    if (len > 0) // stopped, or the pipeline failed
+        ret = -1;
+    spiPipeFree(&pipe);
+    if (spiCsRelease(ctx) < 0)
+        ret = -1;
+    spiProgress(ctx, CH341_PROGRESS_END, total - len, total);
+    return ret;
+}
+
+/* read the content of SPI device to buf, make sure the buf is big enough before call  */
+int32_t ch341SpiRead(struct ch341_ctx *ctx, uint8_t *buf, uint32_t add, uint32_t len)
+{
+    struct spi_read_state st = { NULL, NULL };
+
+    return spiRead(ctx, buf, add, len, &st);
+}
+
+/* read len bytes from add and hand them to sink in address order, a unit at a time, from
+ * the usb event loop; a negative return from sink stops the read */
+int32_t ch341SpiReadStream(struct ch341_ctx *ctx, uint32_t add, uint32_t len,
+        int32_t (*sink)(const uint8_t *data, uint32_t len, void *user), void *user)
+{
+    struct spi_read_state st = { sink, user };
+
+    return spiRead(ctx, NULL, add, len, &st);
+}
+
+#define PAGE_TRANSFER_US       1500     // sending a page to the chip, for the erase planner
+#define WRITE_POLL_MAX_PACKETS 64
+#define DIFF_WINDOW            (1024 * 1024) // chip bytes a diff write reads, erases and programs at a time
+
+/* progress of a batched write, shared by the producer and the consumer */
+struct spi_write_state {
+    uint32_t poll_packets;  // status packets clocked after every page program
+    uint32_t resume;        // data offset to restart from after an overrun
+    uint32_t done;          // data offset up to which every page is known programmed
+    bool overrun;
+};
+
+/* scan the status bytes clocked after every page of a finished write unit for BUSY=0,
+ * and size the polling window of the following units from where it was found */
+static int32_t spiWriteConsume(struct spi_unit *unit)
+{
+    struct spi_write_state *st = unit->pipe->user;
+    uint32_t need = 0, i, j;
+    bool pending = st->overrun;     // units queued behind an overrun until the rewind
+
+    for (i = 0; i < unit->pages && !st->overrun; ++i) {
+        for (j = 0; j < unit->status_len; ++j)
+            if (!(swapByte(unit->in[unit->status_at[i] + j]) & 0x01))
                 break;
+        if (j == unit->status_len) {
+            /* still busy: the pages queued behind this one may have been ignored by the chip */
+            st->overrun = true;
+            st->resume = unit->page_end[i];
+        } else if ((j + 1) / (CH341_PACKET_LENGTH - 1) + 1 > need)
+            need = (j + 1) / (CH341_PACKET_LENGTH - 1) + 1;
+        st->done = unit->page_end[i];
+    }
+    if (pending)
+        return 0;
+    if (st->overrun) { // once per overrun, the rewind clears it
+        st->poll_packets *= 2;
+        if (st->poll_packets > WRITE_POLL_MAX_PACKETS)
+            st->poll_packets = WRITE_POLL_MAX_PACKETS;
+    } else if (need + 1 < st->poll_packets)
+        st->poll_packets--; // shrink slowly, an overrun costs far more than a spare packet
+    return 0;
+}
+
+/* true if all n bytes are 0xff; reduced a word at a time so the compiler can vectorize it */
+static bool spiIsErased(const uint8_t *p, uint32_t n)
+{
+    uint64_t acc = ~0ULL, w;
+    uint32_t i;
+
+    for (i = 0; i + sizeof(w) <= n; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        acc &= w;
+    }
+    for (; i < n; ++i)
+        acc &= ~0xffULL | p[i];
+    return acc == ~0ULL;
+}
+
+/* program buf to the chip at add, skipping erased pages and pages whose content ref says is
+ * already there; both would leave the chip unchanged. The skipped pages are added to skips. */
+static int32_t spiProgram(struct ch341_ctx *ctx, const uint8_t *buf, uint32_t add, uint32_t len, const uint8_t *ref,
+        uint32_t *skips)
+{
+    bool fourbyte = (add + len) > (1 << 24);
+    /* start with a window just covering the typical page program time */
+    struct spi_write_state st = { .poll_packets = ctx->flash.page_prog_us / SPI_PACKET_US + 2 };
+    struct spi_pipe pipe;
+    struct spi_unit *unit;
+    const uint32_t page = ctx->flash.page_size;
+    uint8_t cmd[5 + CH341_MAX_PAGE_LENGTH];
+    uint32_t off = 0, idx, n, skipped = 0, seen = 0, mark = 0, tries = 0; // seen: high-water mark of off
+    bool stopped = false;
+    int32_t ret;
+
+    if (ctx->transport == NULL) return -1;
+    if (spiAddrMode(ctx, fourbyte) < 0)
+        return -1;
+    if (spiPipeInit(ctx, &pipe, "page program", ctx->queue_depth, spiWriteConsume, &st) < 0) {
+        spiPipeFree(&pipe);
+        return -1;
+    }
+
+    spiProgress(ctx, CH341_PROGRESS_BEGIN, 0, len);
+
+    ch341Log(ctx, CH341_LOG_INFO, "Write started!");
+again:
+    while (off < len) {
+        spiProgress(ctx, CH341_PROGRESS_UPDATE, off, len);
+        if ((unit = spiPipeGet(&pipe)) == NULL)
+            break;
+        /* every page is write enable, page program and a continuous status read; the
+         * status packets are full, so the next write enable shares their transfer */
+        while (off < len && spiUnitFits(unit, page / (CH341_PACKET_LENGTH - 1) + 6 + st.poll_packets, 2)) {
+            n = page - (add + off) % page;
+            if (n > len - off)
+                n = len - off;
+            if (spiIsErased(buf + off, n) || (ref != NULL && memcmp(buf + off, ref + off, n) == 0)) {
+                if (off >= seen) // not counted before a rewind or retry
+                    skipped++;
+                off += n;
+                seen = off > seen ? off : seen;
+                continue;
             }
-            if (old_counter != bulk_in.bulk_count) { // new package came
-                if (bulk_in.bulk_count != pkg_count)
-                    libusb_submit_transfer(xferBulkIn);  // resubmit bulk in request
-                old_counter = bulk_in.bulk_count;
-            }
+            cmd[0] = 0x06; // Write enable
+            spiUnitCsPluck(unit);
+            spiUnitStream(unit, cmd, 1, 0);
+            idx = 0;
+            cmd[idx++] = fourbyte? ctx->flash.prog4_op: ctx->flash.prog_op;
+            if (fourbyte)
+                cmd[idx++] = (add + off) >> 24;
+            cmd[idx++] = (add + off) >> 16;
+            cmd[idx++] = (add + off) >> 8;
+            cmd[idx++] = (add + off);
+            memcpy(cmd + idx, buf + off, n);
+            spiUnitCsPluck(unit);
+            spiUnitStream(unit, cmd, idx + n, 0);
+            cmd[0] = 0x05; // Read status
+            spiUnitCsPluck(unit);
+            unit->status_at[unit->pages] = unit->in_expect + 1;
+            unit->status_len = st.poll_packets * (CH341_PACKET_LENGTH - 1) - 1;
+            spiUnitStream(unit, cmd, 1, unit->status_len);
+            off += n;
+            seen = off > seen ? off : seen;
+            unit->page_end[unit->pages++] = off;
         }
-        if (ret < 0) break;
-        ch341SpiCs(out, false);
-        ret = usbTransfer(__func__, BULK_WRITE_ENDPOINT, out, 3);
-        if (ret < 0) break;
-        out[0] = 0x04; // Write disable
-        ret = ch341SpiStream(out, in, 1);
-        do {
-            ret = ch341ReadStatus();
-            if (ret != 0)
-                libusb_handle_events_timeout(NULL, &tv);
-        } while(ret != 0);
-        if (force_stop == 1) { // user hit ctrl+C
-            force_stop = 0;
-            if (len > 0)
-                fprintf(stderr, "User hit Ctrl+C, writing unfinished.\n");
+        if (spiPipeSubmit(&pipe, unit) < 0)
+            break;
+        if (off == len || ctx->stop)
+            spiPipeDrain(&pipe);
+        if (st.overrun) {
+            /* let the chip finish, then redo everything queued behind the slow page */
+            if (spiPipeDrain(&pipe) < 0 || ch341WaitReady(ctx, ctx->flash.page_prog_max_us / 1000 + DEFAULT_TIMEOUT) < 0)
+                break;
+            off = st.resume;
+            st.overrun = false;
+        }
+        if (ctx->stop) { // ch341Stop, e.g. from a ctrl+C handler
+            ctx->stop = 0;
+            stopped = true;
+            if (off < len)
+                ch341Log(ctx, CH341_LOG_ERROR, "Stopped, writing unfinished.");
             break;
         }
     }
-    libusb_free_transfer(xferBulkIn);
-    libusb_free_transfer(xferBulkOut);
+    ret = spiPipeDrain(&pipe);
+    if (ret < 0 && !stopped && spiPipeRetry(&pipe, add, st.done, &mark, &tries) == 0 &&
+            ch341WaitReady(ctx, ctx->flash.page_prog_max_us / 1000 + DEFAULT_TIMEOUT) == 0) {
+        /* the pages after the last confirmed one may or may not be there, program them again */
+        off = st.done;
+        st.overrun = false;
+        goto again;
+    }
+    if (off < len)
+        ret = -1;
+    spiPipeFree(&pipe);
+    if (spiCsRelease(ctx) < 0 || ch341WaitReady(ctx, ctx->flash.page_prog_max_us / 1000 + DEFAULT_TIMEOUT) < 0)
+        ret = -1;
+
+    if (skips != NULL)
+        *skips += skipped;
+    spiProgress(ctx, CH341_PROGRESS_SKIPPED, skipped, len);
+    spiProgress(ctx, CH341_PROGRESS_END, off, len);
+    return ret;
+}
+
+/* write buffer(*buf) to SPI flash */
+int32_t ch341SpiWrite(struct ch341_ctx *ctx, const uint8_t *buf, uint32_t add, uint32_t len)
+{
+    return spiProgram(ctx, buf, add, len, NULL, NULL);
+}
+
+/* Write only what differs from the chip, a window of DIFF_WINDOW bytes at a time: read the
+ * sectors of the window the image covers, erase those where some bit has to go from 0 back to
+ * 1, then program just the pages that are not already there. Data outside the image but
+ * inside an erased sector is preserved. */
+int32_t ch341SpiDiffWrite(struct ch341_ctx *ctx, const uint8_t *buf, uint32_t add, uint32_t len)
+{
+    const uint32_t sector = ctx->flash.erase[0].size, page = ctx->flash.page_size;
+    const uint64_t stop = ((uint64_t)add + len + sector - 1) / sector * sector;
+    uint64_t ws, we, is, ie, bs, be;
+    uint32_t window = DIFF_WINDOW, count, changed = 0, sectors = 0, erased = 0, skipped = 0, sec, i, j;
+    ch341_progress_fn progress = ctx->progress;
+    int32_t level = ctx->log_level;
+    struct spi_erase_block *plan = NULL;
+    uint8_t *old, t;
+    uint32_t *cost;
+    bool *must, dirty, programmed;
+    int32_t ret = -1, blocks;
+
+    if (ctx->transport == NULL) return -1;
+    if (ctx->flash.erase[ctx->flash.erase_types - 1].size > window)
+        window = ctx->flash.erase[ctx->flash.erase_types - 1].size;
+    old = malloc(window);
+    must = malloc(window / sector * sizeof(bool));
+    cost = malloc(window / sector * sizeof(uint32_t));
+    if (old == NULL || must == NULL || cost == NULL) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Malloc failed for diff write buffers.");
+        goto out;
+    }
 
-    v_print(2, 0);
+    spiProgress(ctx, CH341_PROGRESS_BEGIN, 0, len);
+    /* the reads and programs of the windows would each report as an operation of their own */
+    ctx->progress = NULL;
+    if (ctx->log_level > CH341_LOG_ERROR)
+        ctx->log_level = CH341_LOG_ERROR;
+    /* windows are aligned in chip addresses, so the larger erase blocks stay whole */
+    for (ws = add - add % sector; ws < stop; ws = we) {
+        we = (ws / window + 1) * window;
+        if (we > stop)
+            we = stop;
+        is = ws > add ? ws : add;
+        ie = we < (uint64_t)add + len ? we : (uint64_t)add + len;
+        count = (we - ws) / sector;
+        if (ch341SpiRead(ctx, old, ws, we - ws) < 0)
+            goto done;
+
+        /* sectors where a bit has to go from 0 back to 1 must be erased; the others may be
+         * swept into a larger block when reprogramming their pages is cheaper */
+        dirty = false;
+        for (sec = 0; sec < count; ++sec) {
+            bs = ws + sec * sector > is ? ws + sec * sector : is;
+            be = ws + (sec + 1) * sector < ie ? ws + (sec + 1) * sector : ie;
+            if (bs < be && memcmp(old + (bs - ws), buf + (bs - add), be - bs) != 0) {
+                changed++;
+                dirty = true;
+            }
+            must[sec] = false;
+            cost[sec] = 0;
+            for (i = sec * sector; i < (sec + 1) * sector; i += page) {
+                for (j = i, programmed = false; j < i + page; ++j) {
+                    t = (ws + j >= is && ws + j < ie) ? buf[ws + j - add] : old[j];
+                    programmed |= t != 0xff;
+                    if (t & ~old[j])
+                        must[sec] = true;
+                }
+                if (programmed)
+                    cost[sec] += ctx->flash.page_prog_us + PAGE_TRANSFER_US;
+            }
+            cost[sec] /= 1000;
+        }
+        sectors += count;
+        if ((blocks = spiErasePlan(ctx, ws, count, must, cost, &plan)) < 0)
+            goto done;
+        if (blocks > 0 && spiEraseBlocks(ctx, plan, blocks) < 0)
+            goto done;
+        /* what an erased block held outside the image goes back first */
+        for (int32_t b = 0; b < blocks; ++b) {
+            bs = plan[b].add;
+            be = bs + plan[b].type->size;
+            erased += plan[b].type->size;
+            if (bs < is && spiProgram(ctx, old + (bs - ws), bs, (be < is ? be : is) - bs, NULL, &skipped) < 0)
+                goto done;
+            if (be > ie && spiProgram(ctx, old + ((bs > ie ? bs : ie) - ws), bs > ie ? bs : ie,
+                        be - (bs > ie ? bs : ie), NULL, &skipped) < 0)
+                goto done;
+            memset(old + (bs - ws), 0xff, plan[b].type->size);
+        }
+        free(plan);
+        plan = NULL;
+        if (dirty && spiProgram(ctx, buf + (is - add), is, ie - is, old + (is - ws), &skipped) < 0)
+            goto done;
+        if (progress)
+            progress(ctx->progress_user, CH341_PROGRESS_UPDATE, ie - add, len);
+    }
+    ret = 0;
+done:
+    ctx->progress = progress;
+    ctx->log_level = level;
+    ch341Log(ctx, CH341_LOG_INFO, "%u of %u sectors changed, erased %u bytes", changed, sectors, erased);
+    spiProgress(ctx, CH341_PROGRESS_SKIPPED, skipped, len);
+    spiProgress(ctx, CH341_PROGRESS_END, ret == 0 ? len : 0, len);
+out:
+    free(plan);
+    free(old);
+    free(must);
+    free(cost);
     return ret;
 }
 
 /* read status register 2 (needed for lock bit checking) */
-int32_t ch341ReadStatus2(void)
+int32_t ch341ReadStatus2(struct ch341_ctx *ctx)
 {
     uint8_t out[2];
     uint8_t in[2];
     int32_t ret;
 
-    if (devHandle == NULL) return -1;
+    if (ctx->transport == NULL) return -1;
     out[0] = 0x35; // Read status register 2
     out[1] = 0x00;
-    ret = ch341SpiStream(out, in, 2);
+    ret = ch341SpiStream(ctx, out, in, 2);
     if (ret < 0) return ret;
     return (in[1]);
 }
 
 /* write status register 2 (used for setting lock bits) */
-int32_t ch341WriteStatus2(uint8_t status)
+int32_t ch341WriteStatus2(struct ch341_ctx *ctx, uint8_t status)
 {
     uint8_t out[2];
     uint8_t in[2];
     int32_t ret;
 
-    if (devHandle == NULL) return -1;
+    if (ctx->transport == NULL) return -1;
     out[0] = 0x06; // Write enable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
     out[0] = 0x31; // Write status register 2
     out[1] = status;
-    ret = ch341SpiStream(out, in, 2);
+    ret = ch341SpiStream(ctx, out, in, 2);
     if (ret < 0) return ret;
     out[0] = 0x04; // Write disable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
     return 0;
 }
 
+/* the chip database says which parts have the 0x48/0x42/0x44 security registers */
+static int32_t spiSecRegCheck(struct ch341_ctx *ctx, uint8_t page)
+{
+    if (ctx->flash.secreg_pages == 0) {
+        ch341Log(ctx, CH341_LOG_ERROR, "%s has no W25Q-style security registers", ctx->flash.name ? ctx->flash.name : "This chip");
+        return -1;
+    }
+    if (page > ctx->flash.secreg_pages) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Security register page must be 0-%u", ctx->flash.secreg_pages);
+        return -1;
+    }
+    return 0;
+}
+
 /* read 256 bytes from a security register page (0-3)
  * W25Q command 0x48: opcode + 24-bit addr + 8 dummy clocks + data
  * Address format: page number in bits [15:8], byte offset in bits [7:0]
  * So page 1 = address 0x001000, page 2 = 0x002000, page 3 = 0x003000 */
-int32_t ch341ReadSecReg(uint8_t page, uint8_t *buf)
+int32_t ch341ReadSecReg(struct ch341_ctx *ctx, uint8_t page, uint8_t *buf)
 {
     uint8_t out[261]; // 1 cmd + 3 addr + 1 dummy + 256 data = 261
     uint8_t in[261];
     int32_t ret;
     uint32_t addr;
 
-    if (devHandle == NULL) return -1;
-    if (page > 3) {
-        fprintf(stderr, "Security register page must be 0-3\n");
+    if (ctx->transport == NULL) return -1;
+    if (spiSecRegCheck(ctx, page) < 0)
         return -1;
-    }
 
     addr = page << 12; // page 1 -> 0x001000, page 2 -> 0x002000, page 3 -> 0x003000
 
@@ -638,7 +1978,7 @@ int32_t ch341ReadSecReg(uint8_t page, uint8_t *buf)
     out[3] = addr & 0xFF;
     out[4] = 0x00; // 8 dummy clocks
 
-    ret = ch341SpiStream(out, in, 261);
+    ret = ch341SpiStream(ctx, out, in, 261);
     if (ret < 0) return ret;
 
     memcpy(buf, &in[5], 256); // skip cmd + addr + dummy
@@ -647,43 +1987,35 @@ int32_t ch341ReadSecReg(uint8_t page, uint8_t *buf)
 
 /* erase a security register page (0-3)
  * W25Q command 0x44: write-enable + opcode + 24-bit addr */
-int32_t ch341EraseSecReg(uint8_t page)
+int32_t ch341EraseSecReg(struct ch341_ctx *ctx, uint8_t page)
 {
     uint8_t out[4];
     uint8_t in[4];
     int32_t ret;
     uint32_t addr;
-    struct timeval tv = {0, 100};
 
-    if (devHandle == NULL) return -1;
-    if (page > 3) {
-        fprintf(stderr, "Security register page must be 0-3\n");
+    if (ctx->transport == NULL) return -1;
+    if (spiSecRegCheck(ctx, page) < 0)
         return -1;
-    }
 
     addr = page << 12;
 
     out[0] = 0x06; // Write enable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
 
     out[0] = 0x44; // Erase Security Register
     out[1] = (addr >> 16) & 0xFF;
     out[2] = (addr >> 8) & 0xFF;
     out[3] = addr & 0xFF;
-    ret = ch341SpiStream(out, in, 4);
+    ret = ch341SpiStream(ctx, out, in, 4);
     if (ret < 0) return ret;
 
-    // Poll BUSY bit
-    do {
-        ret = ch341ReadStatus();
-        if (ret < 0) return ret;
-        if (ret != 0)
-            libusb_handle_events_timeout(NULL, &tv);
-    } while (ret != 0);
+    ret = ch341WaitReady(ctx, ctx->flash.erase[0].max_ms + DEFAULT_TIMEOUT);
+    if (ret < 0) return ret;
 
     out[0] = 0x04; // Write disable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
 
     return 0;
@@ -692,28 +2024,25 @@ int32_t ch341EraseSecReg(uint8_t page)
 /* write data to a security register page (0-3)
  * W25Q command 0x42: write-enable + opcode + 24-bit addr + data (up to 256 bytes)
  * NOTE: page must be erased first, and bits can only go 1->0 */
-int32_t ch341WriteSecReg(uint8_t page, uint8_t *buf, uint32_t len)
+int32_t ch341WriteSecReg(struct ch341_ctx *ctx, uint8_t page, uint8_t *buf, uint32_t len)
 {
     uint8_t out[260]; // 1 cmd + 3 addr + 256 data max
     uint8_t in[260];
     int32_t ret;
     uint32_t addr;
-    struct timeval tv = {0, 100};
 
-    if (devHandle == NULL) return -1;
-    if (page > 3) {
-        fprintf(stderr, "Security register page must be 0-3\n");
+    if (ctx->transport == NULL) return -1;
+    if (spiSecRegCheck(ctx, page) < 0)
         return -1;
-    }
     if (len > 256) {
-        fprintf(stderr, "Security register page size is 256 bytes max\n");
+        ch341Log(ctx, CH341_LOG_ERROR, "Security register page size is 256 bytes max");
         return -1;
     }
 
     addr = page << 12;
 
     out[0] = 0x06; // Write enable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
 
     out[0] = 0x42; // Program Security Register
@@ -722,19 +2051,14 @@ int32_t ch341WriteSecReg(uint8_t page, uint8_t *buf, uint32_t len)
     out[3] = addr & 0xFF;
     memcpy(&out[4], buf, len);
 
-    ret = ch341SpiStream(out, in, 4 + len);
+    ret = ch341SpiStream(ctx, out, in, 4 + len);
     if (ret < 0) return ret;
 
-    // Poll BUSY bit
-    do {
-        ret = ch341ReadStatus();
-        if (ret < 0) return ret;
-        if (ret != 0)
-            libusb_handle_events_timeout(NULL, &tv);
-    } while (ret != 0);
+    ret = ch341WaitReady(ctx, ctx->flash.page_prog_max_us / 1000 + DEFAULT_TIMEOUT);
+    if (ret < 0) return ret;
 
     out[0] = 0x04; // Write disable
-    ret = ch341SpiStream(out, in, 1);
+    ret = ch341SpiStream(ctx, out, in, 1);
     if (ret < 0) return ret;
 
     return 0;
@@ -20,18 +20,33 @@
 #ifndef __CH341_H__
 #define __CH341_H__
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <signal.h>
+#include "chipdb.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 #define     DEFAULT_TIMEOUT        1000     // 1000mS for USB timeouts
+#define     CH341_RETRIES          3        // restarts of a read or write from the same place
 #define     BULK_WRITE_ENDPOINT    0x02
 #define     BULK_READ_ENDPOINT     0x82
 
 #define     CH341_PACKET_LENGTH    0x20
 #define     CH341_MAX_PACKETS      256
 #define     CH341_MAX_PACKET_LEN   (CH341_PACKET_LENGTH * CH341_MAX_PACKETS)
+#define     CH341_QUEUE_DEPTH      4        // bulk-out units kept in flight by default
+#define     CH341_MAX_QUEUE_DEPTH  16
+#define     CH341_IN_TRANSFERS     32       // bulk-in requests kept in flight
+#define     CH341_UNIT_SEGMENTS    32       // bulk-out transfers a queued unit may be split into
+#define     CH341_MAX_ERASE_TYPES  4
+#define     CH341_MAX_PAGE_LENGTH  1024
 #define     CH341A_USB_VENDOR      0x1A86
 #define     CH341A_USB_PRODUCT     0x5512
+#define     CH341_PATH_LENGTH      32       // "bus-port.port..." of a device
+#define     CH341_MAX_DEVICES      16
 
 #define     CH341A_CMD_SET_OUTPUT  0xA1
 #define     CH341A_CMD_IO_ADDR     0xA2
@@ -64,22 +79,152 @@ extern "C" {
 #define     CH341A_STM_I2C_750K    0x03
 #define     CH341A_STM_SPI_DBL     0x04
 
-int32_t usbTransfer(const char * func, uint8_t type, uint8_t* buf, int len);
-int32_t ch341Configure(uint16_t vid, uint16_t pid);
-int32_t ch341SetStream(uint32_t speed);
-int32_t ch341SpiStream(uint8_t *out, uint8_t *in, uint32_t len);
-int32_t ch341SpiCapacity(void);
-int32_t ch341SpiRead(uint8_t *buf, uint32_t add, uint32_t len);
-int32_t ch341ReadStatus(void);
-int32_t ch341WriteStatus(uint8_t status);
-int32_t ch341EraseChip(void);
-int32_t ch341SpiWrite(uint8_t *buf, uint32_t add, uint32_t len);
-int32_t ch341Release(void);
-int32_t ch341ReadSecReg(uint8_t page, uint8_t *buf);
-int32_t ch341WriteSecReg(uint8_t page, uint8_t *buf, uint32_t len);
-int32_t ch341EraseSecReg(uint8_t page);
-int32_t ch341ReadStatus2(void);
-int32_t ch341WriteStatus2(uint8_t status);
+#define     SPI_READ_AUTO          0        // fast read when the bus runs at double speed
+#define     SPI_READ_NORMAL        1        // 0x03/0x13, no dummy clocks
+#define     SPI_READ_FAST          2        // 0x0B/0x0C, 8 dummy clocks
+
+/* an erase command of the chip; the typical time drives the erase planner */
+struct spi_erase_type {
+    uint32_t size;
+    uint8_t opcode;             // 3-byte address opcode
+    uint8_t opcode4;            // 4-byte address opcode
+    uint32_t typ_ms;
+    uint32_t max_ms;
+};
+
+/* a fast read instruction described by SFDP: opcode plus wait states */
+struct spi_fast_read {
+    uint8_t opcode;             // 0 if not supported
+    uint8_t dummy_clocks;
+    uint8_t mode_clocks;
+};
+
+/* Geometry, commands and timings of the attached chip. The defaults suit common
+ * 25-series parts; ch341SpiCapacity replaces them with the chip database entry or,
+ * for unlisted parts, with what SFDP reports. */
+struct spi_flash_info {
+    const char *name;           // chip database name, NULL if not listed
+    uint32_t jedec_id;          // manufacturer << 16 | memory type << 8 | capacity
+    uint32_t capacity;          // bytes, 0 if unknown
+    uint32_t page_size;
+    uint32_t page_prog_us;      // typical page program time
+    uint32_t page_prog_max_us;
+    uint32_t chip_erase_ms;     // typical chip erase time
+    uint32_t chip_erase_max_ms;
+    uint8_t addr_mode;          // SPI_ADDR_*
+    uint8_t read_op;
+    uint8_t read4_op;
+    uint8_t fast_read_op;       // 0 if not supported
+    uint8_t fast_read4_op;
+    uint8_t prog_op;
+    uint8_t prog4_op;
+    struct spi_fast_read fast_read_112, fast_read_122, fast_read_114, fast_read_144;
+    struct spi_erase_type erase[CH341_MAX_ERASE_TYPES]; // smallest first
+    uint32_t erase_types;
+    uint8_t secreg_pages;       // W25Q-style security register pages, 0 if none
+    uint16_t secreg_size;
+    bool sfdp;                  // filled from the SFDP tables
+};
+
+struct libusb_transfer;
+struct timeval;
+struct ch341_ctx;
+struct ch341_trace;
+
+/* Moves packets between the engines and a ch341. Calls follow the libusb conventions
+ * (LIBUSB_ERROR_* results, transfers completed from handle_events); the default one is
+ * libusb itself, ch341sim.c provides a simulated programmer with a chip. Its state
+ * hangs off ctx->priv. */
+struct ch341_transport {
+    const char *name;
+    int (*bulk)(struct ch341_ctx *ctx, uint8_t ep, uint8_t *buf, int len, int *transferred, uint32_t timeout);
+    int (*submit)(struct ch341_ctx *ctx, struct libusb_transfer *xfer);
+    int (*cancel)(struct ch341_ctx *ctx, struct libusb_transfer *xfer);
+    int (*handle_events)(struct ch341_ctx *ctx, struct timeval *tv);
+    int (*clear_halt)(struct ch341_ctx *ctx, uint8_t ep);
+    void (*release)(struct ch341_ctx *ctx);
+};
+
+/* usb transfers completed or submitted since the counters were last cleared */
+struct ch341_stats {
+    uint64_t out_transfers;
+    uint64_t in_transfers;
+    uint64_t retries;           // times a pipelined operation was restarted after a failure
+};
+
+#define     CH341_LOG_ERROR        0
+#define     CH341_LOG_INFO         1        // what the engines are doing, chip details
+
+/* one line of text, without the newline */
+typedef void (*ch341_log_fn)(void *user, int32_t level, const char *msg);
+
+#define     CH341_PROGRESS_BEGIN   0        // total bytes the operation covers
+#define     CH341_PROGRESS_UPDATE  1        // done of total bytes
+#define     CH341_PROGRESS_END     2
+#define     CH341_PROGRESS_SKIPPED 3        // done is the count of pages that needed no programming
+
+typedef void (*ch341_progress_fn)(void *user, uint32_t event, uint32_t done, uint32_t total);
+
+/* One programmer and the chip on it. Every function takes the context it works on;
+ * calls on one context must not overlap, different contexts are independent and may
+ * be driven from threads of their own. The library itself never prints: messages go
+ * to the log callback, progress to the progress callback, both from the calling thread. */
+struct ch341_ctx {
+    const struct ch341_transport *transport;    // NULL until configured
+    void *priv;                 // transport state
+    struct spi_flash_info flash;
+    struct ch341_stats stats;
+    uint32_t queue_depth;
+    uint32_t stream_speed;
+    uint32_t read_mode;
+    bool addr4;                 // an SPI_ADDR_EN4B chip was switched to 4-byte addresses
+    volatile sig_atomic_t stop; // set by ch341Stop, ends a long operation early
+    struct ch341_trace *trace;  // NULL unless ch341TraceOpen
+    uint64_t trace_units;
+    ch341_log_fn log;
+    void *log_user;
+    int32_t log_level;          // highest CH341_LOG_* passed on
+    ch341_progress_fn progress;
+    void *progress_user;
+};
+
+struct ch341_ctx *ch341New(void);
+void ch341Free(struct ch341_ctx *ctx);
+void ch341SetLog(struct ch341_ctx *ctx, ch341_log_fn log, void *user, int32_t level);
+void ch341SetProgress(struct ch341_ctx *ctx, ch341_progress_fn progress, void *user);
+void ch341Stop(struct ch341_ctx *ctx);
+void ch341Log(struct ch341_ctx *ctx, int32_t level, const char *fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+
+int32_t usbTransfer(struct ch341_ctx *ctx, const char * func, uint8_t type, uint8_t* buf, int len);
+int32_t ch341Configure(struct ch341_ctx *ctx, uint16_t vid, uint16_t pid);
+int32_t ch341ConfigurePath(struct ch341_ctx *ctx, uint16_t vid, uint16_t pid, const char *path);
+int32_t ch341DevicePath(struct ch341_ctx *ctx, char *path, size_t size);
+int32_t ch341List(uint16_t vid, uint16_t pid, char (*paths)[CH341_PATH_LENGTH], uint32_t max);
+int32_t ch341Attach(struct ch341_ctx *ctx, const struct ch341_transport *t, void *priv);
+int32_t ch341SetStream(struct ch341_ctx *ctx, uint32_t speed);
+int32_t ch341SpiStream(struct ch341_ctx *ctx, uint8_t *out, uint8_t *in, uint32_t len);
+int32_t ch341SpiCapacity(struct ch341_ctx *ctx);
+int32_t ch341ReadSfdp(struct ch341_ctx *ctx);
+int32_t ch341SetQueueDepth(struct ch341_ctx *ctx, uint32_t depth);
+int32_t ch341SetReadMode(struct ch341_ctx *ctx, uint32_t mode);
+int32_t ch341SpiRead(struct ch341_ctx *ctx, uint8_t *buf, uint32_t add, uint32_t len);
+int32_t ch341SpiReadStream(struct ch341_ctx *ctx, uint32_t add, uint32_t len,
+        int32_t (*sink)(const uint8_t *data, uint32_t len, void *user), void *user);
+int32_t ch341ReadStatus(struct ch341_ctx *ctx);
+int32_t ch341WaitReady(struct ch341_ctx *ctx, uint32_t timeout_ms);
+int32_t ch341WriteStatus(struct ch341_ctx *ctx, uint8_t status);
+int32_t ch341EraseChip(struct ch341_ctx *ctx);
+int32_t ch341EraseBlock(struct ch341_ctx *ctx, uint32_t add, uint32_t size);
+int32_t ch341EraseRange(struct ch341_ctx *ctx, uint32_t add, uint32_t len);
+int32_t ch341SpiWrite(struct ch341_ctx *ctx, const uint8_t *buf, uint32_t add, uint32_t len);
+int32_t ch341SpiDiffWrite(struct ch341_ctx *ctx, const uint8_t *buf, uint32_t add, uint32_t len);
+int32_t ch341Release(struct ch341_ctx *ctx);
+int32_t ch341ReadSecReg(struct ch341_ctx *ctx, uint8_t page, uint8_t *buf);
+int32_t ch341WriteSecReg(struct ch341_ctx *ctx, uint8_t page, uint8_t *buf, uint32_t len);
+int32_t ch341EraseSecReg(struct ch341_ctx *ctx, uint8_t page);
+int32_t ch341ReadStatus2(struct ch341_ctx *ctx);
+int32_t ch341WriteStatus2(struct ch341_ctx *ctx, uint8_t status);
 uint8_t swapByte(uint8_t c);
 
 #ifdef __cplusplus
@@ -0,0 +1,248 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "ch341a.h"
+#include "ch341bench.h"
+#include "bitrev.h"
+
+#define BENCH_REGION        65536       // bytes erased and programmed
+#define BENCH_READ_BYTES    (512 * 1024)
+#define BENCH_ROUND_TRIPS   200
+#define BENCH_MAX_SAMPLES   2048
+#define BENCH_BITREV_ROUNDS 64          // passes over the read buffer per bit reverse kernel
+
+/* timings of one operation of the matrix */
+struct bench_run {
+    struct ch341_ctx *ctx;
+    const char *op;
+    uint32_t size;          // bytes per call
+    uint32_t calls;
+    uint64_t bytes;
+    uint64_t start;
+    uint64_t lat[BENCH_MAX_SAMPLES]; // ns per call
+};
+
+static uint64_t benchNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int benchCompare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void benchBegin(struct bench_run *run, const char *op, uint32_t size)
+{
+    run->op = op;
+    run->size = size;
+    run->calls = 0;
+    run->bytes = 0;
+    memset(&run->ctx->stats, 0, sizeof(run->ctx->stats));
+    run->start = benchNow();
+}
+
+static void benchSample(struct bench_run *run, uint64_t t0, uint32_t bytes)
+{
+    if (run->calls < BENCH_MAX_SAMPLES)
+        run->lat[run->calls++] = benchNow() - t0;
+    run->bytes += bytes;
+}
+
+/* one JSON object per line: throughput, latency percentiles and usb transfers per KB */
+static void benchReport(FILE *out, struct bench_run *run, uint32_t speed)
+{
+    double secs = (benchNow() - run->start) / 1e9;
+    uint64_t xfers = run->ctx->stats.out_transfers + run->ctx->stats.in_transfers;
+    uint32_t n = run->calls;
+
+    qsort(run->lat, n, sizeof(run->lat[0]), benchCompare);
+    fprintf(out, "{\"op\":\"%s\",\"turbo\":%u,\"double\":%u,\"size\":%u,\"calls\":%u,"
+            "\"bytes\":%llu,\"seconds\":%.6f,\"mb_s\":%.4f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+            "\"xfers_per_kb\":%.3f}\n",
+            run->op, speed & 3, (speed & CH341A_STM_SPI_DBL) ? 1 : 0, run->size, n,
+            (unsigned long long)run->bytes, secs, secs > 0 ? run->bytes / secs / 1e6 : 0.0,
+            n ? run->lat[(n - 1) * 50 / 100] / 1e3 : 0.0, n ? run->lat[(n - 1) * 99 / 100] / 1e3 : 0.0,
+            run->bytes ? xfers * 1024.0 / run->bytes : 0.0);
+    fflush(out);
+}
+
+/* host side only: bit reversal of a read sized buffer with the per byte table and with every
+ * bulk kernel this cpu runs */
+static void benchBitrev(FILE *out, uint8_t *buf)
+{
+    uint64_t t0, ns;
+    uint32_t k, r, i;
+
+    for (k = 0; k <= bitrevKernelCount; ++k) {
+        if (k < bitrevKernelCount && bitrevKernels[k].supported && !bitrevKernels[k].supported())
+            continue;
+        t0 = benchNow();
+        for (r = 0; r < BENCH_BITREV_ROUNDS; ++r) {
+            if (k == bitrevKernelCount)
+                for (i = 0; i < BENCH_READ_BYTES; ++i)
+                    buf[i] = swapByte(buf[i]);
+            else
+                bitrevKernels[k].swap(buf, buf, BENCH_READ_BYTES);
+        }
+        ns = benchNow() - t0;
+        fprintf(out, "{\"op\":\"bitrev\",\"kernel\":\"%s\",\"size\":%u,\"calls\":%u,\"seconds\":%.6f,"
+                "\"mb_s\":%.1f}\n", k < bitrevKernelCount ? bitrevKernels[k].name : "table",
+                BENCH_READ_BYTES, BENCH_BITREV_ROUNDS, ns / 1e9,
+                ns ? (double)BENCH_READ_BYTES * BENCH_BITREV_ROUNDS / ns * 1e3 : 0.0);
+    }
+}
+
+/* the matrix at one bus setting; the region at add is left programmed with pattern */
+static int32_t benchSpeed(FILE *out, struct bench_run *run, uint32_t speed, uint32_t add,
+        uint8_t *buf, const uint8_t *pattern)
+{
+    static const uint32_t chunks[] = { 256, 4096, 65536, 524288 };
+    struct ch341_ctx *ctx = run->ctx;
+    const uint32_t total = ctx->flash.capacity < BENCH_READ_BYTES ? ctx->flash.capacity : BENCH_READ_BYTES;
+    const uint32_t sector = ctx->flash.erase[0].size, page = ctx->flash.page_size;
+    uint8_t cmd[4] = { 0x9F, 0, 0, 0 }, in[4];
+    uint64_t t0;
+
+    if (ch341SetStream(ctx, speed) < 0)
+        return -1;
+
+    for (uint32_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]) && chunks[c] <= total; ++c) {
+        benchBegin(run, "read", chunks[c]);
+        for (uint32_t off = 0; off < total; off += chunks[c]) {
+            t0 = benchNow();
+            if (ch341SpiRead(ctx, buf, off, chunks[c]) < 0)
+                return -1;
+            benchSample(run, t0, chunks[c]);
+        }
+        benchReport(out, run, speed);
+    }
+
+    benchBegin(run, "spi_stream", sizeof(cmd));
+    for (int i = 0; i < BENCH_ROUND_TRIPS; ++i) {
+        t0 = benchNow();
+        if (ch341SpiStream(ctx, cmd, in, sizeof(cmd)) < 0)
+            return -1;
+        benchSample(run, t0, sizeof(cmd));
+    }
+    benchReport(out, run, speed);
+
+    benchBegin(run, "status_poll", 2);
+    for (int i = 0; i < BENCH_ROUND_TRIPS; ++i) {
+        t0 = benchNow();
+        if (ch341ReadStatus(ctx) < 0)
+            return -1;
+        benchSample(run, t0, 2);
+    }
+    benchReport(out, run, speed);
+
+    benchBegin(run, "sector_erase", sector);
+    for (uint32_t off = 0; off < BENCH_REGION; off += sector) {
+        t0 = benchNow();
+        if (ch341EraseBlock(ctx, add + off, sector) < 0)
+            return -1;
+        benchSample(run, t0, sector);
+    }
+    benchReport(out, run, speed);
+
+    /* one call per page: the latency of a single program and its status poll */
+    benchBegin(run, "page_program", page);
+    for (uint32_t off = 0; off < BENCH_REGION && run->calls < 256; off += page) {
+        t0 = benchNow();
+        if (ch341SpiWrite(ctx, pattern + off, add + off, page) < 0)
+            return -1;
+        benchSample(run, t0, page);
+    }
+    benchReport(out, run, speed);
+
+    /* the whole region in one call: what the batched write engine sustains */
+    if (ch341EraseRange(ctx, add, BENCH_REGION) < 0)
+        return -1;
+    benchBegin(run, "program", BENCH_REGION);
+    t0 = benchNow();
+    if (ch341SpiWrite(ctx, pattern, add, BENCH_REGION) < 0)
+        return -1;
+    benchSample(run, t0, BENCH_REGION);
+    benchReport(out, run, speed);
+    return 0;
+}
+
+int32_t ch341Bench(struct ch341_ctx *ctx, FILE *out, uint32_t add)
+{
+    static const uint32_t speeds[] = {
+        0, 1, 2, 3,
+        CH341A_STM_SPI_DBL, CH341A_STM_SPI_DBL | 1, CH341A_STM_SPI_DBL | 2, CH341A_STM_SPI_DBL | 3,
+    };
+    struct bench_run *run;
+    uint8_t *save, *buf, *pattern;
+    int32_t level = ctx->log_level;
+    int32_t ret = -1;
+
+    if (ctx->transport == NULL || ctx->flash.capacity < BENCH_REGION)
+        return -1;
+    add -= add % BENCH_REGION;
+    if (add + BENCH_REGION > ctx->flash.capacity)
+        add = ctx->flash.capacity - BENCH_REGION;
+    run = malloc(sizeof(*run));
+    save = malloc(BENCH_REGION);
+    buf = malloc(BENCH_READ_BYTES);
+    pattern = malloc(BENCH_REGION);
+    if (!run || !save || !buf || !pattern) {
+        fprintf(stderr, "ch341Bench: out of memory\n");
+        goto out;
+    }
+    run->ctx = ctx;
+    for (uint32_t i = 0; i < BENCH_REGION; ++i)
+        pattern[i] = (i * 7 + 1) & 0x7F; // never an erased page, so nothing is skipped
+
+    ctx->log_level = CH341_LOG_ERROR;
+    if (ch341SpiRead(ctx, save, add, BENCH_REGION) < 0) {
+        fprintf(stderr, "ch341Bench: could not save the region at 0x%x\n", add);
+        goto out;
+    }
+    fprintf(out, "{\"chip\":\"%s\",\"transport\":\"%s\",\"capacity\":%u,\"region\":%u}\n",
+            ctx->flash.name ? ctx->flash.name : "unknown", ctx->transport->name, ctx->flash.capacity, add);
+    benchBitrev(out, buf);
+    ret = 0;
+    for (uint32_t s = 0; s < sizeof(speeds) / sizeof(speeds[0]) && ret == 0; ++s)
+        ret = benchSpeed(out, run, speeds[s], add, buf, pattern);
+
+    /* put back what was there */
+    if (ch341SetStream(ctx, 0) < 0 || ch341EraseRange(ctx, add, BENCH_REGION) < 0 ||
+            ch341SpiWrite(ctx, save, add, BENCH_REGION) < 0) {
+        fprintf(stderr, "ch341Bench: failed to restore 0x%x-0x%x\n", add, add + BENCH_REGION - 1);
+        ret = -1;
+    }
+out:
+    ctx->log_level = level;
+    free(run);
+    free(save);
+    free(buf);
+    free(pattern);
+    return ret;
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __CH341BENCH_H__
+#define __CH341BENCH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include "ch341a.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Run the benchmark matrix on the configured chip and print one JSON object per
+ * result line to out. Program and erase use the 64 KB at add, whose content is
+ * saved first and written back at the end. */
+int32_t ch341Bench(struct ch341_ctx *ctx, FILE *out, uint32_t add);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,728 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* A ch341 with a SPI NOR chip attached, behind the ch341_transport interface.
+ *
+ * The device decodes the 0xA8 (SPI) and 0xAB (UIO, for chip select and delays)
+ * stream commands and answers every SPI packet with one response packet, like the
+ * real one. The chip is built from its chip database entry: JEDEC ID, SFDP, status
+ * registers, page program, the erase sizes it has, chip erase and W25Q-style
+ * security registers. While busy it ignores everything but the status reads.
+ * Block protection and quad modes are not modelled.
+ *
+ * Time is simulated. The device clocks a SPI byte in SIM_BYTE_NS and program and
+ * erase keep the chip busy for the typical datasheet time, so polling sees the
+ * same BUSY pattern as on hardware. Without the latency option the clock simply
+ * jumps ahead and runs are as fast as the host can go; with it, every transfer
+ * also pays a usb round trip and completes no earlier than its simulated time.
+ *
+ * With the fault option every nth bulk-in transfer finds the endpoint halted, as
+ * on a marginal cable; it stays halted, the response kept, until it is cleared. */
+
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "ch341a.h"
+#include "ch341sim.h"
+
+#define SIM_BYTE_NS         5333        // one SPI byte at the ch341's ~1.5 MHz clock
+#define SIM_USB_LATENCY_NS  1000000     // one full speed frame each way, with the latency option
+#define SIM_WRSR_US         10000
+#define SIM_QUEUE           1024        // response packets buffered by the device
+
+/* a transfer submitted to the simulated device */
+struct sim_xfer {
+    struct libusb_transfer *xfer;
+    uint64_t due;           // completion time, once ready
+    uint64_t deadline;      // bulk-in: time out if no data came, 0 for never
+    uint32_t done;          // bulk-out: bytes the device has taken so far
+    bool ready;
+    struct sim_xfer *next;
+};
+
+/* a response packet waiting to be read */
+struct sim_packet {
+    uint8_t data[CH341_PACKET_LENGTH];
+    uint32_t len;
+    uint64_t ready;
+};
+
+/* one simulated programmer, ctx->priv */
+struct ch341_sim {
+    struct ch341_ctx *ctx;
+    const struct spi_chip *chip;
+    bool latency;
+    bool nobusy;
+    uint32_t fault;         // halt the bulk-in endpoint on every fault-th transfer, 0 for never
+    uint32_t in_count;
+    bool halted;
+    char *file;
+    uint8_t *mem;
+    uint8_t secreg[4][256];
+    uint8_t sfdp[512];
+    uint8_t sr1, sr2;
+    bool addr4;             // an SPI_ADDR_EN4B chip after EN4B
+    uint64_t busy_until;
+    /* the command in progress while chip select is asserted */
+    bool cs;
+    bool ignore;
+    bool programmed;
+    uint8_t op;
+    uint8_t wrsr[2];
+    uint32_t count;
+    uint32_t addr;
+    /* clocks, ns */
+    uint64_t now;           // host side
+    uint64_t dev;           // device side, where the SPI bus is
+    uint64_t wall;
+    struct sim_packet inq[SIM_QUEUE];
+    uint32_t inq_head, inq_tail;
+    struct sim_xfer *pending;
+};
+
+static uint64_t simWall(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* bring the host clock up to date with the time spent outside the simulator */
+static void simEnter(struct ch341_sim *sim)
+{
+    uint64_t w = simWall();
+
+    if (sim->latency) {
+        if (w > sim->now)
+            sim->now = w;
+    } else
+        sim->now += w - sim->wall;
+    sim->wall = w;
+}
+
+/* advance the host clock to t, sleeping for it with the latency option */
+static void simWait(struct ch341_sim *sim, uint64_t t)
+{
+    struct timespec ts;
+    uint64_t w;
+
+    if (t <= sim->now)
+        return;
+    if (sim->latency && t > (w = simWall())) {
+        ts.tv_sec = (t - w) / 1000000000ULL;
+        ts.tv_nsec = (t - w) % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+    sim->now = t;
+    sim->wall = simWall();
+}
+
+/* keep the chip busy for us microseconds from now on the device clock */
+static void simBusy(struct ch341_sim *sim, uint64_t us)
+{
+    sim->busy_until = sim->dev + (sim->nobusy ? 0 : us * 1000);
+    sim->sr1 &= ~0x02; // a finished write command clears WEL
+}
+
+static bool simIsBusy(struct ch341_sim *sim)
+{
+    return sim->dev < sim->busy_until;
+}
+
+/* the 4-byte opcodes of the chip's own table, only with a part that has them */
+static bool simHas4ByteOp(const struct spi_chip *c, uint8_t op)
+{
+    if (c->addr_mode != SPI_ADDR_3OR4BYTE && c->addr_mode != SPI_ADDR_4BYTE)
+        return false;
+    if (op == 0x13 || op == 0x0C || op == 0x12)
+        return true;
+    return op != 0 && (op == c->erase4_op[0] || op == c->erase4_op[1] || op == c->erase4_op[2]);
+}
+
+/* address bytes of an opcode, 0 for the ones the chip does not know */
+static uint32_t simAddrLen(struct ch341_sim *sim, uint8_t op)
+{
+    switch (op) {
+        case 0x13: case 0x0C: case 0x12: case 0x21: case 0x5C: case 0xDC:
+            return simHas4ByteOp(sim->chip, op) ? 4 : 0;
+        case 0x5A: // SFDP keeps 3 bytes in 4-byte mode
+            return 3;
+        case 0x03: case 0x0B: case 0x02: case 0x20: case 0x52: case 0xD8:
+        case 0x48: case 0x42: case 0x44:
+            return sim->addr4 ? 4 : 3;
+    }
+    return 0;
+}
+
+/* size and typical time of an erase opcode, 0 if the chip does not have it */
+static uint32_t simEraseSize(struct ch341_sim *sim, uint8_t op, uint32_t *ms)
+{
+    const struct spi_chip *c = sim->chip;
+    const struct spi_timing *t[] = { &c->erase_4k, &c->erase_32k, &c->erase_64k };
+    const uint8_t op3[] = { 0x20, 0x52, 0xD8 };
+
+    for (int i = 0; i < 3; ++i) {
+        if (t[i]->max == 0 || (op != op3[i] && !(op == c->erase4_op[i] && simHas4ByteOp(c, op))))
+            continue;
+        *ms = t[i]->typ;
+        return 4096u << (i == 0 ? 0 : i + 2);
+    }
+    return 0;
+}
+
+/* clock one byte through the chip */
+static uint8_t simSpiByte(struct ch341_sim *sim, uint8_t mosi)
+{
+    const struct spi_chip *c = sim->chip;
+    uint32_t alen, dummy, n, d, base;
+
+    sim->dev += SIM_BYTE_NS;
+    if (!sim->cs)
+        return 0xFF;
+    if (sim->count++ == 0) {
+        sim->op = mosi;
+        sim->ignore = simIsBusy(sim) && mosi != 0x05 && mosi != 0x35;
+        sim->programmed = false;
+        sim->addr = 0;
+        return 0xFF;
+    }
+    if (sim->ignore)
+        return 0xFF;
+    n = sim->count - 2; // index after the opcode
+    switch (sim->op) {
+        case 0x9F: // JEDEC ID
+            return n < 3 ? c->jedec_id >> (16 - 8 * n) : 0x00;
+        case 0x05:
+            return sim->sr1 | (simIsBusy(sim) ? 0x01 : 0x00);
+        case 0x35:
+            return sim->sr2;
+        case 0x01:
+        case 0x31:
+            if (n < 2)
+                sim->wrsr[n] = mosi;
+            return 0xFF;
+    }
+    alen = simAddrLen(sim, sim->op);
+    dummy = (sim->op == 0x0B || sim->op == 0x0C || sim->op == 0x5A || sim->op == 0x48) ? 1 : 0;
+    if (alen == 0)
+        return 0xFF;
+    if (n < alen) {
+        sim->addr = sim->addr << 8 | mosi;
+        return 0xFF;
+    }
+    if (n < alen + dummy)
+        return 0xFF;
+    d = n - alen - dummy;
+    switch (sim->op) {
+        case 0x03: case 0x13: case 0x0B: case 0x0C:
+            return sim->mem[(sim->addr + d) % c->capacity];
+        case 0x5A:
+            return sim->sfdp[(sim->addr + d) % sizeof(sim->sfdp)];
+        case 0x48:
+            if (c->secreg_pages == 0)
+                return 0xFF;
+            return sim->secreg[(sim->addr >> 12) & 3][(sim->addr + d) & 0xFF];
+        case 0x02: case 0x12: // page program wraps within the page
+            if (!(sim->sr1 & 0x02))
+                return 0xFF;
+            base = sim->addr % c->capacity;
+            base -= base % c->page_size;
+            sim->mem[base + (sim->addr % c->page_size + d) % c->page_size] &= mosi;
+            sim->programmed = true;
+            return 0xFF;
+        case 0x42:
+            n = (sim->addr >> 12) & 3;
+            if (!(sim->sr1 & 0x02) || c->secreg_pages == 0 || n == 0 || (sim->sr2 & (0x04 << n)))
+                return 0xFF;
+            sim->secreg[n][(sim->addr + d) & 0xFF] &= mosi;
+            sim->programmed = true;
+            return 0xFF;
+    }
+    return 0xFF;
+}
+
+/* chip select deasserted: finish the command */
+static void simCsRise(struct ch341_sim *sim)
+{
+    const struct spi_chip *c = sim->chip;
+    uint32_t size, ms, page, lb;
+    bool wel = sim->sr1 & 0x02;
+
+    sim->cs = false;
+    if (sim->count == 0 || sim->ignore)
+        return;
+    switch (sim->op) {
+        case 0x06:
+            sim->sr1 |= 0x02;
+            break;
+        case 0x04:
+            sim->sr1 &= ~0x02;
+            break;
+        case 0xB7: case 0xE9:
+            if (c->addr_mode == SPI_ADDR_EN4B)
+                sim->addr4 = sim->op == 0xB7;
+            break;
+        case 0x01:
+        case 0x31:
+            if (!wel || sim->count < 2)
+                break;
+            if (sim->op == 0x01)
+                sim->sr1 = (sim->sr1 & 0x03) | (sim->wrsr[0] & 0xFC);
+            if (sim->op == 0x31 || sim->count > 2) {
+                /* the security register lock bits are one-time programmable */
+                lb = sim->sr2 & 0x38;
+                sim->sr2 = sim->wrsr[sim->op == 0x01 ? 1 : 0] | lb;
+            }
+            simBusy(sim, SIM_WRSR_US);
+            break;
+        case 0x02: case 0x12:
+            if (sim->programmed)
+                simBusy(sim, c->page_prog.typ);
+            break;
+        case 0x42:
+            if (sim->programmed)
+                simBusy(sim, c->page_prog.typ);
+            break;
+        case 0x44:
+            page = (sim->addr >> 12) & 3;
+            if (!wel || c->secreg_pages == 0 || page == 0 || (sim->sr2 & (0x04 << page)))
+                break;
+            memset(sim->secreg[page], 0xFF, sizeof(sim->secreg[page]));
+            simBusy(sim, c->erase_4k.typ * 1000);
+            break;
+        case 0xC7: case 0x60:
+            if (!wel)
+                break;
+            memset(sim->mem, 0xFF, c->capacity);
+            simBusy(sim, (uint64_t)c->chip_erase.typ * 1000);
+            break;
+        default:
+            size = simEraseSize(sim, sim->op, &ms);
+            if (!wel || size == 0 || sim->count != simAddrLen(sim, sim->op) + 1)
+                break;
+            memset(sim->mem + (sim->addr % c->capacity) / size * size, 0xFF, size);
+            simBusy(sim, (uint64_t)ms * 1000);
+            break;
+    }
+}
+
+/* execute a bulk-out buffer from *done on, one ch341 command per packet. Like the real
+ * device, a stream packet whose response the full queue cannot take is NAKed: returns
+ * false with *done at that packet, to go on once the host has read some responses. */
+static bool simOut(struct ch341_sim *sim, const uint8_t *buf, uint32_t len, uint32_t *done)
+{
+    const uint64_t latency = sim->latency ? SIM_USB_LATENCY_NS : 0;
+    struct sim_packet *pkt;
+    uint32_t n, i;
+    uint8_t c;
+
+    if (sim->dev < sim->now + latency)
+        sim->dev = sim->now + latency;
+    for (uint32_t off = *done; off < len; off += n, *done = off) {
+        const uint8_t *p = buf + off;
+        n = len - off < CH341_PACKET_LENGTH ? len - off : CH341_PACKET_LENGTH;
+        if (p[0] == CH341A_CMD_SPI_STREAM && n > 1) {
+            if (sim->inq_tail - sim->inq_head >= SIM_QUEUE)
+                return false;
+            pkt = &sim->inq[sim->inq_tail++ % SIM_QUEUE];
+            for (i = 1; i < n; ++i)
+                pkt->data[i - 1] = swapByte(simSpiByte(sim, swapByte(p[i])));
+            pkt->len = n - 1;
+            pkt->ready = sim->dev + latency;
+        } else if (p[0] == CH341A_CMD_UIO_STREAM) {
+            for (i = 1; i < n && (c = p[i]) != CH341A_CMD_UIO_STM_END; ++i) {
+                if ((c & 0xC0) == CH341A_CMD_UIO_STM_OUT) {
+                    if (!(c & 0x01) && !sim->cs) {
+                        sim->cs = true;
+                        sim->count = 0;
+                    } else if ((c & 0x01) && sim->cs)
+                        simCsRise(sim);
+                } else if ((c & 0xC0) == CH341A_CMD_UIO_STM_US)
+                    sim->dev += (c & 0x3F) * 1000ULL;
+            }
+        }
+    }
+    return true;
+}
+
+/* hand waiting response packets to bulk-in transfers, oldest first; returns how many */
+static uint32_t simPair(struct ch341_sim *sim)
+{
+    struct sim_packet *pkt;
+    struct libusb_transfer *xfer;
+    uint32_t paired = 0;
+
+    for (struct sim_xfer *x = sim->pending; x && sim->inq_head != sim->inq_tail; x = x->next) {
+        xfer = x->xfer;
+        if (x->ready || xfer->endpoint != BULK_READ_ENDPOINT)
+            continue;
+        if (sim->fault && ++sim->in_count % sim->fault == 0)
+            sim->halted = true;
+        if (sim->halted) {
+            xfer->status = LIBUSB_TRANSFER_STALL;
+            x->due = sim->now;
+            x->ready = true;
+            continue;
+        }
+        pkt = &sim->inq[sim->inq_head++ % SIM_QUEUE];
+        xfer->actual_length = pkt->len < (uint32_t)xfer->length ? pkt->len : (uint32_t)xfer->length;
+        memcpy(xfer->buffer, pkt->data, xfer->actual_length);
+        xfer->status = LIBUSB_TRANSFER_COMPLETED;
+        x->due = pkt->ready > sim->now ? pkt->ready : sim->now;
+        x->ready = true;
+        paired++;
+    }
+    return paired;
+}
+
+/* move data both ways until neither can: bulk-out transfers are taken in order as far as
+ * the response queue has room, waiting responses go to bulk-in transfers */
+static void simRun(struct ch341_sim *sim)
+{
+    struct libusb_transfer *xfer;
+    uint32_t before;
+    bool moved;
+
+    do {
+        moved = false;
+        for (struct sim_xfer *x = sim->pending; x; x = x->next) {
+            xfer = x->xfer;
+            if (x->ready || xfer->endpoint != BULK_WRITE_ENDPOINT)
+                continue;
+            before = x->done;
+            if (!simOut(sim, xfer->buffer, xfer->length, &x->done)) {
+                moved = x->done != before;
+                break; // the ones behind it wait too
+            }
+            xfer->actual_length = xfer->length;
+            xfer->status = LIBUSB_TRANSFER_COMPLETED;
+            x->due = sim->dev;
+            x->ready = true;
+            moved = true;
+        }
+        if (simPair(sim) > 0)
+            moved = true;
+    } while (moved);
+}
+
+static int simBulk(struct ch341_ctx *ctx, uint8_t ep, uint8_t *buf, int len, int *transferred, uint32_t timeout)
+{
+    struct ch341_sim *sim = ctx->priv;
+    struct sim_packet *pkt;
+    uint32_t done = 0;
+
+    simEnter(sim);
+    *transferred = 0;
+    if (ep == BULK_WRITE_ENDPOINT) {
+        if (!simOut(sim, buf, len, &done)) { // NAKed until the timeout
+            *transferred = done;
+            simWait(sim, sim->now + timeout * 1000000ULL);
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        simWait(sim, sim->dev);
+        *transferred = len;
+        return 0;
+    }
+    if (sim->halted)
+        return LIBUSB_ERROR_PIPE;
+    if (sim->inq_head == sim->inq_tail) {
+        simWait(sim, sim->now + timeout * 1000000ULL);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    pkt = &sim->inq[sim->inq_head++ % SIM_QUEUE];
+    *transferred = (int)pkt->len < len ? (int)pkt->len : len;
+    memcpy(buf, pkt->data, *transferred);
+    simWait(sim, pkt->ready);
+    simRun(sim); // room for a NAKed bulk-out
+    return 0;
+}
+
+static int simSubmit(struct ch341_ctx *ctx, struct libusb_transfer *xfer)
+{
+    struct ch341_sim *sim = ctx->priv;
+    struct sim_xfer *x, **tail;
+
+    if ((x = calloc(1, sizeof(*x))) == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+    simEnter(sim);
+    x->xfer = xfer;
+    xfer->actual_length = 0;
+    if (xfer->endpoint == BULK_READ_ENDPOINT && xfer->timeout)
+        x->deadline = sim->now + xfer->timeout * 1000000ULL;
+    for (tail = &sim->pending; *tail; tail = &(*tail)->next)
+        ;
+    *tail = x;
+    simRun(sim);
+    return 0;
+}
+
+static int simCancel(struct ch341_ctx *ctx, struct libusb_transfer *xfer)
+{
+    struct ch341_sim *sim = ctx->priv;
+
+    for (struct sim_xfer *x = sim->pending; x; x = x->next) {
+        if (x->xfer != xfer)
+            continue;
+        xfer->status = LIBUSB_TRANSFER_CANCELLED;
+        xfer->actual_length = xfer->endpoint == BULK_WRITE_ENDPOINT ? x->done : 0;
+        if (!x->ready || x->due > sim->now)
+            x->due = sim->now;
+        x->ready = true;
+        return 0;
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* complete one transfer: unlink it first, the callback may submit again */
+static void simComplete(struct ch341_sim *sim, struct sim_xfer *x)
+{
+    struct libusb_transfer *xfer = x->xfer;
+    struct sim_xfer **p;
+
+    for (p = &sim->pending; *p != x; p = &(*p)->next)
+        ;
+    *p = x->next;
+    free(x);
+    xfer->callback(xfer);
+}
+
+/* complete every transfer that is due, earliest first; if none is, let tv pass and
+ * time out bulk-in transfers nothing arrived for */
+static int simHandleEvents(struct ch341_ctx *ctx, struct timeval *tv)
+{
+    struct ch341_sim *sim = ctx->priv;
+    uint64_t limit;
+    struct sim_xfer *best;
+    int done = 0;
+
+    simEnter(sim);
+    limit = sim->now + tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+    for (;;) {
+        best = NULL;
+        for (struct sim_xfer *x = sim->pending; x; x = x->next)
+            if (x->ready && (best == NULL || x->due < best->due))
+                best = x;
+        if (best == NULL || (sim->latency && best->due > limit))
+            break;
+        simWait(sim, best->due);
+        simComplete(sim, best);
+        done++;
+    }
+    if (done)
+        return 0;
+    simWait(sim, limit);
+    for (struct sim_xfer *x = sim->pending, *next; x; x = next) {
+        next = x->next;
+        if (!x->ready && x->deadline && x->deadline <= sim->now) {
+            x->xfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+            simComplete(sim, x);
+            next = sim->pending; // the list may have changed under the callback
+        }
+    }
+    return 0;
+}
+
+static int simClearHalt(struct ch341_ctx *ctx, uint8_t ep)
+{
+    struct ch341_sim *sim = ctx->priv;
+
+    if (ep == BULK_READ_ENDPOINT)
+        sim->halted = false;
+    return 0;
+}
+
+static void simRelease(struct ch341_ctx *ctx)
+{
+    struct ch341_sim *sim = ctx->priv;
+    FILE *fp;
+
+    while (sim->pending) {
+        struct sim_xfer *x = sim->pending;
+        sim->pending = x->next;
+        free(x);
+    }
+    if (sim->file && (fp = fopen(sim->file, "wb")) != NULL) {
+        if (fwrite(sim->mem, 1, sim->chip->capacity, fp) != sim->chip->capacity)
+            ch341Log(ctx, CH341_LOG_ERROR, "ch341sim: failed to save %s", sim->file);
+        fclose(fp);
+    }
+    free(sim->mem);
+    free(sim->file);
+    free(sim);
+}
+
+static const struct ch341_transport simTransport = {
+    .name = "simulator",
+    .bulk = simBulk,
+    .submit = simSubmit,
+    .cancel = simCancel,
+    .handle_events = simHandleEvents,
+    .clear_halt = simClearHalt,
+    .release = simRelease,
+};
+
+/* encode a time as a 5-bit count minus one and the finest of the units it fits */
+static uint32_t simSfdpTime(uint32_t t, const uint32_t *unit, int units)
+{
+    uint32_t n;
+
+    for (int u = 0; u < units; ++u) {
+        n = (t + unit[u] - 1) / unit[u];
+        if (n <= 32)
+            return (n ? n - 1 : 0) | u << 5;
+    }
+    return 31 | (units - 1) << 5;
+}
+
+/* max = typ * 2 * (multiplier + 1) */
+static uint32_t simSfdpMult(uint32_t typ, uint32_t max)
+{
+    uint32_t m = typ ? (max + 2 * typ - 1) / (2 * typ) : 1;
+
+    return m < 1 ? 0 : m > 16 ? 15 : m - 1;
+}
+
+/* a JESD216 basic flash parameter table describing the chip */
+static void simSfdpInit(struct ch341_sim *sim)
+{
+    static const uint32_t pp_unit[] = { 8, 64 };                    // us
+    static const uint32_t erase_unit[] = { 1, 16, 128, 1000 };      // ms
+    static const uint32_t chip_unit[] = { 16, 256, 4000, 64000 };   // ms
+    const struct spi_chip *c = sim->chip;
+    const struct spi_timing *t[] = { &c->erase_4k, &c->erase_32k, &c->erase_64k };
+    const uint8_t shift[] = { 12, 15, 16 }, op[] = { 0x20, 0x52, 0xD8 };
+    uint32_t dw[16] = { 0 }, type = 0, mult = 0;
+
+    memset(sim->sfdp, 0xFF, sizeof(sim->sfdp));
+    memcpy(sim->sfdp, "SFDP", 4);
+    sim->sfdp[4] = 6;    // revision 1.6
+    sim->sfdp[5] = 1;
+    sim->sfdp[6] = 0;    // one parameter header
+    sim->sfdp[8] = 0x00; // basic flash parameter table, 16 dwords at 0x30
+    sim->sfdp[9] = 6;
+    sim->sfdp[10] = 1;
+    sim->sfdp[11] = 16;
+    sim->sfdp[12] = 0x30;
+    sim->sfdp[13] = 0x00;
+    sim->sfdp[14] = 0x00;
+    sim->sfdp[15] = 0xFF;
+
+    dw[0] = (c->erase_4k.max ? 0x01 | 0x20 << 8 : 0x03 | 0xFF << 8) |
+            (c->page_size >= 64 ? 1 << 2 : 0) |
+            (uint32_t)(c->addr_mode == SPI_ADDR_EN4B ? SPI_ADDR_3OR4BYTE : c->addr_mode) << 17;
+    dw[1] = c->capacity * 8 - 1;
+    for (int i = 0; i < 3; ++i) {
+        if (t[i]->max == 0)
+            continue;
+        dw[7 + type / 2] |= (uint32_t)(shift[i] | op[i] << 8) << (16 * (type % 2));
+        dw[9] |= simSfdpTime(t[i]->typ, erase_unit, 4) << (4 + 7 * type);
+        if (simSfdpMult(t[i]->typ, t[i]->max) > mult)
+            mult = simSfdpMult(t[i]->typ, t[i]->max);
+        type++;
+    }
+    dw[9] |= mult;
+    for (mult = 0; (1u << mult) < c->page_size; ++mult)
+        ;
+    dw[10] = simSfdpMult(c->page_prog.typ, c->page_prog.max) | mult << 4 |
+            simSfdpTime(c->page_prog.typ, pp_unit, 2) << 8 |
+            simSfdpTime(c->chip_erase.typ, chip_unit, 4) << 24;
+    for (int i = 0; i < 16; ++i)
+        for (int b = 0; b < 4; ++b)
+            sim->sfdp[0x30 + 4 * i + b] = dw[i] >> (8 * b);
+}
+
+int32_t ch341SimConfigure(struct ch341_ctx *ctx, const char *spec)
+{
+    char *args, *tok, *save = NULL;
+    const char *name = "W25Q64", *sfdp = NULL;
+    struct ch341_sim *sim;
+    FILE *fp;
+
+    if (ctx->transport != NULL) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Call ch341Release before re-configure");
+        return -1;
+    }
+    if ((sim = calloc(1, sizeof(*sim))) == NULL)
+        return -1;
+    sim->ctx = ctx;
+    if ((args = strdup(spec)) == NULL)
+        goto fail;
+    for (tok = strtok_r(args, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(tok, "latency"))
+            sim->latency = true;
+        else if (!strcmp(tok, "nobusy"))
+            sim->nobusy = true;
+        else if (!strncmp(tok, "file=", 5))
+            sim->file = strdup(tok + 5);
+        else if (!strncmp(tok, "fault=", 6))
+            sim->fault = strtoul(tok + 6, NULL, 0);
+        else if (!strncmp(tok, "sfdp=", 5))
+            sfdp = tok + 5;
+        else if (tok == args)
+            name = tok;
+        else {
+            ch341Log(ctx, CH341_LOG_ERROR, "Unknown simulator option '%s'", tok);
+            goto fail;
+        }
+    }
+    if ((sim->chip = spiChipFind(name)) == NULL) {
+        ch341Log(ctx, CH341_LOG_ERROR, "Chip %s is not in the chip database", name);
+        goto fail;
+    }
+    if ((sim->mem = malloc(sim->chip->capacity)) == NULL) {
+        ch341Log(ctx, CH341_LOG_ERROR, "ch341sim: out of memory");
+        goto fail;
+    }
+    memset(sim->mem, 0xFF, sim->chip->capacity);
+    if (sim->file && (fp = fopen(sim->file, "rb")) != NULL) {
+        if (fread(sim->mem, 1, sim->chip->capacity, fp) == 0)
+            ch341Log(ctx, CH341_LOG_ERROR, "ch341sim: %s is empty, starting erased", sim->file);
+        fclose(fp);
+    }
+    memset(sim->secreg, 0xFF, sizeof(sim->secreg));
+    for (int i = 0; i < 256; ++i) // page 0 holds factory data
+        sim->secreg[0][i] = i;
+    simSfdpInit(sim);
+    if (sfdp) { // a table read from a real part instead
+        if ((fp = fopen(sfdp, "rb")) == NULL) {
+            ch341Log(ctx, CH341_LOG_ERROR, "ch341sim: cannot open %s", sfdp);
+            goto fail;
+        }
+        memset(sim->sfdp, 0xFF, sizeof(sim->sfdp));
+        if (fread(sim->sfdp, 1, sizeof(sim->sfdp), fp) == 0)
+            ch341Log(ctx, CH341_LOG_ERROR, "ch341sim: %s is empty", sfdp);
+        fclose(fp);
+    }
+    sim->now = sim->dev = sim->wall = simWall();
+    free(args);
+    ch341Log(ctx, CH341_LOG_INFO, "Simulating a ch341 with %s%s%s", sim->chip->name,
+            sim->latency ? ", usb latency" : "", sim->nobusy ? ", no busy time" : "");
+    return ch341Attach(ctx, &simTransport, sim);
+fail:
+    free(args);
+    free(sim->mem);
+    free(sim->file);
+    free(sim);
+    return -1;
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __CH341SIM_H__
+#define __CH341SIM_H__
+
+#include <stdint.h>
+#include "ch341a.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Attach a simulated ch341 with a SPI NOR chip instead of the usb device.
+ * spec is "<chip>[,latency][,nobusy][,file=<path>][,fault=<n>][,sfdp=<path>]": chip
+ * is a chip database name, latency adds usb round trips and paces completions in
+ * real time, nobusy makes program and erase finish at once, file keeps the chip
+ * content across runs, fault stalls every nth bulk-in transfer, sfdp replaces the
+ * SFDP data made up from the database entry with a dump (up to 512 bytes). */
+int32_t ch341SimConfigure(struct ch341_ctx *ctx, const char *spec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "ch341a.h"
+#include "ch341trace.h"
+
+/* one recorded event; formatting is left for ch341TraceClose */
+struct trace_event {
+    char ph;
+    const char *cat;
+    const char *name;
+    uint64_t ts;        // ns
+    uint64_t dur;       // ns, spans only
+    uint64_t id;        // async events only
+    const char *k0, *k1;
+    uint32_t v0, v1;
+};
+
+/* the sink of one context, only ever touched by the thread driving that context */
+struct ch341_trace {
+    char *path;
+    struct trace_event *ev;
+    size_t count, size;
+    uint64_t start;
+    bool full;          // out of memory, later events are dropped
+};
+
+uint64_t traceNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int32_t ch341TraceOpen(struct ch341_ctx *ctx, const char *path)
+{
+    struct ch341_trace *trace;
+
+    if (ctx->trace != NULL)
+        return -1;
+    if ((trace = calloc(1, sizeof(*trace))) == NULL)
+        return -1;
+    trace->path = strdup(path);
+    trace->size = 65536;
+    trace->ev = malloc(trace->size * sizeof(*trace->ev));
+    if (trace->path == NULL || trace->ev == NULL) {
+        free(trace->path);
+        free(trace->ev);
+        free(trace);
+        return -1;
+    }
+    trace->start = traceNow();
+    ctx->trace = trace;
+    ctx->trace_units = 0;
+    return 0;
+}
+
+static void traceAdd(struct ch341_trace *trace, const struct trace_event *ev)
+{
+    struct trace_event *grown;
+
+    if (!trace->full && trace->count == trace->size) {
+        grown = realloc(trace->ev, 2 * trace->size * sizeof(*grown));
+        if (grown == NULL) // keep what we have rather than fail the operation
+            trace->full = true;
+        else {
+            trace->ev = grown;
+            trace->size *= 2;
+        }
+    }
+    if (!trace->full)
+        trace->ev[trace->count++] = *ev;
+}
+
+void traceSpan(struct ch341_ctx *ctx, const char *cat, const char *name, uint64_t t0,
+        const char *k0, uint32_t v0, const char *k1, uint32_t v1)
+{
+    uint64_t now = traceNow();
+
+    traceAdd(ctx->trace, &(struct trace_event) { 'X', cat, name, t0, now - t0, 0, k0, k1, v0, v1 });
+}
+
+void traceAsync(struct ch341_ctx *ctx, char ph, const char *cat, const char *name, uint64_t id,
+        const char *k0, uint32_t v0, const char *k1, uint32_t v1)
+{
+    uint64_t now = traceNow();
+
+    traceAdd(ctx->trace, &(struct trace_event) { ph, cat, name, now, 0, id, k0, k1, v0, v1 });
+}
+
+/* write the events out and stop tracing; nothing to do if no trace was opened */
+int32_t ch341TraceClose(struct ch341_ctx *ctx)
+{
+    struct ch341_trace *trace = ctx->trace;
+    struct trace_event *ev;
+    FILE *fp;
+    int32_t ret = 0;
+
+    if (trace == NULL)
+        return 0;
+    ctx->trace = NULL;
+    if ((fp = fopen(trace->path, "w")) == NULL)
+        ret = -1;
+    else {
+        fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        fprintf(fp, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"ch341prog\"}}");
+        for (size_t i = 0; i < trace->count; ++i) {
+            ev = &trace->ev[i];
+            fprintf(fp, ",\n{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":1,\"ts\":%.3f",
+                    ev->ph, ev->cat, ev->name, (ev->ts - trace->start) / 1e3);
+            if (ev->ph == 'X')
+                fprintf(fp, ",\"dur\":%.3f", ev->dur / 1e3);
+            else
+                fprintf(fp, ",\"id\":\"0x%llx\"", (unsigned long long)ev->id);
+            fprintf(fp, ",\"args\":{");
+            if (ev->k0)
+                fprintf(fp, "\"%s\":%u", ev->k0, ev->v0);
+            if (ev->k1)
+                fprintf(fp, "%s\"%s\":%u", ev->k0 ? "," : "", ev->k1, ev->v1);
+            fprintf(fp, "}}");
+        }
+        fprintf(fp, "\n]}\n");
+        if (fclose(fp) != 0)
+            ret = -1;
+    }
+    free(trace->ev);
+    free(trace->path);
+    free(trace);
+    return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __CH341TRACE_H__
+#define __CH341TRACE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ch341_ctx;
+
+/* Events are kept in memory per context and written as Chrome trace JSON
+ * (chrome://tracing, ui.perfetto.dev) by ch341TraceClose, or by ch341Free if the
+ * trace is still open. Every call site tests ctx->trace first, so a disabled trace
+ * costs one predictable branch. Names must be literals. */
+int32_t ch341TraceOpen(struct ch341_ctx *ctx, const char *path);
+int32_t ch341TraceClose(struct ch341_ctx *ctx);
+uint64_t traceNow(void);
+/* a finished span on the host thread, from t0 to now */
+void traceSpan(struct ch341_ctx *ctx, const char *cat, const char *name, uint64_t t0,
+        const char *k0, uint32_t v0, const char *k1, uint32_t v1);
+/* begin ('b') or end ('e') of an asynchronous span, matched by id */
+void traceAsync(struct ch341_ctx *ctx, char ph, const char *cat, const char *name, uint64_t id,
+        const char *k0, uint32_t v0, const char *k1, uint32_t v1);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "ch341a.h"
+#include "ch341tune.h"
+
+#define TUNE_PASSES     3       // reads per setting
+#define TUNE_CONFIRM    8       // reads of the chosen setting before it is kept
+#define TUNE_LINE       128
+
+static const uint32_t tuneSpeeds[] = {
+    0, 1, 2, 3,
+    CH341A_STM_SPI_DBL, CH341A_STM_SPI_DBL | 1, CH341A_STM_SPI_DBL | 2, CH341A_STM_SPI_DBL | 3,
+};
+static const uint32_t tuneDepths[] = { 1, 2, 4, 8, 16 };
+
+static double tuneNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int32_t tuneApply(struct ch341_ctx *ctx, const struct ch341_tune *t)
+{
+    if (ch341SetQueueDepth(ctx, t->queue_depth) < 0)
+        return -1;
+    return ch341SetStream(ctx, t->speed);
+}
+
+/* read the region passes times under t; returns bytes per second, 0 if some pass
+ * failed, needed a retry or did not match ref */
+static double tuneMeasure(struct ch341_ctx *ctx, const struct ch341_tune *t, uint32_t add, uint32_t len,
+        uint8_t *buf, const uint8_t *ref, uint32_t passes)
+{
+    double t0, secs = 0;
+    uint64_t retries;
+
+    if (tuneApply(ctx, t) < 0)
+        return 0;
+    for (uint32_t p = 0; p < passes; ++p) {
+        memset(buf, ~ref[0], len);
+        retries = ctx->stats.retries;
+        t0 = tuneNow();
+        if (ch341SpiRead(ctx, buf, add, len) < 0 || ctx->stats.retries != retries ||
+                memcmp(buf, ref, len) != 0)
+            return 0;
+        secs += tuneNow() - t0;
+    }
+    return secs > 0 ? (double)len * passes / secs : 0;
+}
+
+static void tuneReport(const struct ch341_tune *t, double rate)
+{
+    printf("  turbo %u%s, queue %2u: ", t->speed & 3, (t->speed & CH341A_STM_SPI_DBL) ? ", double" : "",
+            t->queue_depth);
+    if (rate > 0)
+        printf("%.0f bytes per second\n", rate);
+    else
+        printf("unstable\n");
+    fflush(stdout);
+}
+
+int32_t ch341Tune(struct ch341_ctx *ctx, uint32_t add, uint32_t len, struct ch341_tune *best)
+{
+    const struct ch341_tune base = { 0, CH341_QUEUE_DEPTH };
+    struct ch341_tune t;
+    ch341_progress_fn progress = ctx->progress;
+    int32_t level = ctx->log_level;
+    double rate, top = 0;
+    uint64_t retries;
+    uint8_t *ref, *buf;
+    uint32_t i;
+    int32_t ret = -1;
+
+    if (ctx->transport == NULL || ctx->flash.capacity == 0)
+        return -1;
+    if (len == 0 || len > ctx->flash.capacity)
+        len = ctx->flash.capacity < TUNE_REGION ? ctx->flash.capacity : TUNE_REGION;
+    if (add > ctx->flash.capacity - len)
+        add = ctx->flash.capacity - len;
+    ref = malloc(len);
+    buf = malloc(len);
+    if (!ref || !buf) {
+        fprintf(stderr, "ch341Tune: out of memory\n");
+        goto out;
+    }
+    ctx->progress = NULL;
+    ctx->log_level = CH341_LOG_ERROR;
+
+    /* the reference: the slowest setting, read the same twice without a retry */
+    retries = ctx->stats.retries;
+    if (tuneApply(ctx, &base) < 0 || ch341SpiRead(ctx, ref, add, len) < 0 ||
+            ch341SpiRead(ctx, buf, add, len) < 0 || memcmp(ref, buf, len) != 0 ||
+            ctx->stats.retries != retries) {
+        fprintf(stderr, "The chip does not read back the same at the slowest setting, check the clip and cable.\n");
+        goto out;
+    }
+    for (i = 1; i < len && ref[i] == ref[0]; ++i)
+        ;
+    if (i == len)
+        fprintf(stderr, "The test region at 0x%x holds only %02x, bad reads may go unnoticed; "
+                "choose one with data with --offset.\n", add, ref[0]);
+    printf("Tuning on %u bytes at 0x%x\n", len, add);
+
+    *best = base;
+    for (i = 0; i < sizeof(tuneSpeeds) / sizeof(tuneSpeeds[0]); ++i) {
+        t.speed = tuneSpeeds[i];
+        t.queue_depth = base.queue_depth;
+        rate = tuneMeasure(ctx, &t, add, len, buf, ref, TUNE_PASSES);
+        tuneReport(&t, rate);
+        if (rate > top) {
+            top = rate;
+            *best = t;
+        }
+    }
+    for (i = 0; i < sizeof(tuneDepths) / sizeof(tuneDepths[0]); ++i) {
+        t.speed = best->speed;
+        t.queue_depth = tuneDepths[i];
+        if (t.queue_depth == base.queue_depth)
+            continue;
+        rate = tuneMeasure(ctx, &t, add, len, buf, ref, TUNE_PASSES);
+        tuneReport(&t, rate);
+        if (rate > top) {
+            top = rate;
+            *best = t;
+        }
+    }
+
+    /* a setting that passed a few reads by luck must not be kept */
+    if (tuneMeasure(ctx, best, add, len, buf, ref, TUNE_CONFIRM) == 0) {
+        fprintf(stderr, "turbo %u%s, queue %u did not hold up, keeping the slowest setting\n",
+                best->speed & 3, (best->speed & CH341A_STM_SPI_DBL) ? ", double" : "", best->queue_depth);
+        *best = base;
+    }
+    ret = tuneApply(ctx, best);
+out:
+    ctx->progress = progress;
+    ctx->log_level = level;
+    free(ref);
+    free(buf);
+    return ret;
+}
+
+/* the cache file, creating its directory if asked to */
+static int32_t tuneCachePath(char *path, size_t size, bool create)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+    if (xdg && *xdg)
+        snprintf(path, size, "%s", xdg);
+    else if (home && *home)
+        snprintf(path, size, "%s/.cache", home);
+    else
+        return -1;
+    if (create && mkdir(path, 0755) < 0 && errno != EEXIST)
+        return -1;
+    strncat(path, "/ch341prog", size - strlen(path) - 1);
+    if (create && mkdir(path, 0755) < 0 && errno != EEXIST)
+        return -1;
+    strncat(path, "/tune", size - strlen(path) - 1);
+    return 0;
+}
+
+/* "<jedec id> <port path>", what a cache line is looked up by */
+static int32_t tuneKey(struct ch341_ctx *ctx, char *key, size_t size)
+{
+    char where[CH341_PATH_LENGTH];
+
+    if (ch341DevicePath(ctx, where, sizeof(where)) < 0)
+        return -1;
+    snprintf(key, size, "%06x %s", ctx->flash.jedec_id, where);
+    return 0;
+}
+
+/* does the cache line start with key */
+static bool tuneMatch(const char *line, const char *key)
+{
+    size_t n = strlen(key);
+
+    return !strncmp(line, key, n) && line[n] == ' ';
+}
+
+int32_t ch341TuneLoad(struct ch341_ctx *ctx, struct ch341_tune *tune)
+{
+    char path[4096], key[TUNE_LINE], line[TUNE_LINE];
+    int32_t ret = 0;
+    FILE *fp;
+
+    if (tuneKey(ctx, key, sizeof(key)) < 0 || tuneCachePath(path, sizeof(path), false) < 0 ||
+            (fp = fopen(path, "r")) == NULL)
+        return 0;
+    while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        if (tuneMatch(line, key) &&
+                sscanf(line + strlen(key), "%u %u", &tune->speed, &tune->queue_depth) == 2)
+            ret = tuneApply(ctx, tune) < 0 ? -1 : 1;
+    }
+    fclose(fp);
+    return ret;
+}
+
+int32_t ch341TuneSave(struct ch341_ctx *ctx, const struct ch341_tune *tune)
+{
+    char path[4096], tmp[4100], key[TUNE_LINE], line[TUNE_LINE];
+    FILE *in, *out;
+
+    if (tuneKey(ctx, key, sizeof(key)) < 0 || tuneCachePath(path, sizeof(path), true) < 0) {
+        fprintf(stderr, "No cache directory for the tune result\n");
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((out = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "Couldn't open file %s for writing.\n", tmp);
+        return -1;
+    }
+    /* every other programmer and chip stays as it was */
+    if ((in = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), in) != NULL)
+            if (!tuneMatch(line, key))
+                fputs(line, out);
+        fclose(in);
+    }
+    fprintf(out, "%s %u %u\n", key, tune->speed, tune->queue_depth);
+    if (fclose(out) != 0 || rename(tmp, path) < 0) {
+        fprintf(stderr, "Couldn't write the tune cache %s\n", path);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __CH341TUNE_H__
+#define __CH341TUNE_H__
+
+#include <stdint.h>
+#include "ch341a.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define     TUNE_REGION     32768       // bytes read per pass unless a length is given
+
+/* a bus setting and transfer geometry */
+struct ch341_tune {
+    uint32_t speed;             // ch341SetStream
+    uint32_t queue_depth;       // ch341SetQueueDepth
+};
+
+/* Read len bytes at add with each bus speed, slowest first, then with each queue
+ * depth at the fastest speed that kept its data; a setting is stable when every
+ * pass matches a reference read at the slowest setting without a retry
+ * (ch341_stats.retries). The fastest stable one is
+ * left applied and stored in best. Only these two are searched: the unit and
+ * segment sizes (CH341_MAX_PACKETS, CH341_UNIT_SEGMENTS) are fixed at build time. */
+int32_t ch341Tune(struct ch341_ctx *ctx, uint32_t add, uint32_t len, struct ch341_tune *best);
+
+/* The tune cache keeps the result per chip JEDEC ID and programmer port path, in
+ * $XDG_CACHE_HOME/ch341prog/tune (~/.cache by default). Load returns 1 and applies
+ * the cached setting if there is one, 0 if there is none. */
+int32_t ch341TuneLoad(struct ch341_ctx *ctx, struct ch341_tune *tune);
+int32_t ch341TuneSave(struct ch341_ctx *ctx, const struct ch341_tune *tune);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "checksum.h"
+
+static uint32_t crcTable[256];
+
+static const uint32_t shaK[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void shaBlock(uint32_t h[8], const uint8_t *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; ++i)
+        w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (; i < 64; ++i)
+        w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                w[i - 7] + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; k = h[7];
+    for (i = 0; i < 64; ++i) {
+        t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + shaK[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void crcInit(void)
+{
+    uint32_t i, j, c;
+
+    if (crcTable[1] != 0)
+        return;
+    for (i = 0; i < 256; ++i) {
+        for (c = i, j = 0; j < 8; ++j)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crcTable[i] = c;
+    }
+}
+
+void checksumInit(struct checksum *sum)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    crcInit();
+    memset(sum, 0, sizeof(*sum));
+    sum->crc = 0xffffffff;
+    memcpy(sum->h, iv, sizeof(iv));
+}
+
+void checksumUpdate(struct checksum *sum, const uint8_t *data, size_t len)
+{
+    uint32_t crc = sum->crc, n;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    sum->crc = crc;
+    sum->bytes += len;
+
+    while (len > 0) {
+        if (sum->fill == 0 && len >= 64) {
+            shaBlock(sum->h, data); // whole blocks straight from the caller's buffer
+            data += 64;
+            len -= 64;
+            continue;
+        }
+        n = 64 - sum->fill;
+        if (n > len)
+            n = len;
+        memcpy(sum->block + sum->fill, data, n);
+        sum->fill += n;
+        data += n;
+        len -= n;
+        if (sum->fill == 64) {
+            shaBlock(sum->h, sum->block);
+            sum->fill = 0;
+        }
+    }
+}
+
+uint32_t checksumCrc32(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+
+    crcInit();
+    for (size_t i = 0; i < len; ++i)
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void shaFinal(struct checksum *sum, uint8_t digest[32])
+{
+    uint64_t bits = sum->bytes * 8;
+    int i;
+
+    sum->block[sum->fill++] = 0x80;
+    if (sum->fill > 56) {
+        memset(sum->block + sum->fill, 0, 64 - sum->fill);
+        shaBlock(sum->h, sum->block);
+        sum->fill = 0;
+    }
+    memset(sum->block + sum->fill, 0, 56 - sum->fill);
+    for (i = 0; i < 8; ++i)
+        sum->block[56 + i] = bits >> (56 - 8 * i);
+    shaBlock(sum->h, sum->block);
+    sum->fill = 0;
+    for (i = 0; i < 32; ++i)
+        digest[i] = sum->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+int32_t checksumCheckExpect(const char *expect)
+{
+    size_t n = strlen(expect), i;
+
+    if (n != 8 && n != 64)
+        return -1;
+    for (i = 0; i < n; ++i)
+        if (!isxdigit((unsigned char)expect[i]))
+            return -1;
+    return 0;
+}
+
+int32_t checksumReport(struct checksum *sum, const char *expect)
+{
+    char crc[9], sha[65];
+    uint8_t digest[32];
+    const char *got;
+    int i;
+
+    shaFinal(sum, digest);
+    snprintf(crc, sizeof(crc), "%08x", sum->crc ^ 0xffffffff);
+    for (i = 0; i < 32; ++i)
+        snprintf(sha + 2 * i, 3, "%02x", digest[i]);
+    printf("CRC32: %s\n", crc);
+    printf("SHA-256: %s\n", sha);
+    if (expect == NULL)
+        return 0;
+    got = strlen(expect) == 8 ? crc : sha;
+    if (strcasecmp(expect, got) != 0) {
+        fprintf(stderr, "Checksum mismatch: expected %s, got %s\n", expect, got);
+        return -1;
+    }
+    printf("Checksum matches.\n");
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* CRC32 (IEEE 802.3, as zlib and crc32(1)) and SHA-256 over the same byte stream */
+struct checksum {
+    uint32_t crc;
+    uint32_t h[8];
+    uint64_t bytes;
+    uint8_t block[64];      // partial SHA-256 block
+    uint32_t fill;
+};
+
+void checksumInit(struct checksum *sum);
+void checksumUpdate(struct checksum *sum, const uint8_t *data, size_t len);
+/* CRC32 of one buffer, without the SHA-256 */
+uint32_t checksumCrc32(const uint8_t *data, size_t len);
+/* print both digests to stdout and compare against expect, a hex CRC32 (8 digits)
+ * or SHA-256 (64 digits), if not NULL; returns -1 on a mismatch */
+int32_t checksumReport(struct checksum *sum, const char *expect);
+/* 0 if expect has the form of one of the digests */
+int32_t checksumCheckExpect(const char *expect);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stddef.h>
+#include <strings.h>
+#include "chipdb.h"
+
+#define KB(n) ((n) * 1024u)
+#define MB(n) ((n) * 1024u * 1024u)
+
+/* The part list. The table and the lookup switch below are both expanded from it, so a
+ * duplicated JEDEC ID is a compile error. Page program times are in us, erase times in ms
+ * (typical, maximum); 0, 0 means the part lacks that erase size. Keep maxima conservative,
+ * they become the timeouts. The 4-byte erase opcodes (4 KB, 32 KB, 64 KB) are what goes with
+ * an address above 16 MB, 0 where the part has none; parts larger than 16 MB lose that size
+ * there. */
+#define CHIP_LIST(X) \
+    /* name           JEDEC ID  size     page  program      4 KB erase   32 KB erase   64 KB erase   chip erase          address mode       4-byte erase        secreg   */ \
+    X(W25Q80,        0xEF4014, MB(1),   256, 400,  3000,  45,  400,  120, 1600,  150, 2000,    2500,   8000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(W25Q16,        0xEF4015, MB(2),   256, 400,  3000,  45,  400,  120, 1600,  150, 2000,    5000,  25000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(W25Q32,        0xEF4016, MB(4),   256, 400,  3000,  45,  400,  120, 1600,  150, 2000,   10000,  50000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(W25Q64,        0xEF4017, MB(8),   256, 400,  3000,  45,  400,  120, 1600,  150, 2000,   20000, 100000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(W25Q128,       0xEF4018, MB(16),  256, 400,  3000,  45,  400,  120, 1600,  150, 2000,   40000, 200000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(W25Q256,       0xEF4019, MB(32),  256, 400,  3000,  45,  400,  120, 1600,  150, 2000,   80000, 400000,  SPI_ADDR_3OR4BYTE, 0x21,    0, 0xDC,  3, 256) \
+    X(W25Q512,       0xEF4020, MB(64),  256, 400,  3000,  45,  400,  120, 1600,  150, 2000,  160000, 800000,  SPI_ADDR_3OR4BYTE, 0x21,    0, 0xDC,  3, 256) \
+    X(W25Q32FW,      0xEF6016, MB(4),   256, 400,  3000,  45,  400,  120, 1600,  150, 2000,   10000,  50000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(W25Q64FW,      0xEF6017, MB(8),   256, 400,  3000,  45,  400,  120, 1600,  150, 2000,   20000, 100000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(W25Q128FW,     0xEF6018, MB(16),  256, 400,  3000,  45,  400,  120, 1600,  150, 2000,   40000, 200000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(W25Q64JV_M,    0xEF7017, MB(8),   256, 400,  3000,  45,  400,  120, 1600,  150, 2000,   20000, 100000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(W25Q128JV_M,   0xEF7018, MB(16),  256, 400,  3000,  45,  400,  120, 1600,  150, 2000,   40000, 200000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(MX25L8005,     0xC22014, MB(1),   256, 1400, 5000,  60,  300,    0,    0,  700, 2000,    9000,  20000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(MX25L1606E,    0xC22015, MB(2),   256, 1400, 5000,  60,  300,    0,    0,  700, 2000,   14000,  30000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(MX25L3206E,    0xC22016, MB(4),   256, 1400, 5000,  90,  300,    0,    0,  700, 2000,   25000,  50000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(MX25L6406E,    0xC22017, MB(8),   256, 1400, 5000,  90,  300,    0,    0,  700, 2000,   50000,  80000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(MX25L12835F,   0xC22018, MB(16),  256, 330,  1200,  30,  120,  150,  650,  280, 2000,   50000, 150000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(MX25L25635F,   0xC22019, MB(32),  256, 330,  1200,  45,  200,  150,  650,  280, 2000,  150000, 300000,  SPI_ADDR_EN4B,     0x20, 0x52, 0xD8,  0,   0) \
+    X(MX66L51235F,   0xC2201A, MB(64),  256, 330,  1200,  45,  200,  150,  650,  280, 2000,  300000, 600000,  SPI_ADDR_3OR4BYTE, 0x21, 0x5C, 0xDC,  0,   0) \
+    X(GD25Q16,       0xC84015, MB(2),   256, 600,  2400,  50,  400,  150,  800,  250, 1200,    7000,  20000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(GD25Q32,       0xC84016, MB(4),   256, 600,  2400,  50,  400,  150,  800,  250, 1200,   15000,  40000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(GD25Q64,       0xC84017, MB(8),   256, 600,  2400,  50,  400,  150,  800,  250, 1200,   25000,  60000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(GD25Q128,      0xC84018, MB(16),  256, 600,  2400,  50,  400,  150,  800,  250, 1200,   50000, 120000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(GD25Q256,      0xC84019, MB(32),  256, 600,  2400,  50,  400,  150,  800,  250, 1200,  100000, 250000,  SPI_ADDR_3OR4BYTE, 0x21, 0x5C, 0xDC,  3, 256) \
+    X(GD25LQ64,      0xC86017, MB(8),   256, 600,  2400,  50,  400,  150,  800,  250, 1200,   25000,  60000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(GD25LQ128,     0xC86018, MB(16),  256, 600,  2400,  50,  400,  150,  800,  250, 1200,   50000, 120000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(SST25VF016B,   0xBF2541, MB(2),     1,  7,    10,   18,   25,   18,   25,   18,   25,      35,     50,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(SST25VF032B,   0xBF254A, MB(4),     1,  7,    10,   18,   25,   18,   25,   18,   25,      35,     50,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(SST25VF064C,   0xBF254B, MB(8),   256, 1500, 5000,  18,   25,   18,   25,   18,   25,      35,     50,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(SST26VF016B,   0xBF2641, MB(2),   256, 1500, 5000,  18,   25,    0,    0,    0,    0,      35,     50,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(SST26VF032B,   0xBF2642, MB(4),   256, 1500, 5000,  18,   25,    0,    0,    0,    0,      35,     50,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(SST26VF064B,   0xBF2643, MB(8),   256, 1500, 5000,  18,   25,    0,    0,    0,    0,      35,     50,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(IS25LP016,     0x9D6015, MB(2),   256, 200,   800,  70,  300,  100,  500,  150, 1000,    4000,  12000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(IS25LP032,     0x9D6016, MB(4),   256, 200,   800,  70,  300,  100,  500,  150, 1000,    8000,  24000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(IS25LP064,     0x9D6017, MB(8),   256, 200,   800,  70,  300,  100,  500,  150, 1000,   15000,  45000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(IS25LP128,     0x9D6018, MB(16),  256, 200,   800,  70,  300,  100,  500,  150, 1000,   30000,  90000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(IS25LP256,     0x9D6019, MB(32),  256, 200,   800,  70,  300,  100,  500,  150, 1000,   60000, 180000,  SPI_ADDR_3OR4BYTE, 0x21, 0x5C, 0xDC,  0,   0) \
+    X(IS25WP064,     0x9D7017, MB(8),   256, 200,   800,  70,  300,  100,  500,  150, 1000,   15000,  45000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(IS25WP128,     0x9D7018, MB(16),  256, 200,   800,  70,  300,  100,  500,  150, 1000,   30000,  90000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(N25Q032,       0x20BA16, MB(4),   256, 500,  5000, 250,  800,    0,    0,  700, 3000,   30000,  60000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(N25Q064,       0x20BA17, MB(8),   256, 500,  5000, 250,  800,    0,    0,  700, 3000,   60000, 120000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(N25Q128,       0x20BA18, MB(16),  256, 500,  5000, 250,  800,    0,    0,  700, 3000,  170000, 250000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(MT25QL256,     0x20BA19, MB(32),  256, 120,  1800,  50,  400,  150, 1000,  150, 1000,  153000, 460000,  SPI_ADDR_3OR4BYTE, 0x21, 0x5C, 0xDC,  0,   0) \
+    X(MT25QL512,     0x20BA20, MB(64),  256, 120,  1800,  50,  400,  150, 1000,  150, 1000,  306000, 920000,  SPI_ADDR_3OR4BYTE, 0x21, 0x5C, 0xDC,  0,   0) \
+    X(EN25Q32,       0x1C3016, MB(4),   256, 500,  3000,  40,  300,    0,    0,  200, 2000,   30000, 100000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(EN25Q64,       0x1C3017, MB(8),   256, 500,  3000,  40,  300,    0,    0,  200, 2000,   40000, 128000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(EN25QH128,     0x1C7018, MB(16),  256, 500,  3000,  40,  300,  150, 1000,  200, 2000,   80000, 256000,  SPI_ADDR_3BYTE,       0,    0,    0,  0,   0) \
+    X(S25FL116K,     0x014015, MB(2),   256, 700,  3000,  50,  450,    0,    0,  500, 2000,    7000,  30000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(S25FL132K,     0x014016, MB(4),   256, 700,  3000,  50,  450,    0,    0,  500, 2000,   13000,  60000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256) \
+    X(S25FL164K,     0x014017, MB(8),   256, 700,  3000,  50,  450,    0,    0,  500, 2000,   25000, 120000,  SPI_ADDR_3BYTE,       0,    0,    0,  3, 256)
+
+#define CHIP_INDEX(name, id, ...) CHIP_##name,
+enum { CHIP_LIST(CHIP_INDEX) CHIP_COUNT };
+
+#define CHIP_ENTRY(name, id, size, page, pp, ppmax, se, semax, be32, be32max, be64, be64max, ce, cemax, addr, \
+        se4, be32_4, be64_4, srp, srs) \
+    { #name, id, size, page, { pp, ppmax }, { se, semax }, { be32, be32max }, { be64, be64max }, { ce, cemax }, addr, \
+        { se4, be32_4, be64_4 }, srp, srs },
+static const struct spi_chip chips[CHIP_COUNT] = { CHIP_LIST(CHIP_ENTRY) };
+
+/* look up a part by its JEDEC ID, NULL if unknown; the switch compiles to a jump table or
+ * a short compare tree, so the lookup cost does not grow with the list */
+const struct spi_chip *spiChipLookup(uint32_t jedec_id)
+{
+#define CHIP_CASE(name, id, ...) case id: return &chips[CHIP_##name];
+    switch (jedec_id) {
+        CHIP_LIST(CHIP_CASE)
+        default: return NULL;
+    }
+#undef CHIP_CASE
+}
+
+/* look up a part by name, case-insensitive; not on any hot path */
+const struct spi_chip *spiChipFind(const char *name)
+{
+    for (int i = 0; i < CHIP_COUNT; ++i)
+        if (strcasecmp(chips[i].name, name) == 0)
+            return &chips[i];
+    return NULL;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __CHIPDB_H__
+#define __CHIPDB_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define     SPI_ADDR_3BYTE         0        // 3-byte addresses only
+#define     SPI_ADDR_3OR4BYTE      1        // 3-byte, plus 4-byte opcodes above 16 MB
+#define     SPI_ADDR_4BYTE         2        // 4-byte addresses only
+#define     SPI_ADDR_EN4B          3        // 3-byte opcodes, with 4-byte addresses after EN4B (B7)
+
+/* typical and maximum time of an operation */
+struct spi_timing {
+    uint32_t typ;
+    uint32_t max;
+};
+
+/* a SPI NOR part known to the tool */
+struct spi_chip {
+    const char *name;
+    uint32_t jedec_id;              // manufacturer << 16 | memory type << 8 | capacity
+    uint32_t capacity;              // bytes
+    uint16_t page_size;
+    struct spi_timing page_prog;    // us
+    struct spi_timing erase_4k;     // ms, 0 if the part has no such erase
+    struct spi_timing erase_32k;
+    struct spi_timing erase_64k;
+    struct spi_timing chip_erase;   // ms
+    uint8_t addr_mode;
+    uint8_t erase4_op[3];           // 4 KB, 32 KB, 64 KB erase with a 4-byte address, 0 if none
+    uint8_t secreg_pages;           // W25Q-style (0x48/0x42/0x44) security register pages
+    uint16_t secreg_size;
+};
+
+const struct spi_chip *spiChipLookup(uint32_t jedec_id);
+const struct spi_chip *spiChipFind(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
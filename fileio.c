@@ -0,0 +1,546 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#define _GNU_SOURCE                     // SEEK_DATA, SEEK_HOLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ch341a.h"
+#include "fileio.h"
+
+/* Slots are filled in order by the read sink and written in order by the writer
+ * thread; head counts filled slots, tail written ones. */
+struct file_ring {
+    FILE *fp;
+    int32_t hole;                       // byte whose blocks become holes, -1 for none
+    uint64_t skip;                      // hole bytes seeked over but not yet behind a write
+    struct checksum *sum;               // updated by the writer, may be NULL
+    uint8_t *buf;                       // FILE_RING_SLOTS * FILE_RING_SLOT_SIZE
+    uint32_t used[FILE_RING_SLOTS];     // bytes in every filled slot
+    uint64_t head, tail;
+    uint32_t fill;                      // bytes in the slot being filled
+    bool done;                          // no more slots will be filled
+    bool error;                         // the writer failed
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* true if all n bytes are c; reduced a word at a time so the compiler can vectorize it */
+static bool fileIsRun(const uint8_t *p, uint32_t n, uint8_t c)
+{
+    uint64_t acc = 0, w, pattern = c * 0x0101010101010101ULL;
+    uint32_t i;
+
+    for (i = 0; i + sizeof(w) <= n; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        acc |= w ^ pattern;
+    }
+    for (; i < n; ++i)
+        acc |= p[i] ^ c;
+    return acc == 0;
+}
+
+/* write a slot, seeking over the blocks of the hole byte */
+static bool fileWriteSparse(struct file_ring *ring, const uint8_t *data, uint32_t len)
+{
+    uint32_t n;
+
+    for (uint32_t off = 0; off < len; off += n) {
+        n = len - off < FILE_HOLE_BLOCK ? len - off : FILE_HOLE_BLOCK;
+        if (fileIsRun(data + off, n, ring->hole)) {
+            ring->skip += n;
+            continue;
+        }
+        if (ring->skip > 0 && fseeko(ring->fp, ring->skip, SEEK_CUR) != 0)
+            return false;
+        ring->skip = 0;
+        if (fwrite(data + off, 1, n, ring->fp) != n)
+            return false;
+    }
+    return true;
+}
+
+static void *fileWriter(void *arg)
+{
+    struct file_ring *ring = arg;
+    uint32_t slot, n;
+    const uint8_t *data;
+    bool skip, failed;
+
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        while (ring->tail == ring->head && !ring->done)
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        if (ring->tail == ring->head)
+            break;
+        slot = ring->tail % FILE_RING_SLOTS;
+        n = ring->used[slot];
+        skip = ring->error;
+        pthread_mutex_unlock(&ring->lock);
+        data = ring->buf + (size_t)slot * FILE_RING_SLOT_SIZE;
+        if (ring->hole >= 0)
+            failed = !skip && !fileWriteSparse(ring, data, n);
+        else
+            failed = !skip && fwrite(data, 1, n, ring->fp) != n;
+        if (ring->sum != NULL)
+            checksumUpdate(ring->sum, data, n);
+        pthread_mutex_lock(&ring->lock);
+        if (failed)
+            ring->error = true;
+        ring->tail++;
+        pthread_cond_broadcast(&ring->cond);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+/* hand the slot being filled to the writer */
+static void filePublish(struct file_ring *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->used[ring->head % FILE_RING_SLOTS] = ring->fill;
+    ring->head++;
+    ring->fill = 0;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* read sink: copy into the current slot, waiting for the writer when the ring is full */
+static int32_t fileSink(const uint8_t *data, uint32_t len, void *user)
+{
+    struct file_ring *ring = user;
+    uint32_t n;
+    bool error;
+
+    while (len > 0) {
+        if (ring->fill == 0) {
+            pthread_mutex_lock(&ring->lock);
+            while (ring->head - ring->tail == FILE_RING_SLOTS && !ring->error)
+                pthread_cond_wait(&ring->cond, &ring->lock);
+            error = ring->error;
+            pthread_mutex_unlock(&ring->lock);
+            if (error)
+                return -1;
+        }
+        n = FILE_RING_SLOT_SIZE - ring->fill;
+        if (n > len)
+            n = len;
+        memcpy(ring->buf + (size_t)(ring->head % FILE_RING_SLOTS) * FILE_RING_SLOT_SIZE + ring->fill, data, n);
+        ring->fill += n;
+        data += n;
+        len -= n;
+        if (ring->fill == FILE_RING_SLOT_SIZE)
+            filePublish(ring);
+    }
+    return 0;
+}
+
+int32_t fileReadChip(struct ch341_ctx *ctx, FILE *fp, uint32_t add, uint32_t len, struct checksum *sum,
+        int32_t hole)
+{
+    struct file_ring ring;
+    struct stat st;
+    pthread_t writer;
+    int32_t ret;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fp = fp;
+    ring.sum = sum;
+    /* only a regular file has holes, a pipe gets every byte */
+    ring.hole = (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode)) ? hole : -1;
+    ring.buf = malloc((size_t)FILE_RING_SLOTS * FILE_RING_SLOT_SIZE);
+    if (ring.buf == NULL) {
+        fprintf(stderr, "fileReadChip: out of memory\n");
+        return -1;
+    }
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.cond, NULL);
+    if (pthread_create(&writer, NULL, fileWriter, &ring) != 0) {
+        fprintf(stderr, "fileReadChip: cannot start the writer thread\n");
+        ret = -1;
+        goto out;
+    }
+
+    ret = ch341SpiReadStream(ctx, add, len, fileSink, &ring);
+    if (ring.fill > 0)
+        filePublish(&ring);
+    pthread_mutex_lock(&ring.lock);
+    ring.done = true;
+    pthread_cond_broadcast(&ring.cond);
+    pthread_mutex_unlock(&ring.lock);
+    pthread_join(writer, NULL);
+    /* a trailing hole only moved the position, the file still has to reach it */
+    if (!ring.error && ring.skip > 0 && (fseeko(fp, ring.skip, SEEK_CUR) != 0 || fflush(fp) != 0 ||
+            ftruncate(fileno(fp), ftello(fp)) < 0))
+        ring.error = true;
+    if (ring.error || fflush(fp) != 0) {
+        fprintf(stderr, "Error writing the output file\n");
+        ret = -1;
+    }
+out:
+    pthread_cond_destroy(&ring.cond);
+    pthread_mutex_destroy(&ring.lock);
+    free(ring.buf);
+    return ret;
+}
+
+/* the progress of one extent, passed on as part of the whole read */
+struct file_progress {
+    ch341_progress_fn progress;
+    void *user;
+    uint32_t base;                      // bytes of the extents already read
+    uint32_t total;
+};
+
+static void fileExtentProgress(void *user, uint32_t event, uint32_t done, uint32_t total)
+{
+    struct file_progress *prog = user;
+
+    if (event == CH341_PROGRESS_UPDATE)
+        prog->progress(prog->user, event, prog->base + done, prog->total);
+}
+
+int32_t fileReadExtents(struct ch341_ctx *ctx, FILE *fp, const struct file_extent *ext, uint32_t count,
+        uint32_t len, struct checksum *sum, int32_t hole)
+{
+    struct file_progress prog = { ctx->progress, ctx->progress_user, 0, 0 };
+    int32_t level = ctx->log_level;
+    uint8_t pad[FILE_HOLE_BLOCK];
+    struct stat st;
+    size_t pos = 0, end, n;
+    int32_t ret = 0;
+    bool seek;
+
+    memset(pad, 0xff, sizeof(pad));
+    /* with ff as the hole value the gaps are erased blocks like any other */
+    seek = hole == 0xff && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode);
+    /* one banner and one progress run for all the extents, not one per extent */
+    for (uint32_t i = 0; i < count; ++i)
+        prog.total += ext[i].end - ext[i].start;
+    ch341Log(ctx, CH341_LOG_INFO, "Read started!");
+    if (prog.progress) {
+        prog.progress(prog.user, CH341_PROGRESS_BEGIN, 0, prog.total);
+        ch341SetProgress(ctx, fileExtentProgress, &prog);
+    }
+    if (ctx->log_level > CH341_LOG_ERROR)
+        ctx->log_level = CH341_LOG_ERROR;
+    for (uint32_t i = 0; i <= count && ret == 0; ++i) {
+        end = i < count ? ext[i].start : len;
+        if (seek && end > pos && fseeko(fp, end - pos, SEEK_CUR) != 0)
+            goto fail;
+        for (; pos < end; pos += n) {
+            n = end - pos < sizeof(pad) ? end - pos : sizeof(pad);
+            if (sum != NULL)
+                checksumUpdate(sum, pad, n);
+            if (!seek && fwrite(pad, 1, n, fp) != n)
+                goto fail;
+        }
+        if (i == count)
+            break;
+        ret = fileReadChip(ctx, fp, ext[i].start, ext[i].end - ext[i].start, sum, hole);
+        pos = ext[i].end;
+        prog.base += ext[i].end - ext[i].start;
+    }
+    if (ret == 0 && seek && (fflush(fp) != 0 || ftruncate(fileno(fp), ftello(fp)) < 0))
+        goto fail;
+    goto out;
+fail:
+    fprintf(stderr, "Error writing the output file\n");
+    ret = -1;
+out:
+    ch341SetProgress(ctx, prog.progress, prog.user);
+    ctx->log_level = level;
+    if (prog.progress)
+        prog.progress(prog.user, CH341_PROGRESS_END, prog.base, prog.total);
+    return ret;
+}
+
+static void *fileHasher(void *arg)
+{
+    struct file_hash *job = arg;
+    size_t end;
+
+    if (job->extents == NULL) {
+        checksumUpdate(job->sum, job->data, job->len);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < job->count && job->extents[i].start < job->len; ++i) {
+        end = job->extents[i].end < job->len ? job->extents[i].end : job->len;
+        checksumUpdate(job->sum, job->data + job->extents[i].start, end - job->extents[i].start);
+    }
+    return NULL;
+}
+
+void fileHashStart(struct file_hash *job, struct checksum *sum, const uint8_t *data, size_t len,
+        const struct file_extent *extents, uint32_t count)
+{
+    job->sum = sum;
+    job->data = data;
+    job->len = len;
+    job->extents = extents;
+    job->count = count;
+    job->started = pthread_create(&job->thread, NULL, fileHasher, job) == 0;
+    if (!job->started)
+        fileHasher(job);
+}
+
+void fileHashJoin(struct file_hash *job)
+{
+    if (job->started)
+        pthread_join(job->thread, NULL);
+    job->started = false;
+}
+
+/* pipes and other files without a size are read into a growing heap buffer */
+static int32_t fileSlurp(int fd, struct file_map *map)
+{
+    size_t size = 0, room = 0;
+    uint8_t *buf = NULL, *p;
+    ssize_t n;
+
+    for (;;) {
+        if (size == room) {
+            room = room ? room * 2 : FILE_RING_SLOT_SIZE;
+            if ((p = realloc(buf, room)) == NULL) {
+                free(buf);
+                return -1;
+            }
+            buf = p;
+        }
+        n = read(fd, buf + size, room - size);
+        if (n == 0)
+            break;
+        if (n < 0) {
+            free(buf);
+            return -1;
+        }
+        size += n;
+    }
+    map->data = buf;
+    map->size = size;
+    map->mapped = false;
+    return 0;
+}
+
+static int32_t fileAddExtent(struct file_map *map, size_t start, size_t end, uint32_t *room)
+{
+    struct file_extent *e;
+
+    if (map->count == *room) {
+        *room = *room ? *room * 2 : 16;
+        if ((e = realloc(map->extents, *room * sizeof(*e))) == NULL)
+            return -1;
+        map->extents = e;
+    }
+    map->extents[map->count].start = start;
+    map->extents[map->count].end = end;
+    map->count++;
+    return 0;
+}
+
+/* where the data of the file is; for what is not a regular file, or a file system
+ * without SEEK_DATA, it is all data */
+static int32_t fileExtents(int fd, struct file_map *map, bool regular)
+{
+    off_t data, hole;
+    uint32_t room = 0;
+
+    map->count = 0;
+    if (map->size == 0)
+        return 0;
+#ifdef SEEK_DATA
+    if (!regular || ((data = lseek(fd, 0, SEEK_DATA)) < 0 && errno != ENXIO))
+#endif
+        return fileAddExtent(map, 0, map->size, &room);
+#ifdef SEEK_DATA
+    while (data >= 0 && (size_t)data < map->size) { // ENXIO: only a hole is left
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || (size_t)hole > map->size)
+            hole = map->size;
+        if (fileAddExtent(map, data, hole, &room) < 0)
+            return -1;
+        data = lseek(fd, hole, SEEK_DATA);
+    }
+    return 0;
+#endif
+}
+
+int32_t fileMap(const char *path, struct file_map *map)
+{
+    struct stat st;
+    bool regular;
+    void *p;
+    int fd;
+
+    memset(map, 0, sizeof(*map));
+    fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open file %s for reading.\n", path);
+        return -1;
+    }
+    regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular) {
+        if (st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            /* page framing and verify both walk the image front to back */
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            map->data = p;
+            map->size = st.st_size;
+            map->mapped = true;
+        }
+    }
+    if (!map->mapped && fileSlurp(fd, map) < 0) {
+        fprintf(stderr, "Error reading file [%s]\n", path);
+        close(fd);
+        return -1;
+    }
+    if (fileExtents(fd, map, regular) < 0) {
+        fprintf(stderr, "fileMap: out of memory\n");
+        close(fd);
+        fileUnmap(map);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+void fileUnmap(struct file_map *map)
+{
+    if (map->mapped)
+        munmap((void *)map->data, map->size);
+    else
+        free((void *)map->data);
+    free(map->extents);
+    memset(map, 0, sizeof(*map));
+}
+
+int32_t fileFillHoles(struct file_map *map, uint8_t value)
+{
+    size_t at = 0;
+
+    if (value == 0) // what a hole reads as anyway
+        return 0;
+    /* the mapping is private, writing to it never reaches the file */
+    if (map->mapped && mprotect((void *)map->data, map->size, PROT_READ | PROT_WRITE) < 0) {
+        perror("fileFillHoles");
+        return -1;
+    }
+    for (uint32_t i = 0; i <= map->count; ++i) {
+        size_t end = i < map->count ? map->extents[i].start : map->size;
+        memset((uint8_t *)map->data + at, value, end - at);
+        if (i < map->count)
+            at = map->extents[i].end;
+    }
+    return 0;
+}
+
+#define FILE_VERIFY_RANGES     16      // mismatching ranges printed before summarizing
+
+struct file_verify {
+    struct ch341_ctx *ctx;  // the report goes to its log, tagged like its other errors
+    const uint8_t *ref;     // image byte matching the next readback byte
+    uint32_t add;           // chip address of the next readback byte
+    uint32_t bad;           // differing bytes
+    uint32_t ranges;        // runs of differing bytes
+    uint32_t start, end;    // the open run, end is exclusive
+    uint64_t cleared;       // bits read as 0 that the image has as 1
+    uint64_t set;           // bits read as 1 that the image has as 0
+};
+
+static void fileVerifyRange(struct file_verify *v)
+{
+    if (v->ranges++ < FILE_VERIFY_RANGES)
+        ch341Log(v->ctx, CH341_LOG_ERROR, "Mismatch at 0x%08x-0x%08x (%u bytes)", v->start, v->end - 1,
+                v->end - v->start);
+}
+
+static void fileVerifyByte(struct file_verify *v, uint32_t add, uint8_t got, uint8_t want)
+{
+    if (v->bad++ > 0 && add == v->end)
+        v->end++;
+    else {
+        if (v->bad > 1)
+            fileVerifyRange(v);
+        v->start = add;
+        v->end = add + 1;
+    }
+    v->cleared += __builtin_popcount(want & ~got & 0xff);
+    v->set += __builtin_popcount(got & ~want & 0xff);
+}
+
+/* compare a word at a time so the loop vectorizes; only differing words are looked at
+ * byte by byte */
+static int32_t fileVerifySink(const uint8_t *data, uint32_t len, void *user)
+{
+    struct file_verify *v = user;
+    uint64_t a, b;
+    uint32_t i, j;
+
+    for (i = 0; i + sizeof(a) <= len; i += sizeof(a)) {
+        memcpy(&a, data + i, sizeof(a));
+        memcpy(&b, v->ref + i, sizeof(b));
+        if (a != b)
+            for (j = i; j < i + sizeof(a); ++j)
+                if (data[j] != v->ref[j])
+                    fileVerifyByte(v, v->add + j, data[j], v->ref[j]);
+    }
+    for (; i < len; ++i)
+        if (data[i] != v->ref[i])
+            fileVerifyByte(v, v->add + i, data[i], v->ref[i]);
+    v->ref += len;
+    v->add += len;
+    return 0;
+}
+
+int32_t fileVerifyChip(struct ch341_ctx *ctx, const uint8_t *ref, uint32_t add, uint32_t len)
+{
+    struct file_verify v;
+
+    memset(&v, 0, sizeof(v));
+    v.ctx = ctx;
+    v.ref = ref;
+    v.add = add;
+    if (ch341SpiReadStream(ctx, add, len, fileVerifySink, &v) < 0)
+        return -1;
+    if (v.bad == 0)
+        return 0;
+    fileVerifyRange(&v);
+    if (v.ranges > FILE_VERIFY_RANGES)
+        ch341Log(ctx, CH341_LOG_ERROR, "... %u more ranges", v.ranges - FILE_VERIFY_RANGES);
+    ch341Log(ctx, CH341_LOG_ERROR, "Verify: %u bytes differ in %u ranges, %llu bits 1->0, %llu bits 0->1",
+            v.bad, v.ranges, (unsigned long long)v.cleared, (unsigned long long)v.set);
+    /* programming only clears bits: a 0 that should be 1 means the sector was not erased */
+    if (v.cleared)
+        ch341Log(ctx, CH341_LOG_ERROR, "Bits that should be 1 read as 0: the area needs an erase.");
+    if (v.set)
+        ch341Log(ctx, CH341_LOG_ERROR,
+                "Bits that should be 0 read as 1: program failed, the chip may be protected or worn.");
+    return v.bad;
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __FILEIO_H__
+#define __FILEIO_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "ch341a.h"
+#include "checksum.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define     FILE_RING_SLOTS        8
+#define     FILE_RING_SLOT_SIZE    (64 * 1024)
+#define     FILE_HOLE_BLOCK        4096     // granularity of the holes in a sparse dump
+
+/* read len bytes of the chip at add into fp; a writer thread drains a fixed ring of
+ * buffers so disk writes overlap the usb transfers, and feeds sum if not NULL. With
+ * hole 0-255, blocks holding only that byte are seeked over instead of written, leaving
+ * holes in the file (where fp can seek); -1 writes everything. */
+int32_t fileReadChip(struct ch341_ctx *ctx, FILE *fp, uint32_t add, uint32_t len, struct checksum *sum,
+        int32_t hole);
+
+/* a range of an input file that holds data, [start, end) */
+struct file_extent {
+    size_t start;
+    size_t end;
+};
+
+/* hash an image on a thread of its own while it is being programmed: the first len bytes,
+ * or only the parts of them in the count extents when extents is not NULL */
+struct file_hash {
+    pthread_t thread;
+    struct checksum *sum;
+    const uint8_t *data;
+    size_t len;
+    const struct file_extent *extents;
+    uint32_t count;
+    bool started;
+};
+
+void fileHashStart(struct file_hash *job, struct checksum *sum, const uint8_t *data, size_t len,
+        const struct file_extent *extents, uint32_t count);
+void fileHashJoin(struct file_hash *job);
+
+/* read the extents of the first len bytes of the chip into fp as fileReadChip does, the
+ * bytes between them written as 0xff (or left as holes when hole is 0xff); reported as
+ * one read of all the extents */
+int32_t fileReadExtents(struct ch341_ctx *ctx, FILE *fp, const struct file_extent *ext, uint32_t count,
+        uint32_t len, struct checksum *sum, int32_t hole);
+
+/* a read-only view of an input file: mmap'ed when it is a regular file, read into
+ * the heap otherwise (pipes, character devices). extents lists where the data is,
+ * from SEEK_DATA/SEEK_HOLE; everything else is a hole. */
+struct file_map {
+    const uint8_t *data;
+    size_t size;
+    bool mapped;
+    struct file_extent *extents;
+    uint32_t count;             // extents
+};
+
+int32_t fileMap(const char *path, struct file_map *map);
+void fileUnmap(struct file_map *map);
+
+/* make the holes of the image read as value instead of zero */
+int32_t fileFillHoles(struct file_map *map, uint8_t value);
+
+/* compare len bytes of the chip at add with ref as the readback arrives, logging the
+ * mismatching address ranges and how many bits flipped each way as errors of ctx; returns
+ * the number of differing bytes, or -1 if the read failed */
+int32_t fileVerifyChip(struct ch341_ctx *ctx, const uint8_t *ref, uint32_t add, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
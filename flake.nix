@@ -22,7 +22,7 @@
         gcc gnumake libusb1 systemdLibs
       ];
       buildPhase = ''
-        gcc ch341a.c main.c -o ch341prog -lusb-1.0
+        gcc bitrev.c ch341a.c ch341bench.c ch341sim.c ch341trace.c ch341tune.c checksum.c chipdb.c fileio.c gang.c imagefmt.c journal.c layout.c main.c -o ch341prog -lusb-1.0 -lpthread
       '';
       installPhase = ''
         mkdir -p $out/bin 
@@ -0,0 +1,229 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include "ch341a.h"
+#include "ch341sim.h"
+#include "ch341tune.h"
+#include "fileio.h"
+#include "gang.h"
+
+struct gang_dev {
+    char path[CH341_PATH_LENGTH];
+    char chip[32];
+    const struct gang_job *job;
+    struct ch341_ctx *ctx;
+    pthread_t thread;
+    bool started;
+    const char *failed;         // the step that failed, NULL when all went well
+    int32_t bad;                // bytes that did not verify
+    double secs;
+};
+
+/* the running gang, for gangStop */
+static struct gang_dev *gangDevs;
+static volatile sig_atomic_t gangCount;
+
+static double gangNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* errors only, tagged with the device they came from */
+static void gangLog(void *user, int32_t level, const char *msg)
+{
+    struct gang_dev *d = user;
+
+    fprintf(stderr, "%s: %s\n", d->path, msg);
+}
+
+static void *gangWorker(void *arg)
+{
+    struct gang_dev *d = arg;
+    struct ch341_ctx *ctx = d->ctx;
+    const struct gang_job *job = d->job;
+    struct ch341_tune tune;
+    const struct file_extent whole = { 0, job->len };
+    const struct file_extent *ext = job->extents ? job->extents : &whole;
+    uint32_t count = job->extents ? job->count : 1;
+    size_t end;
+    double t0 = gangNow();
+    int32_t ret;
+
+    d->failed = "open";
+    ret = job->sim ? ch341SimConfigure(ctx, job->sim) :
+            ch341ConfigurePath(ctx, CH341A_USB_VENDOR, CH341A_USB_PRODUCT, d->path);
+    if (ret < 0)
+        goto done;
+    d->failed = "detect";
+    if (ch341SetStream(ctx, job->speed) < 0 || ch341SpiCapacity(ctx) < 0)
+        goto out;
+    snprintf(d->chip, sizeof(d->chip), "%s", ctx->flash.name ? ctx->flash.name : "unknown");
+    d->failed = "tune";
+    if (job->tuned && ch341TuneLoad(ctx, &tune) < 0)
+        goto out;
+    d->failed = "size";
+    if ((uint64_t)job->offset + job->len > ctx->flash.capacity)
+        goto out;
+    d->failed = "write";
+    for (uint32_t i = 0; i < count && ext[i].start < job->len; ++i) {
+        end = ext[i].end < job->len ? ext[i].end : job->len;
+        ret = job->diff ? ch341SpiDiffWrite(ctx, job->image + ext[i].start, job->offset + ext[i].start,
+                        end - ext[i].start) :
+                ch341SpiWrite(ctx, job->image + ext[i].start, job->offset + ext[i].start, end - ext[i].start);
+        if (ret < 0)
+            goto out;
+    }
+    d->failed = "verify";
+    for (uint32_t i = 0; i < count && ext[i].start < job->len && d->bad == 0; ++i) {
+        end = ext[i].end < job->len ? ext[i].end : job->len;
+        d->bad = fileVerifyChip(ctx, job->image + ext[i].start, job->offset + ext[i].start, end - ext[i].start);
+    }
+    if (d->bad == 0)
+        d->failed = NULL;
+out:
+    ch341Release(ctx);
+done:
+    d->secs = gangNow() - t0;
+    return NULL;
+}
+
+/* fill devs from the device argument, returns how many */
+static int32_t gangDevices(const char *devices, const struct gang_job *job, struct gang_dev *devs)
+{
+    char found[CH341_MAX_DEVICES][CH341_PATH_LENGTH];
+    char *list, *tok, *save = NULL, *end;
+    long want = strtol(devices, &end, 10);
+    int32_t n = 0;
+
+    if (job->sim) {
+        if (*end != '\0' || want < 1 || want > CH341_MAX_DEVICES) {
+            fprintf(stderr, "With --sim, --gang takes the number of programmers (1-%d)\n", CH341_MAX_DEVICES);
+            return -1;
+        }
+        if (strstr(job->sim, "file=")) {
+            fprintf(stderr, "Simulated programmers of a gang cannot share file=\n");
+            return -1;
+        }
+        for (n = 0; n < want; ++n)
+            snprintf(devs[n].path, CH341_PATH_LENGTH, "sim%d", n);
+        return n;
+    }
+    if (!strcmp(devices, "all") || (*end == '\0' && want > 0)) {
+        n = ch341List(CH341A_USB_VENDOR, CH341A_USB_PRODUCT, found, CH341_MAX_DEVICES);
+        if (n < 0) {
+            fprintf(stderr, "Couldn't initialise libusb\n");
+            return -1;
+        }
+        if (*end == '\0' && want < n)
+            n = want;
+        if (n == 0 || (*end == '\0' && n < want)) {
+            fprintf(stderr, "Found %d programmers [%04x:%04x]\n", n, CH341A_USB_VENDOR, CH341A_USB_PRODUCT);
+            return -1;
+        }
+        for (int32_t i = 0; i < n; ++i)
+            memcpy(devs[i].path, found[i], CH341_PATH_LENGTH);
+        return n;
+    }
+    if ((list = strdup(devices)) == NULL)
+        return -1;
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n == CH341_MAX_DEVICES || strlen(tok) >= CH341_PATH_LENGTH) {
+            fprintf(stderr, "Too many or too long device paths in '%s'\n", devices);
+            n = -1;
+            break;
+        }
+        strcpy(devs[n++].path, tok);
+    }
+    free(list);
+    return n;
+}
+
+int32_t gangWrite(const char *devices, const struct gang_job *job)
+{
+    struct gang_dev devs[CH341_MAX_DEVICES];
+    int32_t n, i, failed = 0, ret = -1;
+    double t0, secs;
+
+    memset(devs, 0, sizeof(devs));
+    n = gangDevices(devices, job, devs);
+    if (n <= 0)
+        return -1;
+    for (i = 0; i < n; ++i) {
+        if ((devs[i].ctx = ch341New()) == NULL) {
+            fprintf(stderr, "gangWrite: out of memory\n");
+            goto out;
+        }
+        ch341SetLog(devs[i].ctx, gangLog, &devs[i], CH341_LOG_ERROR);
+        ch341SetQueueDepth(devs[i].ctx, job->queue_depth);
+        ch341SetReadMode(devs[i].ctx, job->read_mode);
+    }
+    gangDevs = devs;
+    gangCount = n;
+    printf("Programming %u bytes at 0x%x on %d programmers\n", job->len, job->offset, n);
+    t0 = gangNow();
+    for (i = 0; i < n; ++i) {
+        devs[i].job = job;
+        devs[i].failed = "start";
+        devs[i].started = pthread_create(&devs[i].thread, NULL, gangWorker, &devs[i]) == 0;
+    }
+    for (i = 0; i < n; ++i)
+        if (devs[i].started)
+            pthread_join(devs[i].thread, NULL);
+    secs = gangNow() - t0;
+    gangCount = 0;
+
+    printf("\n%-16s %-16s %-24s %s\n", "Device", "Chip", "Result", "Time");
+    for (i = 0; i < n; ++i) {
+        char result[32];
+
+        if (devs[i].failed == NULL)
+            snprintf(result, sizeof(result), "ok");
+        else if (devs[i].bad > 0)
+            snprintf(result, sizeof(result), "verify: %d bytes differ", devs[i].bad);
+        else
+            snprintf(result, sizeof(result), "failed: %s", devs[i].failed);
+        printf("%-16s %-16s %-24s %.1f s\n", devs[i].path, devs[i].chip[0] ? devs[i].chip : "-",
+                result, devs[i].secs);
+        if (devs[i].failed)
+            failed++;
+    }
+    printf("%d of %d programmers passed in %.1f s, %.0f bytes per second in total\n",
+            n - failed, n, secs, secs > 0 ? (double)(n - failed) * job->len / secs : 0.0);
+    ret = failed;
+out:
+    for (i = 0; i < n; ++i)
+        ch341Free(devs[i].ctx);
+    return ret;
+}
+
+void gangStop(void)
+{
+    for (int32_t i = 0; i < gangCount; ++i)
+        ch341Stop(gangDevs[i].ctx);
+}
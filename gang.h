@@ -0,0 +1,58 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __GANG_H__
+#define __GANG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fileio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* what every programmer of the gang does */
+struct gang_job {
+    const uint8_t *image;
+    uint32_t len;
+    const struct file_extent *extents; // the ranges of image to program, in order; NULL for all of it
+    uint32_t count;
+    uint32_t offset;
+    uint32_t speed;         // ch341SetStream
+    uint32_t queue_depth;   // ch341SetQueueDepth
+    uint32_t read_mode;     // ch341SetReadMode
+    bool diff;              // ch341SpiDiffWrite instead of ch341SpiWrite
+    bool tuned;             // each device starts from its cached autotune setting, if any
+    const char *sim;        // simulator spec, NULL for real devices
+};
+
+/* Write and verify job->image on several programmers at once, each from a thread of
+ * its own, and print a result line per device. devices is "all", a count of devices
+ * to take, or a comma separated list of usb port paths ("1-1.2,1-1.3"); with a
+ * simulator it is the number of simulated programmers. Returns the number of devices
+ * that failed, or -1 if none could be started. */
+int32_t gangWrite(const char *devices, const struct gang_job *job);
+
+/* ch341Stop every programmer of the gang that is running; async-signal-safe */
+void gangStop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include "fileio.h"
+#include "imagefmt.h"
+
+#define IMAGE_RECORD_MAX    256         // data bytes of the longest HEX or S-record line
+#define IMAGE_PT_LOAD       1
+
+static const struct {
+    const char *name;
+    int32_t format;
+} imageNames[] = {
+    { "auto", IMAGE_AUTO }, { "raw", IMAGE_RAW }, { "ihex", IMAGE_IHEX }, { "srec", IMAGE_SREC }, { "elf", IMAGE_ELF },
+};
+
+static const struct {
+    const char *ext;
+    int32_t format;
+} imageExts[] = {
+    { ".hex", IMAGE_IHEX }, { ".ihx", IMAGE_IHEX }, { ".ihex", IMAGE_IHEX },
+    { ".srec", IMAGE_SREC }, { ".s19", IMAGE_SREC }, { ".s28", IMAGE_SREC }, { ".s37", IMAGE_SREC },
+    { ".mot", IMAGE_SREC }, { ".elf", IMAGE_ELF },
+};
+
+/* the image being laid out */
+struct image_build {
+    const char *path;
+    uint64_t base;              // the file address of buf[0]
+    uint8_t *buf;
+    size_t size;                // highest address written, plus one
+    size_t room;
+    struct file_extent *ext;
+    uint32_t count;
+    uint32_t ext_room;
+    bool failed;                // imagePut refused data, and has said why
+};
+
+int32_t imageFormat(const char *name)
+{
+    for (size_t i = 0; i < sizeof(imageNames) / sizeof(imageNames[0]); ++i)
+        if (!strcmp(name, imageNames[i].name))
+            return imageNames[i].format;
+    return -2;
+}
+
+const char *imageFormatName(int32_t format)
+{
+    for (size_t i = 0; i < sizeof(imageNames) / sizeof(imageNames[0]); ++i)
+        if (imageNames[i].format == format)
+            return imageNames[i].name;
+    return "unknown";
+}
+
+/* copy len bytes to the file address add, growing the buffer with 0xff padding */
+static int32_t imagePut(struct image_build *b, uint64_t add, const uint8_t *data, uint64_t len)
+{
+    struct file_extent *e;
+    size_t room;
+    uint8_t *p;
+
+    if (len == 0)
+        return 0;
+    if (add < b->base) {
+        fprintf(stderr, "%s: data at 0x%llx is below the base 0x%llx\n", b->path, (unsigned long long)add,
+                (unsigned long long)b->base);
+        b->failed = true;
+        return -1;
+    }
+    if (add - b->base + len > IMAGE_MAX_SIZE) {
+        fprintf(stderr, "%s: data at 0x%llx is beyond %u MB%s\n", b->path, (unsigned long long)add,
+                IMAGE_MAX_SIZE >> 20, b->base ? " from the base" : ", give its base address with --base");
+        b->failed = true;
+        return -1;
+    }
+    add -= b->base;
+    if (add + len > b->room) {
+        room = b->room ? b->room * 2 : FILE_RING_SLOT_SIZE;
+        if (room < add + len)
+            room = add + len;
+        if (room > IMAGE_MAX_SIZE)
+            room = IMAGE_MAX_SIZE;
+        if ((p = realloc(b->buf, room)) == NULL)
+            goto nomem;
+        memset(p + b->room, 0xff, room - b->room);
+        b->buf = p;
+        b->room = room;
+    }
+    memcpy(b->buf + add, data, len);
+    if (add + len > b->size)
+        b->size = add + len;
+    /* records mostly follow each other */
+    if (b->count > 0 && b->ext[b->count - 1].end == add) {
+        b->ext[b->count - 1].end += len;
+        return 0;
+    }
+    if (b->count == b->ext_room) {
+        b->ext_room = b->ext_room ? b->ext_room * 2 : 16;
+        if ((e = realloc(b->ext, b->ext_room * sizeof(*e))) == NULL)
+            goto nomem;
+        b->ext = e;
+    }
+    b->ext[b->count].start = add;
+    b->ext[b->count].end = add + len;
+    b->count++;
+    return 0;
+nomem:
+    fprintf(stderr, "imageLoad: out of memory\n");
+    b->failed = true;
+    return -1;
+}
+
+static int imageExtentCompare(const void *a, const void *b)
+{
+    const struct file_extent *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* sort the extents and join those that touch or overlap */
+static void imageMerge(struct image_build *b)
+{
+    uint32_t n = 0;
+
+    qsort(b->ext, b->count, sizeof(b->ext[0]), imageExtentCompare);
+    for (uint32_t i = 0; i < b->count; ++i) {
+        if (n > 0 && b->ext[i].start <= b->ext[n - 1].end) {
+            if (b->ext[i].end > b->ext[n - 1].end)
+                b->ext[n - 1].end = b->ext[i].end;
+        } else
+            b->ext[n++] = b->ext[i];
+    }
+    b->count = n;
+}
+
+/* decode n bytes from 2n hex digits */
+static int32_t imageHex(const char *p, uint32_t n, uint8_t *out)
+{
+    uint8_t v;
+
+    for (uint32_t i = 0; i < 2 * n; ++i) {
+        if (p[i] >= '0' && p[i] <= '9')
+            v = p[i] - '0';
+        else if ((p[i] | 0x20) >= 'a' && (p[i] | 0x20) <= 'f')
+            v = (p[i] | 0x20) - 'a' + 10;
+        else
+            return -1;
+        out[i / 2] = (i & 1) ? (out[i / 2] << 4) | v : v;
+    }
+    return 0;
+}
+
+/* ":LLAAAATT<data>CC"; base is the extended segment or linear address in force */
+static int32_t imageIhex(struct image_build *b, const char *line, size_t n, uint32_t *base, bool *end)
+{
+    uint8_t rec[IMAGE_RECORD_MAX + 5], sum = 0;
+    uint32_t count = (n - 1) / 2;
+
+    if (n < 11 || line[0] != ':' || (n - 1) % 2 || count > sizeof(rec) || imageHex(line + 1, count, rec) < 0 ||
+            rec[0] + 5u != count)
+        return -1;
+    for (uint32_t i = 0; i < count; ++i)
+        sum += rec[i];
+    if (sum != 0)
+        return -1;
+    switch (rec[3]) {
+        case 0x00: // data
+            return imagePut(b, (uint64_t)*base + (rec[1] << 8 | rec[2]), rec + 4, rec[0]);
+        case 0x01: // end of file
+            *end = true;
+            return 0;
+        case 0x02: // extended segment address
+        case 0x04: // extended linear address
+            if (rec[0] != 2)
+                return -1;
+            *base = (uint32_t)(rec[4] << 8 | rec[5]) << (rec[3] == 0x02 ? 4 : 16);
+            return 0;
+        case 0x03: // start addresses, nothing to program
+        case 0x05:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/* "STCC<address><data>SS" with a 2, 3 or 4 byte address */
+static int32_t imageSrec(struct image_build *b, const char *line, size_t n, bool *end)
+{
+    static const uint8_t addrLen[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+    uint8_t rec[IMAGE_RECORD_MAX], sum = 0;
+    uint32_t count = (n - 2) / 2, add = 0, alen, type;
+
+    if (n < 4 || line[0] != 'S' || line[1] < '0' || line[1] > '9' || n % 2 || count > sizeof(rec) ||
+            imageHex(line + 2, count, rec) < 0 || rec[0] + 1u != count)
+        return -1;
+    type = line[1] - '0';
+    alen = addrLen[type];
+    if (alen == 0 || rec[0] < alen + 1)
+        return -1;
+    for (uint32_t i = 0; i < count; ++i)
+        sum += rec[i];
+    if (sum != 0xff)
+        return -1;
+    for (uint32_t i = 0; i < alen; ++i)
+        add = add << 8 | rec[1 + i];
+    if (type >= 1 && type <= 3)
+        return imagePut(b, add, rec + 1 + alen, rec[0] - alen - 1);
+    if (type >= 7)
+        *end = true;
+    return 0; // header and record counts
+}
+
+/* Intel HEX and S-records, a record per line up to the end record */
+static int32_t imageText(struct image_build *b, const struct file_map *raw, int32_t format)
+{
+    const char *p = (const char *)raw->data, *stop = p + raw->size, *eol;
+    uint32_t base = 0, line = 0;
+    bool end = false;
+    size_t n;
+
+    for (; p < stop && !end; p = eol + 1) {
+        line++;
+        if ((eol = memchr(p, '\n', stop - p)) == NULL)
+            eol = stop;
+        for (n = eol - p; n > 0 && (p[n - 1] == '\r' || p[n - 1] == ' ' || p[n - 1] == '\t'); --n)
+            ;
+        if (n == 0)
+            continue;
+        if ((format == IMAGE_IHEX ? imageIhex(b, p, n, &base, &end) : imageSrec(b, p, n, &end)) < 0) {
+            if (!b->failed)
+                fprintf(stderr, "%s:%u: not a valid %s\n", b->path, line,
+                        format == IMAGE_IHEX ? "Intel HEX record" : "S-record");
+            return -1;
+        }
+    }
+    if (!end)
+        fprintf(stderr, "%s: no end record, the file may be cut short\n", b->path);
+    return 0;
+}
+
+static uint64_t imageWord(const uint8_t *p, uint32_t n, bool big)
+{
+    uint64_t v = 0;
+
+    for (uint32_t i = 0; i < n; ++i)
+        v |= (uint64_t)p[big ? i : n - 1 - i] << (8 * (n - 1 - i));
+    return v;
+}
+
+/* the file contents of every PT_LOAD segment, at its physical (load) address */
+static int32_t imageElf(struct image_build *b, const uint8_t *p, size_t size)
+{
+    bool wide, big;
+    uint64_t phoff, entsize, phnum, off, paddr, filesz;
+    const uint8_t *ph;
+
+    if (size < 52 || memcmp(p, "\x7f" "ELF", 4) != 0 || (p[4] != 1 && p[4] != 2) || (p[5] != 1 && p[5] != 2))
+        goto bad;
+    wide = p[4] == 2;
+    big = p[5] == 2;
+    if (wide && size < 64)
+        goto bad;
+    phoff = imageWord(p + (wide ? 32 : 28), wide ? 8 : 4, big);
+    entsize = imageWord(p + (wide ? 54 : 42), 2, big);
+    phnum = imageWord(p + (wide ? 56 : 44), 2, big);
+    if (entsize < (wide ? 56u : 32u) || phoff > size || phnum * entsize > size - phoff)
+        goto bad;
+    for (uint64_t i = 0; i < phnum; ++i) {
+        ph = p + phoff + i * entsize;
+        if (imageWord(ph, 4, big) != IMAGE_PT_LOAD)
+            continue;
+        off = imageWord(ph + (wide ? 8 : 4), wide ? 8 : 4, big);
+        paddr = imageWord(ph + (wide ? 24 : 12), wide ? 8 : 4, big);
+        filesz = imageWord(ph + (wide ? 32 : 16), wide ? 8 : 4, big);
+        if (off > size || filesz > size - off)
+            goto bad;
+        if (imagePut(b, paddr, p + off, filesz) < 0)
+            return -1;
+    }
+    return 0;
+bad:
+    fprintf(stderr, "%s: not a valid ELF file\n", b->path);
+    return -1;
+}
+
+static int32_t imageDetect(const char *path, const struct file_map *raw)
+{
+    size_t n = strlen(path), e;
+
+    for (size_t i = 0; i < sizeof(imageExts) / sizeof(imageExts[0]); ++i) {
+        e = strlen(imageExts[i].ext);
+        if (n > e && !strcasecmp(path + n - e, imageExts[i].ext))
+            return imageExts[i].format;
+    }
+    if (raw->size >= 4 && memcmp(raw->data, "\x7f" "ELF", 4) == 0)
+        return IMAGE_ELF;
+    return IMAGE_RAW;
+}
+
+int32_t imageLoad(const char *path, int32_t format, uint32_t base, struct file_map *map)
+{
+    struct image_build b = { .path = path, .base = base };
+    struct file_map raw;
+    int32_t ret;
+
+    if (fileMap(path, &raw) < 0)
+        return -1;
+    if (format == IMAGE_AUTO)
+        format = imageDetect(path, &raw);
+    if (format == IMAGE_RAW) {
+        if (base != 0) {
+            fprintf(stderr, "%s: a raw image has no addresses to take the base from, use --offset\n", path);
+            fileUnmap(&raw);
+            return -1;
+        }
+        *map = raw;
+        return IMAGE_RAW;
+    }
+    ret = format == IMAGE_ELF ? imageElf(&b, raw.data, raw.size) : imageText(&b, &raw, format);
+    fileUnmap(&raw);
+    if (ret == 0 && b.count == 0) {
+        fprintf(stderr, "%s: no data to program\n", path);
+        ret = -1;
+    }
+    if (ret < 0) {
+        free(b.buf);
+        free(b.ext);
+        return -1;
+    }
+    imageMerge(&b);
+    memset(map, 0, sizeof(*map));
+    map->data = b.buf;
+    map->size = b.size;
+    map->extents = b.ext;
+    map->count = b.count;
+    return format;
+}
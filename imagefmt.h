@@ -0,0 +1,51 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __IMAGEFMT_H__
+#define __IMAGEFMT_H__
+
+#include <stdint.h>
+#include "fileio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define     IMAGE_AUTO      -1          // by file name extension, or the ELF magic
+#define     IMAGE_RAW       0           // a plain binary, written from --offset
+#define     IMAGE_IHEX      1           // Intel HEX
+#define     IMAGE_SREC      2           // Motorola S-record
+#define     IMAGE_ELF       3           // the PT_LOAD segments of an ELF file, at their physical address
+
+#define     IMAGE_MAX_SIZE  (256u << 20) // highest address a segment may reach, above the base
+
+/* the IMAGE_* value of a --format name, -2 if it is none */
+int32_t imageFormat(const char *name);
+const char *imageFormatName(int32_t format);
+
+/* Load the image at path into map, returning the IMAGE_* format it had. A raw image is
+ * fileMap'ed as it is. The others are laid out at their addresses less base (0x08000000
+ * for a part executing in place from there) in a heap buffer padded with 0xff, with
+ * map->extents listing the ranges the file covers, merged and in address order; data
+ * below base is an error, and so is a base for a raw image. */
+int32_t imageLoad(const char *path, int32_t format, uint32_t base, struct file_map *map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
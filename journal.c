@@ -0,0 +1,260 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "ch341a.h"
+#include "checksum.h"
+#include "fileio.h"
+#include "journal.h"
+
+#define JOURNAL_VERSION     1
+
+/* append a done chunk and push it to disk, so a crash never records more than was done */
+static int32_t journalRecord(struct journal *j, uint32_t i, uint32_t crc)
+{
+    j->done[i] = true;
+    j->crc[i] = crc;
+    if (fprintf(j->fp, "%u %08x\n", i, crc) < 0 || fflush(j->fp) != 0 || fsync(fileno(j->fp)) < 0) {
+        fprintf(stderr, "Error writing the journal %s\n", j->path);
+        return -1;
+    }
+    return 0;
+}
+
+int32_t journalOpen(struct journal *j, const char *path, const char *job,
+        const struct spi_flash_info *flash, uint32_t add, uint32_t len, bool resume)
+{
+    char header[160], line[160];
+    uint32_t i, crc, done = 0;
+    FILE *fp;
+
+    memset(j, 0, sizeof(*j));
+    j->add = add;
+    j->len = len;
+    j->chunks = (len + JOURNAL_CHUNK - 1) / JOURNAL_CHUNK;
+    j->path = strdup(path);
+    j->crc = calloc(j->chunks + 1, sizeof(uint32_t));
+    j->done = calloc(j->chunks + 1, sizeof(bool));
+    if (!j->path || !j->crc || !j->done) {
+        fprintf(stderr, "journalOpen: out of memory\n");
+        goto fail;
+    }
+    snprintf(header, sizeof(header), "ch341prog journal %d %s %s %u 0x%08x %u %u\n", JOURNAL_VERSION, job,
+            flash->name ? flash->name : "unknown", flash->capacity, add, len, JOURNAL_CHUNK);
+
+    if (resume && (fp = fopen(path, "r")) != NULL) {
+        if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, header) != 0) {
+            fprintf(stderr, "%s is a journal for another job, chip or range, not resuming.\n", path);
+            fclose(fp);
+            goto fail;
+        }
+        /* a line torn by a crash only loses its chunk, which is then done again */
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "%u %x", &i, &crc) != 2 || i >= j->chunks || strchr(line, '\n') == NULL)
+                continue;
+            done += !j->done[i];
+            j->done[i] = true;
+            j->crc[i] = crc;
+        }
+        fclose(fp);
+        printf("Resuming from %s: %u of %u chunks done\n", path, done, j->chunks);
+    }
+
+    /* start the file over with what is known, dropping duplicates and torn lines */
+    if ((j->fp = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "Couldn't open journal %s for writing.\n", path);
+        goto fail;
+    }
+    if (fputs(header, j->fp) < 0)
+        goto fail_write;
+    for (i = 0; i < j->chunks; ++i)
+        if (j->done[i] && fprintf(j->fp, "%u %08x\n", i, j->crc[i]) < 0)
+            goto fail_write;
+    if (fflush(j->fp) != 0 || fsync(fileno(j->fp)) < 0)
+        goto fail_write;
+    return 0;
+fail_write:
+    fprintf(stderr, "Error writing the journal %s\n", path);
+fail:
+    journalClose(j, false);
+    return -1;
+}
+
+/* bytes of chunk i, the last one may be short */
+static uint32_t journalChunkLen(const struct journal *j, uint32_t i)
+{
+    uint32_t off = i * JOURNAL_CHUNK;
+
+    return j->len - off < JOURNAL_CHUNK ? j->len - off : JOURNAL_CHUNK;
+}
+
+/* the engine reports each chunk as an operation of its own, so its progress and messages are
+ * held back and progress is given per chunk over the whole range instead */
+static void journalBegin(struct ch341_ctx *ctx, struct journal *j)
+{
+    j->progress = ctx->progress;
+    j->log_level = ctx->log_level;
+    if (j->progress)
+        j->progress(ctx->progress_user, CH341_PROGRESS_BEGIN, 0, j->len);
+    ctx->progress = NULL;
+    ctx->log_level = CH341_LOG_ERROR;
+}
+
+static void journalUpdate(struct ch341_ctx *ctx, struct journal *j, uint32_t done)
+{
+    if (j->progress)
+        j->progress(ctx->progress_user, CH341_PROGRESS_UPDATE, done, j->len);
+}
+
+static void journalEnd(struct ch341_ctx *ctx, struct journal *j, uint32_t done)
+{
+    ctx->progress = j->progress;
+    ctx->log_level = j->log_level;
+    if (j->progress)
+        j->progress(ctx->progress_user, CH341_PROGRESS_END, done, j->len);
+}
+
+static bool journalStopped(struct ch341_ctx *ctx, const char *what)
+{
+    if (!ctx->stop)
+        return false;
+    ctx->stop = 0;
+    ch341Log(ctx, CH341_LOG_ERROR, "Stopped, %s unfinished.", what);
+    return true;
+}
+
+int32_t journalRead(struct ch341_ctx *ctx, struct journal *j, const char *path, struct checksum *sum)
+{
+    uint32_t i, n, off, crc, skipped = 0;
+    int32_t ret = -1;
+    uint8_t *buf;
+    FILE *fp = NULL;
+
+    for (i = 0; i < j->chunks && !j->done[i]; ++i)
+        ;
+    /* keep what an earlier run read; without it nothing recorded can be trusted */
+    if (i < j->chunks && (fp = fopen(path, "r+b")) == NULL)
+        memset(j->done, 0, j->chunks * sizeof(bool));
+    if (fp == NULL && (fp = fopen(path, "wb")) == NULL) {
+        fprintf(stderr, "Couldn't open file %s for writing.\n", path);
+        return -1;
+    }
+    if ((buf = malloc(JOURNAL_CHUNK)) == NULL) {
+        fprintf(stderr, "journalRead: out of memory\n");
+        fclose(fp);
+        return -1;
+    }
+
+    journalBegin(ctx, j);
+    for (i = 0; i < j->chunks; ++i) {
+        off = i * JOURNAL_CHUNK;
+        n = journalChunkLen(j, i);
+        if (journalStopped(ctx, "reading"))
+            goto out;
+        if (j->done[i] && fseeko(fp, off, SEEK_SET) == 0 && fread(buf, 1, n, fp) == n &&
+                checksumCrc32(buf, n) == j->crc[i]) {
+            skipped++;
+        } else {
+            clearerr(fp);
+            if (ch341SpiRead(ctx, buf, j->add + off, n) < 0)
+                goto out;
+            crc = checksumCrc32(buf, n);
+            /* the data is on disk before the journal says so */
+            if (fseeko(fp, off, SEEK_SET) != 0 || fwrite(buf, 1, n, fp) != n || fflush(fp) != 0 ||
+                    fsync(fileno(fp)) < 0) {
+                fprintf(stderr, "Error writing the output file\n");
+                goto out;
+            }
+            if (journalRecord(j, i, crc) < 0)
+                goto out;
+        }
+        if (sum)
+            checksumUpdate(sum, buf, n);
+        journalUpdate(ctx, j, off + n);
+    }
+    ret = 0;
+out:
+    journalEnd(ctx, j, ret == 0 ? j->len : i * JOURNAL_CHUNK);
+    if (skipped)
+        printf("Skipped %u of %u chunks read before\n", skipped, j->chunks);
+    free(buf);
+    if (fclose(fp) != 0 && ret == 0) {
+        fprintf(stderr, "Error writing the output file\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+int32_t journalWrite(struct ch341_ctx *ctx, struct journal *j, const uint8_t *image, bool diff)
+{
+    uint32_t i, n, off, crc, skipped = 0;
+    int32_t ret = -1, bad;
+
+    journalBegin(ctx, j);
+    for (i = 0; i < j->chunks; ++i) {
+        off = i * JOURNAL_CHUNK;
+        n = journalChunkLen(j, i);
+        if (journalStopped(ctx, "writing"))
+            goto out;
+        crc = checksumCrc32(image + off, n);
+        if (j->done[i] && j->crc[i] == crc) {
+            skipped++;
+        } else {
+            if ((diff ? ch341SpiDiffWrite(ctx, image + off, j->add + off, n)
+                      : ch341SpiWrite(ctx, image + off, j->add + off, n)) < 0) {
+                fprintf(stderr, "Write failed at 0x%08x.\n", j->add + off);
+                goto out;
+            }
+            bad = fileVerifyChip(ctx, image + off, j->add + off, n);
+            if (bad != 0) {
+                if (bad > 0)
+                    fprintf(stderr, "Error while writing at 0x%08x. Check your device.\n", j->add + off);
+                goto out;
+            }
+            if (journalRecord(j, i, crc) < 0)
+                goto out;
+        }
+        journalUpdate(ctx, j, off + n);
+    }
+    ret = 0;
+out:
+    journalEnd(ctx, j, ret == 0 ? j->len : i * JOURNAL_CHUNK);
+    if (skipped)
+        printf("Skipped %u of %u chunks written and verified before\n", skipped, j->chunks);
+    return ret;
+}
+
+void journalClose(struct journal *j, bool complete)
+{
+    if (j->fp) {
+        fclose(j->fp);
+        if (complete)
+            remove(j->path);
+        else
+            fprintf(stderr, "Journal kept in %s, run again with --resume to continue.\n", j->path);
+    }
+    free(j->path);
+    free(j->crc);
+    free(j->done);
+    memset(j, 0, sizeof(*j));
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include "ch341a.h"
+#include "checksum.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define     JOURNAL_CHUNK       (256 * 1024)
+
+/* A journal records the chunks of a long read or write that are done, with the
+ * CRC32 of each, so an interrupted run can go on where it stopped. It is a text
+ * file: a header line naming the job, chip and range, then "<chunk> <crc32>"
+ * lines, each flushed to disk before the next chunk starts. */
+struct journal {
+    char *path;
+    FILE *fp;
+    uint32_t add;
+    uint32_t len;
+    uint32_t chunks;
+    uint32_t *crc;              // per chunk, valid where done is set
+    bool *done;
+    ch341_progress_fn progress; // held while the journal runs the engine
+    int32_t log_level;
+};
+
+/* open the journal at path for job ("read", "write" or "diff-write") on len bytes
+ * at add; with resume, the chunks of an existing journal for the same job, chip
+ * and range are taken as done, a journal for anything else is an error */
+int32_t journalOpen(struct journal *j, const char *path, const char *job,
+        const struct spi_flash_info *flash, uint32_t add, uint32_t len, bool resume);
+
+/* read the range into the file at path, skipping the done chunks whose file
+ * content still has the recorded CRC; feeds sum if not NULL */
+int32_t journalRead(struct ch341_ctx *ctx, struct journal *j, const char *path, struct checksum *sum);
+
+/* write image over the range a chunk at a time, each verified before it is
+ * recorded; done chunks with the CRC of the same image data are skipped */
+int32_t journalWrite(struct ch341_ctx *ctx, struct journal *j, const uint8_t *image, bool diff);
+
+/* close the journal, removing the file once the whole range is done */
+void journalClose(struct journal *j, bool complete);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#define _GNU_SOURCE                     // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include "ch341a.h"
+#include "fileio.h"
+#include "layout.h"
+
+#define FMAP_SIGNATURE      "__FMAP__"
+#define FMAP_HEADER_SIZE    56          // signature, version, base, size, name, area count
+#define FMAP_AREA_SIZE      42          // offset, size, name, flags
+
+static uint32_t layoutLe(const uint8_t *p, uint32_t n)
+{
+    uint32_t v = 0;
+
+    while (n--)
+        v = v << 8 | p[n];
+    return v;
+}
+
+static int32_t layoutAdd(struct layout *l, uint64_t start, uint64_t end, const char *name, size_t len)
+{
+    struct layout_region *r;
+
+    if (l->count == LAYOUT_MAX_REGIONS || start >= end || end > 0x100000000ULL)
+        return -1;
+    r = &l->region[l->count++];
+    r->start = start;
+    r->end = end;
+    if (len >= LAYOUT_NAME_LENGTH)
+        len = LAYOUT_NAME_LENGTH - 1;
+    memcpy(r->name, name, len);
+    r->name[len] = 0;
+    r->included = false;
+    return 0;
+}
+
+int32_t layoutLoad(struct layout *l, const char *path)
+{
+    char line[256], *p, *end, *name;
+    unsigned long long start, last;
+    uint32_t n = 0;
+    FILE *fp;
+
+    l->count = 0;
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Couldn't open layout file %s.\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        n++;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = 0;
+        for (p = line; isspace((unsigned char)*p); ++p)
+            ;
+        if (*p == 0)
+            continue;
+        start = strtoull(p, &end, 16);
+        if (end == p || *end != ':')
+            goto bad;
+        p = end + 1;
+        last = strtoull(p, &end, 16);
+        if (end == p || !isspace((unsigned char)*end))
+            goto bad;
+        for (name = end; isspace((unsigned char)*name); ++name)
+            ;
+        for (end = name; *end && !isspace((unsigned char)*end); ++end)
+            ;
+        if (end == name || last < start || layoutAdd(l, start, last + 1, name, end - name) < 0)
+            goto bad;
+    }
+    fclose(fp);
+    if (l->count == 0) {
+        fprintf(stderr, "%s: no regions\n", path);
+        return -1;
+    }
+    return 0;
+bad:
+    fprintf(stderr, "%s:%u: expected \"<start>:<end> <name>\" in hex\n", path, n);
+    fclose(fp);
+    return -1;
+}
+
+/* the FMAP at p, which starts with the signature */
+static int32_t layoutFmapAt(struct layout *l, const uint8_t *p, size_t len)
+{
+    const uint8_t *a;
+    uint32_t areas;
+
+    if (len < FMAP_HEADER_SIZE || p[8] != 1)
+        return -1;
+    areas = layoutLe(p + 54, 2);
+    if (areas == 0 || areas > LAYOUT_MAX_REGIONS || (size_t)areas * FMAP_AREA_SIZE > len - FMAP_HEADER_SIZE)
+        return -1;
+    l->count = 0;
+    for (uint32_t i = 0; i < areas; ++i) {
+        a = p + FMAP_HEADER_SIZE + i * FMAP_AREA_SIZE;
+        if (layoutAdd(l, layoutLe(a, 4), (uint64_t)layoutLe(a, 4) + layoutLe(a + 4, 4), (const char *)a + 8,
+                    strnlen((const char *)a + 8, 32)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int32_t layoutFmap(struct layout *l, const uint8_t *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while ((p = memmem(p, len - (p - data), FMAP_SIGNATURE, 8)) != NULL) {
+        if (layoutFmapAt(l, p, len - (p - data)) == 0)
+            return 0;
+        p++;
+    }
+    l->count = 0;
+    return -1;
+}
+
+/* the FMAP at add on the chip, if there is one */
+static int32_t layoutFmapProbe(struct ch341_ctx *ctx, struct layout *l, uint32_t add)
+{
+    uint8_t head[FMAP_HEADER_SIZE], *buf;
+    uint32_t len;
+    int32_t ret;
+
+    if (ch341SpiRead(ctx, head, add, 8) < 0)
+        return -2;
+    if (memcmp(head, FMAP_SIGNATURE, 8) != 0 || add + FMAP_HEADER_SIZE > ctx->flash.capacity)
+        return -1;
+    if (ch341SpiRead(ctx, head, add, FMAP_HEADER_SIZE) < 0)
+        return -2;
+    len = FMAP_HEADER_SIZE + layoutLe(head + 54, 2) * FMAP_AREA_SIZE;
+    if (add + len > ctx->flash.capacity || (buf = malloc(len)) == NULL)
+        return -1;
+    ret = ch341SpiRead(ctx, buf, add, len) < 0 ? -2 : layoutFmapAt(l, buf, len);
+    free(buf);
+    return ret;
+}
+
+int32_t layoutFmapChip(struct ch341_ctx *ctx, struct layout *l)
+{
+    ch341_progress_fn progress = ctx->progress;
+    int32_t level = ctx->log_level;
+    int32_t ret;
+
+    /* offset 0, then the odd multiples of each stride: the even ones were seen at the one before */
+    ctx->progress = NULL;
+    ctx->log_level = CH341_LOG_ERROR;
+    ret = layoutFmapProbe(ctx, l, 0);
+    for (uint32_t stride = ctx->flash.capacity / 2; stride >= LAYOUT_FMAP_STRIDE && ret == -1; stride /= 2)
+        for (uint32_t add = stride; add < ctx->flash.capacity && ret == -1; add += 2 * stride)
+            ret = layoutFmapProbe(ctx, l, add);
+    ctx->progress = progress;
+    ctx->log_level = level;
+    if (ret == -1)
+        fprintf(stderr, "No FMAP found on the chip, give the regions with --layout\n");
+    return ret < 0 ? -1 : 0;
+}
+
+int32_t layoutInclude(struct layout *l, const char *name)
+{
+    for (uint32_t i = 0; i < l->count; ++i) {
+        if (!strcmp(l->region[i].name, name)) {
+            l->region[i].included = true;
+            return i;
+        }
+    }
+    fprintf(stderr, "No region called %s in the layout\n", name);
+    return -1;
+}
+
+static int layoutCompare(const void *a, const void *b)
+{
+    const struct file_extent *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+struct file_extent *layoutExtents(const struct layout *l, const struct file_extent *in, uint32_t n,
+        uint32_t *count)
+{
+    struct file_extent sel[LAYOUT_MAX_REGIONS], *out;
+    uint32_t m = 0, k = 0, i = 0, j = 0;
+    size_t start, end;
+
+    for (uint32_t r = 0; r < l->count; ++r) {
+        if (l->region[r].included) {
+            sel[m].start = l->region[r].start;
+            sel[m++].end = l->region[r].end;
+        }
+    }
+    qsort(sel, m, sizeof(sel[0]), layoutCompare);
+    for (uint32_t r = 0; r < m; ++r) {   // regions may overlap
+        if (k > 0 && sel[r].start <= sel[k - 1].end) {
+            if (sel[r].end > sel[k - 1].end)
+                sel[k - 1].end = sel[r].end;
+        } else
+            sel[k++] = sel[r];
+    }
+    if ((out = malloc((n + k + 1) * sizeof(*out))) == NULL) {
+        fprintf(stderr, "layoutExtents: out of memory\n");
+        return NULL;
+    }
+    *count = 0;
+    while (i < n && j < k) {
+        start = in[i].start > sel[j].start ? in[i].start : sel[j].start;
+        end = in[i].end < sel[j].end ? in[i].end : sel[j].end;
+        if (start < end) {
+            out[*count].start = start;
+            out[(*count)++].end = end;
+        }
+        if (in[i].end < sel[j].end)
+            i++;
+        else
+            j++;
+    }
+    return out;
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __LAYOUT_H__
+#define __LAYOUT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ch341a.h"
+#include "fileio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define     LAYOUT_MAX_REGIONS      128
+#define     LAYOUT_NAME_LENGTH      33      // FMAP area names are up to 32 bytes
+#define     LAYOUT_FMAP_STRIDE      4096    // smallest alignment an FMAP is looked for at on the chip
+
+/* a named range of the chip, [start, end) */
+struct layout_region {
+    uint32_t start;
+    uint32_t end;
+    char name[LAYOUT_NAME_LENGTH];
+    bool included;
+};
+
+struct layout {
+    struct layout_region region[LAYOUT_MAX_REGIONS];
+    uint32_t count;
+};
+
+/* a flashrom layout file, one "<start>:<end> <name>" line per region with inclusive
+ * hex addresses; # starts a comment */
+int32_t layoutLoad(struct layout *l, const char *path);
+
+/* the areas of the first valid FMAP in data, -1 if there is none */
+int32_t layoutFmap(struct layout *l, const uint8_t *data, size_t len);
+
+/* look for an FMAP on the chip at every LAYOUT_FMAP_STRIDE aligned offset, the widest
+ * alignments first, reading only its signature at each */
+int32_t layoutFmapChip(struct ch341_ctx *ctx, struct layout *l);
+
+/* include the region called name, returning its index */
+int32_t layoutInclude(struct layout *l, const char *name);
+
+/* the parts of the n sorted extents in that lie in included regions, sorted and merged;
+ * count is set to how many. Returns a malloc'ed array, NULL if out of memory. */
+struct file_extent *layoutExtents(const struct layout *l, const struct file_extent *in, uint32_t n,
+        uint32_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,54 +24,132 @@
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <signal.h>
 #include "ch341a.h"
+#include "ch341sim.h"
+#include "ch341bench.h"
+#include "ch341tune.h"
+#include "ch341trace.h"
+#include "fileio.h"
+#include "gang.h"
+#include "journal.h"
+#include "imagefmt.h"
+#include "layout.h"
 #include <time.h>
 #include <stdio.h>
 
 int verbose;
+static bool progressLine;               // a progress line is waiting for its newline
+static struct ch341_ctx *volatile cliCtx;
 
-void v_print(int mode, int len) { // mode: begin=0, progress = 1
-    if (!verbose) return ;
-
-    static unsigned int size = 0;
+static void cliProgress(void *user, uint32_t event, uint32_t done, uint32_t total)
+{
+    static unsigned int size = 0, skipped = 0;
     static time_t started,reported;
-    unsigned int dur,done;
+    static struct timespec begin;
+    struct timespec end;
+    unsigned int dur;
+    double secs;
     time_t now;
     time(&now);
 
-    switch (mode) {
-        case 0: // setup
-            size = len;
+    switch (event) {
+        case CH341_PROGRESS_BEGIN:
+            size = total;
+            skipped = 0;
             started = reported = now;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
             break;
-        case 1: // progress
+        case CH341_PROGRESS_UPDATE:
             if (now == started ) return ;
 
             dur = now - started;
-            done = size-len;
             if (done > 0 && reported != now) {
                 printf("Bytes: %d (%d%c),  Time: %d, ETA: %d   \r",done,
-                        (done * 100) / size, '%', dur, (int) ((1.0 * dur * size) / done-dur));
+                        (int)(((uint64_t)done * 100) / size), '%', dur, (int) ((1.0 * dur * size) / done-dur));
                 fflush(stdout);
                 reported = now;
+                progressLine = true;
             }
             break;
-        case 2: // done
-            dur = now - started; if (dur<1) dur=1;
-            printf("Total:  %d sec,  average speed  %d  bytes per second.\n", dur, size / dur);
+        case CH341_PROGRESS_END:
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+            if (secs < 1e-6) secs = 1e-6;
+            printf("Total:  %.3f sec,  average speed  %.0f  bytes per second.\n", secs, size / secs);
+            if (skipped)
+                printf("Skipped %d pages that needed no programming.\n", skipped);
+            progressLine = false;
+            break;
+        case CH341_PROGRESS_SKIPPED:
+            skipped = done;
             break;
         default:
             break;
     }
 }
 
+/* library messages: errors to stderr, the rest to stdout */
+static void cliLog(void *user, int32_t level, const char *msg)
+{
+    if (progressLine) {
+        printf("\n");
+        fflush(stdout);
+        progressLine = false;
+    }
+    fprintf(level == CH341_LOG_ERROR ? stderr : stdout, "%s\n", msg);
+}
+
+/* SIGINT handler: let the running operation stop cleanly */
+static void cliSigInt(int signo)
+{
+    if (cliCtx)
+        ch341Stop(cliCtx);
+    gangStop();
+}
+
+/* the parts of the n extents in that lie in the --include regions; the regions come
+ * from the --layout file, else an FMAP in img, else one on the chip */
+static struct file_extent *cliRegions(struct ch341_ctx *ctx, const char *path, const struct file_map *img,
+        const char **names, uint32_t includes, const struct file_extent *in, uint32_t n, uint32_t *count)
+{
+    struct layout layout;
+    const struct layout_region *reg;
+    int32_t ret;
+
+    if (path)
+        ret = layoutLoad(&layout, path);
+    else if (img && layoutFmap(&layout, img->data, img->size) == 0)
+        ret = 0;
+    else if (ctx)
+        ret = layoutFmapChip(ctx, &layout);
+    else {
+        fprintf(stderr, "No FMAP in the image, give the regions with --layout\n");
+        ret = -1;
+    }
+    if (ret < 0)
+        return NULL;
+    for (uint32_t i = 0; i < includes; ++i) {
+        if ((ret = layoutInclude(&layout, names[i])) < 0)
+            return NULL;
+        reg = &layout.region[ret];
+        fprintf(stderr, "Region %s: 0x%06x-0x%06x\n", reg->name, reg->start, reg->end - 1);
+    }
+    return layoutExtents(&layout, in, n, count);
+}
+
 int main(int argc, char* argv[])
 {
+    struct ch341_ctx *ctx;
+    struct sigaction sa;
     int32_t ret;
     int exitcode = 0;
-    uint8_t *buf;
     FILE *fp;
-    char *filename;
+    char *filename = NULL;
+    char *sim = NULL;
+    char *gang = NULL;
+    char *trace = NULL;
+    FILE *data_out = NULL;
     int cap;
     int length = 0;
     char op = 0;
@@ -80,20 +158,78 @@ int main(int argc, char* argv[])
     int offset = 0;
     int sec_page = -1;
     char sec_op = 0;
+    bool checksum = false;
+    char *expect = NULL;
+    struct checksum sum;
+    char *journal = NULL;
+    bool resume = false;
+    struct journal jnl;
+    int32_t hole = -1;              // --sparse byte
+    bool hole_set = false;          // --sparse came with a value
+    int32_t format = IMAGE_AUTO;    // --format of the --write image
+    uint32_t base = 0;              // --base, the image address of chip byte 0
+    bool segmented;                 // the image only covers its extents
+    bool ranged;                    // only the extents of the image are programmed
+    char *layout = NULL;
+    const char *include[LAYOUT_MAX_REGIONS];
+    uint32_t includes = 0;
+    struct file_extent *regions, whole;
+    uint32_t nregions;
+    bool bus_set = false;           // -t, -d or -q given, the tune cache is not used
+    struct ch341_tune tune;
 
     const char usage[] =
         "\nUsage:\n"\
         " -h, --help             display this message\n"\
         " -i, --info             read the chip ID info\n"\
         " -u, --unlock           unlock block protection\n"\
-        " -e, --erase            erase the entire chip\n"\
+        " -e, --erase            erase the entire chip, or only --offset/--length if given\n"\
         " -v, --verbose          print verbose info\n"\
-        " -l, --length <bytes>   manually set length\n"\
-        " -w, --write <filename> write chip with data from filename\n"\
-        " -o, --offset <bytes>   write data starting from specific offset\n"\
-        " -r, --read <filename>  read chip and save data to filename\n"\
+        " -l, --length <bytes>   manually set length (0x for hex)\n"\
+        " -w, --write <filename> write chip with data from filename (- for stdin)\n"\
+        " -f, --diff-write <filename>  write only the sectors and pages that differ from filename\n"\
+        " -o, --offset <bytes>   write data starting from specific offset (0x for hex)\n"\
+        " -I, --include <region> limit --read, --write, --diff-write and --erase to the named\n"\
+        "                        region, once per region; the image and the read file are\n"\
+        "                        chip sized, the rest of the read file is ff\n"\
+        " -p, --layout <file>    flashrom layout file of the regions (\"<start>:<end> <name>\"\n"\
+        "                        lines); without it they come from an FMAP in the image,\n"\
+        "                        or else on the chip\n"\
+        " -F, --format <fmt>     image format for --write and --diff-write: auto (default,\n"\
+        "                        by extension or ELF magic), raw, ihex, srec or elf; only\n"\
+        "                        the address ranges a hex, srec or elf file covers are\n"\
+        "                        programmed and verified, moved up by --offset\n"\
+        " -B, --base <address>   address of chip byte 0 in a hex, srec or elf image, like\n"\
+        "                        0x08000000 for a part executing in place (default 0)\n"\
+        " -r, --read <filename>  read chip and save data to filename (- for stdout)\n"\
         " -t, --turbo            increase the i2c bus speed (-tt to use much faster speed)\n"\
         " -d, --double           double the spi bus speed\n"\
+        " -q, --queue <n>        number of usb transfers kept in flight (1-16, default 4)\n"\
+        " -c, --checksum[=<hex>] print CRC32 and SHA-256 of the data read or written, fail\n"\
+        "                        unless one matches hex (8 digits CRC32, 64 digits SHA-256);\n"\
+        "                        of a segmented or sparse image, only the ranges programmed\n"\
+        " -m, --read-mode <mode> read instruction: auto (default, fast with -d), normal or fast\n"\
+        " -g, --gang <all|n|path,...>  write and verify on several programmers at once: all of\n"\
+        "                        them, the first n, or those at usb port paths like 1-1.2\n"\
+        " -s, --sim <chip>[,latency][,nobusy][,file=<path>][,fault=<n>][,sfdp=<path>]  use a\n"\
+        "                        simulated programmer and chip, fault stalls every nth usb\n"\
+        "                        read, sfdp answers SFDP reads from a dump\n"\
+        " -T, --trace <file>     record usb and spi activity as Chrome trace JSON\n"\
+        " -z, --sparse[=<hex>]   erased value (default ff): --write and --diff-write take\n"\
+        "                        the holes of the image as it and do not program or verify\n"\
+        "                        them when it is ff; --read needs it spelled out and leaves\n"\
+        "                        4 KB blocks of it as holes, which read back as 00: with\n"\
+        "                        -z00 the file is a plain image, with others only -z reads\n"\
+        "                        it back right\n"\
+        " -j, --journal <file>   record the chunks a read or write has done in file, kept\n"\
+        "                        if it is interrupted and removed once it completes\n"\
+        " -R, --resume           continue the read or write recorded in the --journal file\n"\
+        " -a, --autotune         find the fastest bus setting and queue depth that read the\n"\
+        "                        chip reliably (32 KB at --offset, or --length bytes) and\n"\
+        "                        keep it for this chip and usb port; later runs without\n"\
+        "                        -t, -d or -q start from it\n"\
+        " -b, --bench <file>     run the benchmark matrix, JSON lines to file (- for stdout);\n"\
+        "                        erases and restores 64 KB at --offset (default: the last 64 KB)\n"\
         "\nSecurity Register commands:\n"\
         " -S, --read-secreg <page>   read security register page (0-3)\n"\
         " -W, --write-secreg <page>  write file to security register page (1-3)\n"\
@@ -105,13 +241,29 @@ int main(int argc, char* argv[])
         {"info",    no_argument,        0, 'i'},
         {"erase",   no_argument,        0, 'e'},
         {"write",   required_argument,  0, 'w'},
+        {"diff-write", required_argument, 0, 'f'},
         {"length",  required_argument,  0, 'l'},
         {"verbose", no_argument,        0, 'v'},
         {"write",   required_argument,  0, 'w'},
         {"offset",  required_argument,  0, 'o'},
+        {"format",  required_argument,  0, 'F'},
+        {"base",    required_argument,  0, 'B'},
+        {"include", required_argument,  0, 'I'},
+        {"layout",  required_argument,  0, 'p'},
         {"read",    required_argument,  0, 'r'},
         {"turbo",   no_argument,        0, 't'},
         {"double",  no_argument,        0, 'd'},
+        {"queue",   required_argument,  0, 'q'},
+        {"read-mode", required_argument, 0, 'm'},
+        {"checksum", optional_argument, 0, 'c'},
+        {"gang",    required_argument,  0, 'g'},
+        {"sim",     required_argument,  0, 's'},
+        {"bench",   required_argument,  0, 'b'},
+        {"trace",   required_argument,  0, 'T'},
+        {"sparse",  optional_argument,  0, 'z'},
+        {"journal", required_argument,  0, 'j'},
+        {"resume",  no_argument,        0, 'R'},
+        {"autotune", no_argument,       0, 'a'},
         {"unlock",  no_argument,        0, 'u'},
         {"read-secreg",  required_argument, 0, 'S'},
         {"write-secreg", required_argument, 0, 'W'},
@@ -122,9 +274,14 @@ int main(int argc, char* argv[])
 
         int32_t optidx = 0;
 
-        while ((c = getopt_long(argc, argv, "uhiew:r:l:tdvo:S:W:E:L:D", options, &optidx)) != -1){
+        if ((ctx = ch341New()) == NULL)
+            return -1;
+        ch341SetLog(ctx, cliLog, NULL, CH341_LOG_INFO);
+
+        while ((c = getopt_long(argc, argv, "uhiaew:f:r:b:l:tdq:m:c::z::g:s:T:j:RvF:B:I:p:o:S:W:E:L:D", options, &optidx)) != -1){
             switch (c) {
                 case 'i':
+                case 'a':
                 case 'e':
                     if (!op)
                         op = c;
@@ -135,7 +292,9 @@ int main(int argc, char* argv[])
                     verbose = 1;
                     break;
                 case 'w':
+                case 'f':
                 case 'r':
+                case 'b':
                     if (!op) {
                         op = c;
                         filename = (char*) malloc(strlen(optarg) + 1);
@@ -144,18 +303,91 @@ int main(int argc, char* argv[])
                         op = 'x';
                     break;
                 case 'l':
-                    length = atoi(optarg);
+                    length = strtoul(optarg, NULL, 0);
                     break;
                 case 't':
                     if ((speed & 3) < 3) {
                         speed++;
                     }
+                    bus_set = true;
                     break;
                 case 'd':
                     speed |= CH341A_STM_SPI_DBL;
+                    bus_set = true;
+                    break;
+                case 'q':
+                    bus_set = true;
+                    if (ch341SetQueueDepth(ctx, atoi(optarg)) < 0)
+                        return -1;
+                    break;
+                case 'm':
+                    if (!strcmp(optarg, "auto"))
+                        ret = ch341SetReadMode(ctx, SPI_READ_AUTO);
+                    else if (!strcmp(optarg, "normal"))
+                        ret = ch341SetReadMode(ctx, SPI_READ_NORMAL);
+                    else if (!strcmp(optarg, "fast"))
+                        ret = ch341SetReadMode(ctx, SPI_READ_FAST);
+                    else {
+                        fprintf(stderr, "Read mode must be auto, normal or fast\n");
+                        return -1;
+                    }
+                    break;
+                case 'c':
+                    checksum = true;
+                    if (optarg && checksumCheckExpect(optarg) < 0) {
+                        fprintf(stderr, "Checksum must be 8 (CRC32) or 64 (SHA-256) hex digits\n");
+                        return -1;
+                    }
+                    expect = optarg;
+                    break;
+                case 'g':
+                    gang = optarg;
+                    break;
+                case 's':
+                    sim = optarg;
+                    break;
+                case 'T':
+                    if (ch341TraceOpen(ctx, optarg) < 0) {
+                        fprintf(stderr, "Cannot start the trace\n");
+                        return -1;
+                    }
+                    trace = optarg;
+                    break;
+                case 'z':
+                    hole = optarg ? (int32_t)strtoul(optarg, NULL, 16) : 0xff;
+                    hole_set = optarg != NULL;
+                    if (hole > 0xff) {
+                        fprintf(stderr, "The erased value is one byte, 00-ff\n");
+                        return -1;
+                    }
+                    break;
+                case 'j':
+                    journal = optarg;
+                    break;
+                case 'R':
+                    resume = true;
+                    break;
+                case 'F':
+                    if ((format = imageFormat(optarg)) < IMAGE_AUTO) {
+                        fprintf(stderr, "Image format must be auto, raw, ihex, srec or elf\n");
+                        return -1;
+                    }
+                    break;
+                case 'I':
+                    if (includes == LAYOUT_MAX_REGIONS) {
+                        fprintf(stderr, "Too many --include regions\n");
+                        return -1;
+                    }
+                    include[includes++] = optarg;
+                    break;
+                case 'p':
+                    layout = optarg;
                     break;
                 case 'o':
-                    offset = atoi(optarg);
+                    offset = strtoul(optarg, NULL, 0);
+                    break;
+                case 'B':
+                    base = strtoul(optarg, NULL, 0);
                     break;
                 case 'u':
                     op='u';
@@ -204,12 +436,116 @@ int main(int argc, char* argv[])
         fprintf(stderr, "Conflicting options, only one option at a time.\n");
         return -1;
     }
-    ret = ch341Configure(CH341A_USB_VENDOR, CH341A_USB_PRODUCT);
+    if (resume && !journal) {
+        fprintf(stderr, "--resume needs the --journal file\n");
+        return -1;
+    }
+    if (journal && (gang || (op != 'r' && op != 'w' && op != 'f') || (op == 'r' && !strcmp(filename, "-")))) {
+        fprintf(stderr, "--journal goes with --read to a file, --write or --diff-write on one programmer\n");
+        return -1;
+    }
+    if (layout && !includes) {
+        fprintf(stderr, "--layout needs the --include regions to work on\n");
+        return -1;
+    }
+    if (includes && ((op != 'r' && op != 'w' && op != 'f' && op != 'e') || offset || length || journal)) {
+        fprintf(stderr, "--include goes with --read, --write, --diff-write or --erase, without --offset,\n"
+                "--length or --journal: the regions give the addresses\n");
+        return -1;
+    }
+    if (journal && op == 'r' && hole >= 0) {
+        fprintf(stderr, "--sparse does not go with a journaled --read\n");
+        return -1;
+    }
+    /* holes read back as 00, a dump with holes of another byte is not the chip */
+    if (op == 'r' && hole >= 0 && !hole_set) {
+        fprintf(stderr, "--read takes the byte to leave as holes: -z00 keeps the file a plain image,\n"
+                "-zff makes one that only --write -z or --diff-write -z reads back right\n");
+        return -1;
+    }
+    if (op == 'r' && hole > 0)
+        fprintf(stderr, "Warning: blocks of %02x become holes that read back as 00, %s is not a plain image;\n"
+                "write it back with -z%02x\n", hole, filename, hole);
+    if (verbose)
+        ch341SetProgress(ctx, cliProgress, NULL);
+    cliCtx = ctx;
+    sa.sa_handler = cliSigInt;
+    sa.sa_flags = SA_RESTART;
+    sigfillset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    if (gang) {
+        struct gang_job job = { .offset = offset, .speed = speed, .queue_depth = ctx->queue_depth,
+                .read_mode = ctx->read_mode, .diff = op == 'f', .tuned = !bus_set, .sim = sim };
+        struct file_map img;
+        struct file_hash hash;
+
+        if (op != 'w' && op != 'f') {
+            fprintf(stderr, "--gang goes with --write or --diff-write\n");
+            return -1;
+        }
+        if (filename == NULL) {
+            fprintf(stderr, "--gang needs the image to write and verify\n");
+            return -1;
+        }
+        if (ctx->trace) {
+            fprintf(stderr, "--trace follows a single programmer, not a gang\n");
+            return -1;
+        }
+        if ((format = imageLoad(filename, format, base, &img)) < 0)
+            return -1;
+        if (format == IMAGE_RAW && hole >= 0 && fileFillHoles(&img, hole) < 0) {
+            fileUnmap(&img);
+            return -1;
+        }
+        job.image = img.data;
+        job.len = (length && (size_t)length < img.size) ? (uint32_t)length : img.size;
+        if (includes) {
+            if ((regions = cliRegions(NULL, layout, &img, include, includes, img.extents, img.count,
+                            &nregions)) == NULL) {
+                fileUnmap(&img);
+                return -1;
+            }
+            free(img.extents);
+            img.extents = regions;
+            img.count = nregions;
+        }
+        if (format != IMAGE_RAW || includes) {
+            job.extents = img.extents;
+            job.count = img.count;
+        }
+        if (checksum) {
+            checksumInit(&sum);
+            fileHashStart(&hash, &sum, img.data, job.len, job.extents, job.count);
+        }
+        ret = gangWrite(gang, &job);
+        if (checksum) {
+            fileHashJoin(&hash);
+            if (job.extents)
+                printf("Checksum of the programmed ranges only, in address order:\n");
+            if (checksumReport(&sum, expect) < 0)
+                ret = -1;
+        }
+        fileUnmap(&img);
+        ch341Free(ctx);
+        return ret == 0 ? 0 : 1;
+    }
+    if (op == 'r' && !strcmp(filename, "-")) {
+        /* the chip data owns stdout, everything else goes to stderr */
+        int fd = dup(STDOUT_FILENO);
+        if (fd < 0 || (data_out = fdopen(fd, "wb")) == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Cannot redirect stdout");
+            return -1;
+        }
+    }
+    if (sim)
+        ret = ch341SimConfigure(ctx, sim);
+    else
+        ret = ch341Configure(ctx, CH341A_USB_VENDOR, CH341A_USB_PRODUCT);
     if (ret < 0)
         return -1;
-    ret = ch341SetStream(speed);
+    ret = ch341SetStream(ctx, speed);
     if (ret < 0) goto fail;
-    ret = ch341SpiCapacity();
+    ret = ch341SpiCapacity(ctx);
     if (ret < 0) goto fail;
     cap = 1 << ret;
     printf("Chip capacity is %d bytes\n", cap);
@@ -218,11 +554,26 @@ int main(int argc, char* argv[])
         cap = length;
     }
     if (op == 'i') goto out;
+    if (op == 'a') {
+        ret = ch341Tune(ctx, offset, length, &tune);
+        if (ret < 0 || ch341TuneSave(ctx, &tune) < 0)
+            goto fail;
+        printf("Tuned: turbo %u%s, queue %u\n", tune.speed & 3,
+                (tune.speed & CH341A_STM_SPI_DBL) ? ", double" : "", tune.queue_depth);
+        goto out;
+    }
+    if (!bus_set) {
+        ret = ch341TuneLoad(ctx, &tune);
+        if (ret < 0) goto fail;
+        if (ret > 0)
+            printf("Using the tuned setting: turbo %u%s, queue %u\n", tune.speed & 3,
+                    (tune.speed & CH341A_STM_SPI_DBL) ? ", double" : "", tune.queue_depth);
+    }
     if (op == 'S') {
         uint8_t secbuf[256];
         if (sec_op == 'D') {
             for (int p = 0; p <= 3; p++) {
-                ret = ch341ReadSecReg(p, secbuf);
+                ret = ch341ReadSecReg(ctx, p, secbuf);
                 if (ret < 0) {
                     fprintf(stderr, "Failed to read security register page %d\n", p);
                     goto fail;
@@ -238,7 +589,7 @@ int main(int argc, char* argv[])
                     printf("|\n");
                 }
             }
-            ret = ch341ReadStatus2();
+            ret = ch341ReadStatus2(ctx);
             if (ret >= 0) {
                 printf("\nStatus Register 2: 0x%02x\n", ret);
                 printf("  LB1 (page 1 lock): %s\n", (ret & 0x08) ? "LOCKED (OTP)" : "unlocked");
@@ -252,7 +603,7 @@ int main(int argc, char* argv[])
             goto fail;
         }
         if (sec_op == 'R') {
-            ret = ch341ReadSecReg(sec_page, secbuf);
+            ret = ch341ReadSecReg(ctx, sec_page, secbuf);
             if (ret < 0) {
                 fprintf(stderr, "Failed to read security register\n");
                 goto fail;
@@ -275,7 +626,7 @@ int main(int argc, char* argv[])
                 goto fail;
             }
             printf("Erasing security register page %d...\n", sec_page);
-            ret = ch341EraseSecReg(sec_page);
+            ret = ch341EraseSecReg(ctx, sec_page);
             if (ret < 0) {
                 fprintf(stderr, "Erase failed\n");
                 goto fail;
@@ -305,14 +656,14 @@ int main(int argc, char* argv[])
                 goto fail;
             }
             printf("Writing %d bytes to security register page %d...\n", ret, sec_page);
-            int wret = ch341WriteSecReg(sec_page, secbuf, ret);
+            int wret = ch341WriteSecReg(ctx, sec_page, secbuf, ret);
             if (wret < 0) {
                 fprintf(stderr, "Write failed\n");
                 goto fail;
             }
             printf("Write done! Verifying...\n");
             uint8_t vbuf[256];
-            wret = ch341ReadSecReg(sec_page, vbuf);
+            wret = ch341ReadSecReg(ctx, sec_page, vbuf);
             if (wret < 0) {
                 fprintf(stderr, "Verify read failed\n");
                 goto fail;
@@ -330,7 +681,7 @@ int main(int argc, char* argv[])
                 fprintf(stderr, "Can only lock pages 1-3\n");
                 goto fail;
             }
-            ret = ch341ReadStatus2();
+            ret = ch341ReadStatus2(ctx);
             if (ret < 0) {
                 fprintf(stderr, "Failed to read status register 2\n");
                 goto fail;
@@ -350,7 +701,7 @@ int main(int argc, char* argv[])
                 goto out;
             }
             sr2 |= lb_bit;
-            ret = ch341WriteStatus2(sr2);
+            ret = ch341WriteStatus2(ctx, sr2);
             if (ret < 0) {
                 fprintf(stderr, "Failed to write status register 2\n");
                 goto fail;
@@ -359,25 +710,57 @@ int main(int argc, char* argv[])
             goto out;
         }
     }
+    if (op == 'b') {
+        fp = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+        if (!fp) {
+            fprintf(stderr, "Couldn't open file %s for writing.\n", filename);
+            goto fail;
+        }
+        ret = ch341Bench(ctx, fp, offset ? offset : cap - 65536);
+        if (fp != stdout)
+            fclose(fp);
+        if (ret < 0) goto fail;
+        printf("Benchmark done!\n");
+        goto out;
+    }
     if (op == 'u') {
-        ret = ch341WriteStatus(0);
+        ret = ch341WriteStatus(ctx, 0);
         if (ret < 0) goto fail;
         printf("Chip status %04x\n",ret);
     }
-    if (op == 'e') {
-        uint8_t timeout = 0;
-        ret = ch341EraseChip();
+    if (op == 'e' && includes) {
+        whole.start = 0;
+        whole.end = cap;
+        if ((regions = cliRegions(ctx, layout, NULL, include, includes, &whole, 1, &nregions)) == NULL)
+            goto fail;
+        ret = 0;
+        for (uint32_t i = 0; i < nregions && ret == 0; ++i)
+            ret = ch341EraseRange(ctx, regions[i].start, regions[i].end - regions[i].start);
+        free(regions);
+        if (ret < 0) goto fail;
+        printf("Erase done!\n");
+    } else if (op == 'e' && (offset != 0 || length != 0)) {
+        ret = ch341EraseRange(ctx, offset, length ? length : cap - offset);
+        if (ret < 0) goto fail;
+        printf("Erase done!\n");
+    } else if (op == 'e') {
+        /* poll about 100 times over the typical erase time, give up after the maximum */
+        uint32_t waited = 0, step = ctx->flash.chip_erase_ms / 100;
+        if (step < 50) step = 50;
+        if (step > 1000) step = 1000;
+        ret = ch341EraseChip(ctx);
         if (ret < 0) goto fail;
         do {
-            sleep(1);
-            ret = ch341ReadStatus();
+            usleep(step * 1000);
+            waited += step;
+            ret = ch341ReadStatus(ctx);
             if (ret < 0) goto fail;
-            printf(".");
-            fflush(stdout);
-            timeout++;
-            if (timeout == 100) break;
-        } while(ret != 0);
-        if (timeout == 100)
+            if (waited % 1000 < step) {
+                printf(".");
+                fflush(stdout);
+            }
+        } while ((ret & 0x01) && waited < ctx->flash.chip_erase_max_ms);
+        if (ret & 0x01)
         {
             fprintf(stderr, "Chip erase timeout.\n");
             goto fail;
@@ -385,97 +768,147 @@ int main(int argc, char* argv[])
         else
             printf("Chip erase done!\n");
     }
-    if ((op == 'r') || (op == 'w')) {
-        buf = (uint8_t *)malloc(cap);
-        if (!buf) {
-            fprintf(stderr, "Malloc failed for read buffer.\n");
+    if (op == 'r' && journal) {
+        if (journalOpen(&jnl, journal, "read", &ctx->flash, offset, cap, resume) < 0)
             goto fail;
-        }
-    }
-    if (op == 'r') {
-        ret = ch341SpiRead(buf, offset, cap);
+        if (checksum)
+            checksumInit(&sum);
+        ret = journalRead(ctx, &jnl, filename, checksum ? &sum : NULL);
+        journalClose(&jnl, ret == 0);
         if (ret < 0)
-        {
             goto fail;
-        }
-        fp = fopen(filename, "wb");
+        if (checksum && checksumReport(&sum, expect) < 0)
+            goto fail;
+    } else if (op == 'r') {
+        fp = data_out ? data_out : fopen(filename, "wb");
         if (!fp) {
             fprintf(stderr, "Couldn't open file %s for writing.\n", filename);
             goto fail;
         }
-        fwrite(buf, 1, cap, fp);
-        if (ferror(fp))
-            fprintf(stderr, "Error writing file [%s]\n", filename);
+        if (checksum)
+            checksumInit(&sum);
+        if (includes) {
+            whole.start = 0;
+            whole.end = cap;
+            regions = cliRegions(ctx, layout, NULL, include, includes, &whole, 1, &nregions);
+            ret = regions ? fileReadExtents(ctx, fp, regions, nregions, cap, checksum ? &sum : NULL, hole) : -1;
+            free(regions);
+        } else
+            ret = fileReadChip(ctx, fp, offset, cap, checksum ? &sum : NULL, hole);
         fclose(fp);
+        if (ret < 0)
+            goto fail;
+        if (checksum && checksumReport(&sum, expect) < 0)
+            goto fail;
     }
-    if (op == 'w') {
-        fp = fopen(filename, "rb");
-        if (!fp) {
-            fprintf(stderr, "Couldn't open file %s for reading.\n", filename);
+    if ((op == 'w') || (op == 'f')) {
+        struct file_map img;
+        struct file_hash hash;
+
+        if ((format = imageLoad(filename, format, base, &img)) < 0)
+            goto fail;
+        segmented = format != IMAGE_RAW;
+        if (!segmented && hole >= 0 && fileFillHoles(&img, hole) < 0) {
+            fileUnmap(&img);
             goto fail;
         }
-        ret = fread(buf, 1, cap, fp);
-        if (ferror(fp)) {
-            fprintf(stderr, "Error reading file [%s]\n", filename);
-            if (fp)
-                fclose(fp);
+        if (segmented && (journal || offset + img.size > ctx->flash.capacity)) {
+            if (journal)
+                fprintf(stderr, "--journal takes a raw image, not %s\n", imageFormatName(format));
+            else
+                fprintf(stderr, "The image reaches 0x%zx, beyond the chip%s\n", offset + img.size - 1,
+                        base ? "" : "; give the address of chip byte 0 with --base");
+            fileUnmap(&img);
             goto fail;
         }
-        cap = ret;
-        fprintf(stderr, "File Size is [%d]\n", ret);
-        ret = ch341SpiWrite(buf, offset, ret);
-        if (ret == 0) {
-            printf("\nWrite ok! Try to verify... ");
-            FILE *test_file;
-            char *test_filename;
-            test_filename = (char*) malloc(strlen("./test-firmware.bin") + 1);
-            strcpy(test_filename, "./test-firmware.bin");
-
-            ret = ch341SpiRead(buf, offset, cap);
-            test_file = fopen(test_filename, "w+b");
-
-            if (!test_file) {
-                fprintf(stderr, "Couldn't open file %s for writing.\n", test_filename);
+        if (includes) {
+            if ((regions = cliRegions(ctx, layout, &img, include, includes, img.extents, img.count,
+                            &nregions)) == NULL || nregions == 0) {
+                if (regions)
+                    fprintf(stderr, "The image has no data in the regions\n");
+                free(regions);
+                fileUnmap(&img);
                 goto fail;
             }
-            fwrite(buf, 1, cap, test_file);
-
-            if (ferror(test_file))
-                fprintf(stderr, "Error writing file [%s]\n", test_filename);
-
-            fseek(fp, 0, SEEK_SET);
-            fseek(test_file, 0, SEEK_SET);
-
-            int ch1, ch2;
-            int checked_count = 0;
-            ch1 = getc(fp);
-            ch2 = getc(test_file);
-
-            while ((ch1 != EOF) && (ch2 != EOF) && (ch1 == ch2)) {
-                ch1 = getc(fp);
-                ch2 = getc(test_file);
-                checked_count++;
+            free(img.extents);
+            img.extents = regions;
+            img.count = nregions;
+            segmented = true;
+        }
+        if (segmented)
+            fprintf(stderr, "Image is %s, %u segments from 0x%zx to 0x%zx\n", imageFormatName(format),
+                    img.count, offset + img.extents[0].start, offset + img.extents[img.count - 1].end - 1);
+        if (img.size < (size_t)cap)
+            cap = img.size;
+        fprintf(stderr, "File Size is [%d]\n", cap);
+        /* a segmented image and the holes of a sparse one are not programmed, nor hashed */
+        ranged = !journal && (segmented || (hole == 0xff && op == 'w'));
+        if (checksum) {
+            checksumInit(&sum);
+            fileHashStart(&hash, &sum, img.data, cap, ranged ? img.extents : NULL, img.count);
+        }
+        if (journal) {
+            /* each chunk is verified before it is recorded */
+            ret = journalOpen(&jnl, journal, op == 'f' ? "diff-write" : "write", &ctx->flash, offset, cap, resume);
+            if (ret == 0) {
+                ret = journalWrite(ctx, &jnl, img.data, op == 'f');
+                journalClose(&jnl, ret == 0);
             }
-
-            if (ch1 == ch2 || (checked_count == cap))
+            if (ret == 0)
                 printf("\nWrite completed successfully. \n");
-            else
-            {
-                fprintf(stderr, "\nError while writing. Check your device. Maybe it needs to be erased.\n");
-                goto fail;
-            }
+        } else if (ranged) {
+            /* the holes are erased flash on a chip ready for --write, and what a segmented
+             * image does not cover is none of its business: only the data goes out */
+            size_t start, end, data = 0;
 
-            if (remove(test_filename) == 0)
-                printf("\nAll done. \n");
-            else
-                printf("\nTemp file could not be deleted");
+            ret = 0;
+            for (uint32_t i = 0; i < img.count && img.extents[i].start < (size_t)cap && ret == 0; ++i) {
+                start = img.extents[i].start;
+                end = img.extents[i].end < (size_t)cap ? img.extents[i].end : (size_t)cap;
+                data += end - start;
+                if (((op == 'f') ? ch341SpiDiffWrite(ctx, img.data + start, offset + start, end - start)
+                                 : ch341SpiWrite(ctx, img.data + start, offset + start, end - start)) < 0) {
+                    fprintf(stderr, "\nWrite failed.\n");
+                    ret = -1;
+                } else if ((ret = fileVerifyChip(ctx, img.data + start, offset + start, end - start)) > 0)
+                    fprintf(stderr, "Error while writing. Check your device.\n");
+            }
+            if (ret == 0 && segmented)
+                printf("\nWrite completed successfully, %zu bytes in %u segments. \n", data, img.count);
+            else if (ret == 0)
+                printf("\nWrite completed successfully, %zu bytes of data, %zu in holes left alone. \n",
+                        data, (size_t)cap - data);
+        } else if ((ret = (op == 'f') ? ch341SpiDiffWrite(ctx, img.data, offset, cap)
+                                      : ch341SpiWrite(ctx, img.data, offset, cap)) == 0) {
+            printf("\nWrite ok! Try to verify... ");
+            ret = fileVerifyChip(ctx, img.data, offset, cap);
+            if (ret == 0)
+                printf("\nWrite completed successfully. \n");
+            else if (ret > 0)
+                fprintf(stderr, "Error while writing. Check your device.\n");
+        } else
+            fprintf(stderr, "\nWrite failed.\n");
+        if (checksum) {
+            fileHashJoin(&hash);
+            if (ret == 0 && ranged)
+                printf("Checksum of the programmed ranges only, in address order:\n");
+            if (ret == 0 && checksumReport(&sum, expect) < 0)
+                ret = -1;
         }
-        fclose(fp);
+        fileUnmap(&img);
+        if (ret != 0)
+            goto fail;
+        printf("\nAll done. \n");
     }
     goto out;
 fail:
     exitcode = 1;
 out:
-    ch341Release();
+    cliCtx = NULL;
+    if (ch341TraceClose(ctx) < 0) {
+        fprintf(stderr, "Couldn't write trace file %s\n", trace);
+        exitcode = 1;
+    }
+    ch341Free(ctx);
     return exitcode;
 }
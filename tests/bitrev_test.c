@@ -0,0 +1,93 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* every bitrev kernel the cpu runs against the swapByte table */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "ch341a.h"
+#include "bitrev.h"
+#include "check.h"
+
+#define MAXLEN  300
+#define SLACK   32
+
+static uint8_t src[MAXLEN + SLACK], dst[MAXLEN + SLACK], ref[MAXLEN + SLACK];
+
+/* true when buf holds the reversed src over [off, off + len) and fill elsewhere */
+static bool swapped(const uint8_t *buf, uint32_t off, uint32_t len, int fill)
+{
+    uint32_t i;
+
+    for (i = 0; i < MAXLEN + SLACK; ++i)
+        if (buf[i] != (i >= off && i < off + len ? swapByte(src[i]) : fill < 0 ? src[i] : fill))
+            return false;
+    return true;
+}
+
+/* odd lengths across the 8, 16 and 32 byte steps, from every misalignment of a
+ * 32 byte vector, both out of place and in place */
+static void testKernel(const struct bitrev_kernel *k)
+{
+    uint32_t len, off, bad = 0;
+
+    for (off = 0; off < SLACK; ++off) {
+        for (len = 0; len <= MAXLEN; len += len < 70 ? 1 : 37) {
+            memset(dst, 0xa5, sizeof(dst));
+            k->swap(dst + off, src + off, len);
+            memcpy(ref, src, sizeof(ref));
+            k->swap(ref + off, ref + off, len);
+            if (!swapped(dst, off, len, 0xa5) || !swapped(ref, off, len, -1))
+                bad++;
+        }
+    }
+    if (bad)
+        fprintf(stderr, "%s: %u mismatching runs\n", k->name, bad);
+    CHECK_EQ(bad, 0);
+}
+
+int main(void)
+{
+    uint32_t k, i, run = 0;
+
+    for (i = 0; i < sizeof(src); ++i)
+        src[i] = (uint8_t)(i * 167 + 13);
+    /* the table itself against a bit by bit reversal */
+    for (i = 0; i < 256; ++i) {
+        uint8_t r = 0;
+        for (uint32_t b = 0; b < 8; ++b)
+            r |= ((i >> b) & 1) << (7 - b);
+        CHECK_EQ(swapByte(i), r);
+    }
+    for (k = 0; k < bitrevKernelCount; ++k) {
+        if (bitrevKernels[k].supported != NULL && !bitrevKernels[k].supported()) {
+            printf("%s: not supported here\n", bitrevKernels[k].name);
+            continue;
+        }
+        testKernel(&bitrevKernels[k]);
+        run++;
+    }
+    CHECK(run > 0);
+    /* and the dispatched entry point */
+    swapBytes(dst + 3, src + 3, 101);
+    for (i = 0; i < 101; ++i)
+        CHECK_EQ(dst[3 + i], swapByte(src[3 + i]));
+    return CHECK_DONE();
+}
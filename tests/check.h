@@ -0,0 +1,43 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+
+/* The unit tests: every failed check is printed, the test fails if any did. */
+static int checkFailures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            checkFailures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) do { \
+        unsigned long long a_ = (a), b_ = (b); \
+        if (a_ != b_) { \
+            fprintf(stderr, "%s:%d: %s is 0x%llx, not 0x%llx\n", __FILE__, __LINE__, #a, a_, b_); \
+            checkFailures++; \
+        } \
+    } while (0)
+
+#define CHECK_DONE() (checkFailures ? (fprintf(stderr, "%d checks failed\n", checkFailures), 1) : 0)
+
+#endif
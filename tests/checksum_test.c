@@ -0,0 +1,80 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* checksum.c against the published CRC32 and SHA-256 test vectors */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "checksum.h"
+#include "check.h"
+
+/* the digests of data fed in pieces of step bytes, matched through checksumReport */
+static int32_t checkDigest(const char *data, size_t len, size_t step, const char *expect)
+{
+    struct checksum sum;
+
+    checksumInit(&sum);
+    for (size_t off = 0; off < len; off += step)
+        checksumUpdate(&sum, (const uint8_t *)data + off, len - off < step ? len - off : step);
+    return checksumReport(&sum, expect);
+}
+
+static void testCrc32(void)
+{
+    CHECK_EQ(checksumCrc32((const uint8_t *)"", 0), 0x00000000);
+    CHECK_EQ(checksumCrc32((const uint8_t *)"abc", 3), 0x352441C2);
+    CHECK_EQ(checksumCrc32((const uint8_t *)"123456789", 9), 0xCBF43926);
+    CHECK_EQ(checkDigest("123456789", 9, 1, "cbf43926"), 0);
+    CHECK_EQ(checkDigest("123456789", 9, 4, "CBF43926"), 0);
+    CHECK_EQ(checkDigest("123456789", 9, 9, "cbf43927"), -1);
+}
+
+static void testSha256(void)
+{
+    static const char two_blocks[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    static char million[1000000];
+
+    CHECK_EQ(checkDigest("", 0, 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"), 0);
+    CHECK_EQ(checkDigest("abc", 3, 3, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"), 0);
+    CHECK_EQ(checkDigest("abc", 3, 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"), 0);
+    /* 56 bytes: the length no longer fits the last block */
+    for (size_t step = 1; step <= sizeof(two_blocks); step += 9)
+        CHECK_EQ(checkDigest(two_blocks, sizeof(two_blocks) - 1, step,
+                "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"), 0);
+    memset(million, 'a', sizeof(million));
+    CHECK_EQ(checkDigest(million, sizeof(million), 4093,
+            "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"), 0);
+    CHECK_EQ(checkDigest("abc", 3, 3, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ae"), -1);
+}
+
+static void testExpect(void)
+{
+    CHECK_EQ(checksumCheckExpect("cbf43926"), 0);
+    CHECK_EQ(checksumCheckExpect("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"), 0);
+    CHECK(checksumCheckExpect("cbf4392") < 0);
+    CHECK(checksumCheckExpect("cbf4392g") < 0);
+}
+
+int main(void)
+{
+    testCrc32();
+    testSha256();
+    testExpect();
+    return CHECK_DONE();
+}
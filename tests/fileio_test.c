@@ -0,0 +1,258 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* fileio.c against the simulator: verify reports, sparse dumps and input files with holes */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ch341a.h"
+#include "ch341sim.h"
+#include "fileio.h"
+#include "check.h"
+
+#define CHIP_PATH   "fileio_test.chip"
+#define DUMP_PATH   "fileio_test.dump"
+#define HOLE_PATH   "fileio_test.holes"
+#define TEST_SIZE   (64 * 1024)
+
+static char logText[8192];
+
+static void testLog(void *user, int32_t level, const char *msg)
+{
+    strncat(logText, msg, sizeof(logText) - strlen(logText) - 2);
+    strcat(logText, "\n");
+}
+
+/* a simulated W25Q80 holding chip in its first TEST_SIZE bytes, the rest erased */
+static struct ch341_ctx *testChip(const uint8_t *chip)
+{
+    struct ch341_ctx *ctx;
+    FILE *fp;
+
+    if ((fp = fopen(CHIP_PATH, "wb")) == NULL)
+        return NULL;
+    fwrite(chip, 1, TEST_SIZE, fp);
+    fclose(fp);
+    if ((ctx = ch341New()) == NULL)
+        return NULL;
+    if (ch341SimConfigure(ctx, "W25Q80,nobusy,file=" CHIP_PATH) < 0 || ch341SpiCapacity(ctx) < 0) {
+        ch341Free(ctx);
+        return NULL;
+    }
+    logText[0] = 0;
+    ch341SetLog(ctx, testLog, NULL, CH341_LOG_ERROR);
+    return ctx;
+}
+
+static void testPattern(uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        buf[i] = i * 7 + (i >> 8);
+}
+
+static void testVerify(void)
+{
+    uint8_t *ref = malloc(TEST_SIZE), *chip = malloc(TEST_SIZE);
+    struct ch341_ctx *ctx;
+
+    testPattern(ref, TEST_SIZE);
+    memcpy(chip, ref, TEST_SIZE);
+    memset(ref + 0x1000, 0xFF, 4);      // 32 bits cleared
+    memset(chip + 0x1000, 0x00, 4);
+    ref[0x1006] = 0x00;                 // across a word boundary: 2 + 2 bits set
+    chip[0x1006] = 0x03;
+    ref[0x1007] = 0x00;
+    chip[0x1007] = 0x03;
+    ref[0x1008] = 0x00;                 // the same run, 3 bits set
+    chip[0x1008] = 0x07;
+    ref[0x2345] = 0xF0;                 // 4 bits each way
+    chip[0x2345] = 0x0F;
+    ctx = testChip(chip);
+    CHECK(ctx != NULL);
+    if (ctx) {
+        CHECK_EQ(fileVerifyChip(ctx, ref, 0, TEST_SIZE), 8);
+        CHECK(strstr(logText, "Mismatch at 0x00001000-0x00001003 (4 bytes)\n") != NULL);
+        CHECK(strstr(logText, "Mismatch at 0x00001006-0x00001008 (3 bytes)\n") != NULL);
+        CHECK(strstr(logText, "Mismatch at 0x00002345-0x00002345 (1 bytes)\n") != NULL);
+        CHECK(strstr(logText, "Verify: 8 bytes differ in 3 ranges, 36 bits 1->0, 11 bits 0->1\n") != NULL);
+        CHECK(strstr(logText, "the area needs an erase") != NULL);
+        CHECK(strstr(logText, "program failed") != NULL);
+
+        /* the same readback from an offset: addresses are the chip's */
+        logText[0] = 0;
+        CHECK_EQ(fileVerifyChip(ctx, ref + 0x2000, 0x2000, 0x1000), 1);
+        CHECK(strstr(logText, "Mismatch at 0x00002345-0x00002345 (1 bytes)\n") != NULL);
+        CHECK(strstr(logText, "Verify: 1 bytes differ in 1 ranges, 4 bits 1->0, 4 bits 0->1\n") != NULL);
+
+        logText[0] = 0;
+        CHECK_EQ(fileVerifyChip(ctx, chip, 0, TEST_SIZE), 0);
+        CHECK_EQ(logText[0], 0);
+        ch341Free(ctx);
+    }
+    free(ref);
+    free(chip);
+}
+
+/* past 16 ranges only the count is reported */
+static void testVerifyRanges(void)
+{
+    uint8_t *ref = malloc(TEST_SIZE), *chip = malloc(TEST_SIZE);
+    struct ch341_ctx *ctx;
+
+    memset(ref, 0xFF, TEST_SIZE);
+    memset(chip, 0xFF, TEST_SIZE);
+    for (int i = 0; i < 20; ++i)
+        chip[0x100 * i + 0x80] = 0xFE;
+    ctx = testChip(chip);
+    CHECK(ctx != NULL);
+    if (ctx) {
+        CHECK_EQ(fileVerifyChip(ctx, ref, 0, TEST_SIZE), 20);
+        CHECK(strstr(logText, "Mismatch at 0x00000f80-0x00000f80 (1 bytes)\n") != NULL);
+        CHECK(strstr(logText, "Mismatch at 0x00001080") == NULL);
+        CHECK(strstr(logText, "... 4 more ranges\n") != NULL);
+        CHECK(strstr(logText, "Verify: 20 bytes differ in 20 ranges, 20 bits 1->0, 0 bits 0->1\n") != NULL);
+        CHECK(strstr(logText, "program failed") == NULL);
+        ch341Free(ctx);
+    }
+    free(ref);
+    free(chip);
+}
+
+/* whether the file system here keeps holes; without them there are no extents to check */
+static bool holesKept;
+
+/* 4 KB of A at 0, 4 KB of B at 64 KB, one C at 192 KB, 256 KB long */
+static void testFileMap(void)
+{
+    struct file_map map;
+    struct stat st;
+    uint8_t block[4096];
+    FILE *fp;
+    size_t i;
+
+    CHECK((fp = fopen(HOLE_PATH, "wb")) != NULL);
+    if (fp == NULL)
+        return;
+    memset(block, 'A', sizeof(block));
+    fwrite(block, 1, sizeof(block), fp);
+    memset(block, 'B', sizeof(block));
+    fseek(fp, 0x10000, SEEK_SET);
+    fwrite(block, 1, sizeof(block), fp);
+    fseek(fp, 0x30000, SEEK_SET);
+    fputc('C', fp);
+    fflush(fp);
+    CHECK_EQ(ftruncate(fileno(fp), 0x40000), 0);
+    fclose(fp);
+    holesKept = stat(HOLE_PATH, &st) == 0 && st.st_blocks * 512 < 0x10000;
+    if (!holesKept)
+        printf("no holes on this file system, extents not checked\n");
+
+    CHECK_EQ(fileMap(HOLE_PATH, &map), 0);
+    CHECK_EQ(map.size, 0x40000);
+    if (holesKept) {
+        CHECK_EQ(map.count, 3);
+        CHECK_EQ(map.extents[0].start, 0);
+        CHECK_EQ(map.extents[0].end, 0x1000);
+        CHECK_EQ(map.extents[1].start, 0x10000);
+        CHECK_EQ(map.extents[1].end, 0x11000);
+        CHECK_EQ(map.extents[2].start, 0x30000);
+        CHECK(map.extents[2].end > 0x30000 && map.extents[2].end <= 0x31000);
+    }
+    CHECK_EQ(fileFillHoles(&map, 0), 0);
+    CHECK_EQ(map.data[0x2000], 0);
+    CHECK_EQ(fileFillHoles(&map, 0xEE), 0);
+    for (i = 0; i < map.size && holesKept; ++i) {
+        uint8_t want = i < 0x1000 ? 'A' : i >= 0x10000 && i < 0x11000 ? 'B' : i == 0x30000 ? 'C' :
+                i > 0x30000 && i < map.extents[2].end ? 0 : 0xEE;
+        if (map.data[i] != want) {
+            CHECK_EQ(i, -1);
+            break;
+        }
+    }
+    fileUnmap(&map);
+
+    /* the file itself is untouched */
+    CHECK_EQ(fileMap(HOLE_PATH, &map), 0);
+    CHECK_EQ(map.data[0x2000], 0);
+    fileUnmap(&map);
+    remove(HOLE_PATH);
+}
+
+/* a dump of 128 KB: pattern with a 16 KB run of ff and a 2 KB one that is not a whole
+ * block, then the erased rest of the chip as a trailing hole */
+static void testSparseRead(void)
+{
+    uint8_t *chip = malloc(TEST_SIZE), *dense = malloc(2 * TEST_SIZE);
+    struct ch341_ctx *ctx;
+    struct file_map map;
+    struct stat st;
+    FILE *fp;
+
+    testPattern(chip, TEST_SIZE);
+    memset(chip + 0x4000, 0xFF, 0x4000);
+    memset(chip + 0x9000, 0xFF, 0x800);
+    ctx = testChip(chip);
+    CHECK(ctx != NULL);
+    if (ctx == NULL)
+        goto out;
+    CHECK_EQ(ch341SpiRead(ctx, dense, 0, 2 * TEST_SIZE), 0);
+    CHECK((fp = fopen(DUMP_PATH, "wb")) != NULL);
+    if (fp == NULL)
+        goto out;
+    CHECK_EQ(fileReadChip(ctx, fp, 0, 2 * TEST_SIZE, NULL, 0xFF), 0);
+    fclose(fp);
+    ch341Free(ctx);
+
+    CHECK_EQ(stat(DUMP_PATH, &st), 0);
+    CHECK_EQ(st.st_size, 2 * TEST_SIZE);
+    if (holesKept)
+        CHECK(st.st_blocks * 512 <= 0xC000);
+    CHECK_EQ(fileMap(DUMP_PATH, &map), 0);
+    CHECK_EQ(map.size, 2 * TEST_SIZE);
+    if (holesKept) {
+        CHECK_EQ(map.count, 2);
+        CHECK_EQ(map.extents[0].start, 0);
+        CHECK_EQ(map.extents[0].end, 0x4000);
+        CHECK_EQ(map.extents[1].start, 0x8000);
+        CHECK_EQ(map.extents[1].end, 0x10000);
+    }
+    CHECK_EQ(map.data[0x4000], 0);
+    CHECK_EQ(map.data[0x9000], 0xFF);
+    CHECK_EQ(fileFillHoles(&map, 0xFF), 0);
+    CHECK(memcmp(map.data, dense, 2 * TEST_SIZE) == 0);
+    fileUnmap(&map);
+out:
+    remove(DUMP_PATH);
+    free(chip);
+    free(dense);
+}
+
+int main(void)
+{
+    testVerify();
+    testVerifyRanges();
+    testFileMap();
+    testSparseRead();
+    remove(CHIP_PATH);
+    return CHECK_DONE();
+}
@@ -0,0 +1,219 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* imagefmt.c against the fixtures in tests/images and broken records made up here */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "imagefmt.h"
+#include "check.h"
+
+#define TEMP_PATH   "imagefmt_test.tmp"
+
+static const char *dir;
+
+static int32_t load(const char *name, int32_t format, uint32_t base, struct file_map *map)
+{
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return imageLoad(path, format, base, map);
+}
+
+/* what the fixtures hold: bytes seed, seed + 3, seed + 6, ... */
+static int checkPattern(const struct file_map *map, size_t at, uint8_t seed, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (map->data[at + i] != (uint8_t)(seed + 3 * i))
+            return 0;
+    return 1;
+}
+
+static void checkExtent(const struct file_map *map, uint32_t i, size_t start, size_t end)
+{
+    CHECK(i < map->count);
+    if (i < map->count) {
+        CHECK_EQ(map->extents[i].start, start);
+        CHECK_EQ(map->extents[i].end, end);
+    }
+}
+
+static void testIhex(void)
+{
+    struct file_map map;
+
+    /* 04 and 05 records, CRLF, rebased from 0x08000000 */
+    CHECK_EQ(load("xip.hex", IMAGE_AUTO, 0x08000000, &map), IMAGE_IHEX);
+    CHECK_EQ(map.size, 0x110);
+    CHECK_EQ(map.count, 2);
+    checkExtent(&map, 0, 0, 0x28);
+    checkExtent(&map, 1, 0x100, 0x110);
+    CHECK(checkPattern(&map, 0, 0x10, 16) && checkPattern(&map, 0x10, 0x20, 16) && checkPattern(&map, 0x20, 0x30, 8));
+    CHECK(checkPattern(&map, 0x100, 0x40, 16));
+    CHECK_EQ(map.data[0x28], 0xff);
+    CHECK_EQ(map.data[0xff], 0xff);
+    fileUnmap(&map);
+    CHECK_EQ(load("xip.hex", IMAGE_IHEX, 0x08000100, &map), -1);
+
+    /* 02 segments meeting at 0x20000, an 03 start, a later record over an earlier one,
+     * a record past the end record */
+    CHECK_EQ(load("segment.hex", IMAGE_AUTO, 0, &map), IMAGE_IHEX);
+    CHECK_EQ(map.size, 0x20010);
+    CHECK_EQ(map.count, 1);
+    checkExtent(&map, 0, 0x1fff0, 0x20010);
+    CHECK_EQ(map.data[0], 0xff);
+    CHECK(checkPattern(&map, 0x1fff0, 0x50, 16) && checkPattern(&map, 0x20000, 0x60, 4));
+    CHECK(map.data[0x20004] == 0xAA && map.data[0x20007] == 0xAA);
+    CHECK(checkPattern(&map, 0x20008, 0x60 + 3 * 8, 8));
+    fileUnmap(&map);
+}
+
+static void testSrec(void)
+{
+    struct file_map map;
+
+    /* S1 ended by S9, with a record after it */
+    CHECK_EQ(load("s1.s19", IMAGE_AUTO, 0, &map), IMAGE_SREC);
+    CHECK_EQ(map.size, 0x1014);
+    CHECK_EQ(map.count, 1);
+    checkExtent(&map, 0, 0x1000, 0x1014);
+    CHECK(checkPattern(&map, 0x1000, 1, 16) && checkPattern(&map, 0x1010, 2, 4));
+    fileUnmap(&map);
+
+    /* S2 out of order, ended by S8 */
+    CHECK_EQ(load("s2.s28", IMAGE_SREC, 0x120000, &map), IMAGE_SREC);
+    CHECK_EQ(map.size, 0x3460);
+    CHECK_EQ(map.count, 2);
+    checkExtent(&map, 0, 0x3400, 0x3408);
+    checkExtent(&map, 1, 0x3450, 0x3460);
+    CHECK(checkPattern(&map, 0x3400, 5, 8) && checkPattern(&map, 0x3450, 4, 16));
+    fileUnmap(&map);
+
+    /* S3 with overlapping records, S5 and S7 */
+    CHECK_EQ(load("s3.s37", IMAGE_AUTO, 0x08000000, &map), IMAGE_SREC);
+    CHECK_EQ(map.size, 0x28);
+    CHECK_EQ(map.count, 1);
+    checkExtent(&map, 0, 0, 0x28);
+    CHECK(checkPattern(&map, 0, 6, 0x18));
+    CHECK(map.data[0x18] == 0x55 && map.data[0x27] == 0x55);
+    fileUnmap(&map);
+}
+
+/* .text at 0x08000000, .data run at 0x20000000 and loaded at 0x08000400, a .bss and a
+ * note that have nothing to program */
+static void testElf(void)
+{
+    static const char *const names[] = { "xip32le.elf", "xip64be.elf" };
+    struct file_map map;
+
+    for (int i = 0; i < 2; ++i) {
+        CHECK_EQ(load(names[i], IMAGE_AUTO, 0x08000000, &map), IMAGE_ELF);
+        CHECK_EQ(map.size, 0x408);
+        CHECK_EQ(map.count, 2);
+        checkExtent(&map, 0, 0, 0x20);
+        checkExtent(&map, 1, 0x400, 0x408);
+        CHECK(checkPattern(&map, 0, 7, 0x20) && checkPattern(&map, 0x400, 8, 8));
+        fileUnmap(&map);
+    }
+}
+
+/* load text (or len bytes of it) as format, true if it is refused */
+static int refused(const void *text, size_t len, int32_t format, uint32_t base)
+{
+    struct file_map map;
+    FILE *fp;
+    int32_t ret;
+
+    if ((fp = fopen(TEMP_PATH, "wb")) == NULL)
+        return 0;
+    fwrite(text, 1, len ? len : strlen(text), fp);
+    fclose(fp);
+    ret = imageLoad(TEMP_PATH, format, base, &map);
+    if (ret >= 0)
+        fileUnmap(&map);
+    remove(TEMP_PATH);
+    return ret < 0;
+}
+
+static void testMalformed(void)
+{
+    char path[1024], elf[512];
+    size_t n;
+    FILE *fp;
+
+    /* Intel HEX: checksum, digits, lengths, record types */
+    CHECK(!refused(":0400000001020304F2\n:00000001FF\n", 0, IMAGE_IHEX, 0));
+    CHECK(refused(":0400000001020304F3\n:00000001FF\n", 0, IMAGE_IHEX, 0));
+    CHECK(refused(":0400000001020304F\n:00000001FF\n", 0, IMAGE_IHEX, 0));
+    CHECK(refused(":0500000001020304F1\n:00000001FF\n", 0, IMAGE_IHEX, 0));
+    CHECK(refused(":04000000010203G4F2\n:00000001FF\n", 0, IMAGE_IHEX, 0));
+    CHECK(refused("0400000001020304F2\n:00000001FF\n", 0, IMAGE_IHEX, 0));
+    CHECK(refused(":0100000408F3\n:0400000001020304F2\n", 0, IMAGE_IHEX, 0));
+    CHECK(refused(":0400000601020304EE\n:00000001FF\n", 0, IMAGE_IHEX, 0));
+    CHECK(refused(":00000001FF\n", 0, IMAGE_IHEX, 0));
+    /* without an end record it loads, with a warning */
+    CHECK(!refused(":0400000001020304F2\n", 0, IMAGE_IHEX, 0));
+    /* XIP at 0x10000000 is past the limit without its base */
+    CHECK(refused(":020000041000EA\n:0400000001020304F2\n:00000001FF\n", 0, IMAGE_IHEX, 0));
+    CHECK(!refused(":020000041000EA\n:0400000001020304F2\n:00000001FF\n", 0, IMAGE_IHEX, 0x10000000));
+
+    /* S-records: checksum, count, type, address length */
+    CHECK(!refused("S107100001020304DE\nS9030000FC\n", 0, IMAGE_SREC, 0));
+    CHECK(refused("S107100001020304DF\nS9030000FC\n", 0, IMAGE_SREC, 0));
+    CHECK(refused("S108100001020304DE\nS9030000FC\n", 0, IMAGE_SREC, 0));
+    CHECK(refused("S407100001020304DE\nS9030000FC\n", 0, IMAGE_SREC, 0));
+    CHECK(refused("S3031000EC\nS9030000FC\n", 0, IMAGE_SREC, 0));
+    CHECK(refused("X107100001020304DE\n", 0, IMAGE_SREC, 0));
+
+    /* ELF: cut short, program headers or a segment past the end */
+    snprintf(path, sizeof(path), "%s/xip32le.elf", dir);
+    CHECK((fp = fopen(path, "rb")) != NULL);
+    if (fp == NULL)
+        return;
+    n = fread(elf, 1, sizeof(elf), fp);
+    fclose(fp);
+    CHECK(!refused(elf, n, IMAGE_ELF, 0x08000000));
+    CHECK(refused(elf, 40, IMAGE_ELF, 0x08000000));
+    CHECK(refused(elf, 52 + 32, IMAGE_ELF, 0x08000000));
+    elf[52 + 4] = 0xf0;     // p_offset of the first segment
+    CHECK(refused(elf, n, IMAGE_ELF, 0x08000000));
+    elf[52 + 4] = 0;
+    elf[28] = 0xf0;         // e_phoff
+    CHECK(refused(elf, n, IMAGE_ELF, 0x08000000));
+    CHECK(refused("\x7f" "ELF", 4, IMAGE_AUTO, 0));
+
+    /* a raw image has no addresses */
+    CHECK(refused("raw", 0, IMAGE_RAW, 0x1000));
+    CHECK(!refused("raw", 0, IMAGE_RAW, 0));
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <tests/images>\n", argv[0]);
+        return 2;
+    }
+    dir = argv[1];
+    testIhex();
+    testSrec();
+    testElf();
+    testMalformed();
+    return CHECK_DONE();
+}
@@ -0,0 +1,249 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* layout.c: layout files, FMAPs in an image and on the simulated chip, and -I */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "ch341a.h"
+#include "ch341sim.h"
+#include "layout.h"
+#include "check.h"
+
+#define LAYOUT_PATH "layout_test.layout"
+#define CHIP_PATH   "layout_test.chip"
+#define CHIP_SIZE   (1024 * 1024)
+
+static int32_t loadText(struct layout *l, const char *text)
+{
+    FILE *fp = fopen(LAYOUT_PATH, "w");
+
+    if (fp == NULL)
+        return -2;
+    fputs(text, fp);
+    fclose(fp);
+    return layoutLoad(l, LAYOUT_PATH);
+}
+
+static void checkRegion(const struct layout *l, uint32_t i, uint32_t start, uint32_t end, const char *name)
+{
+    CHECK(i < l->count);
+    if (i < l->count) {
+        CHECK_EQ(l->region[i].start, start);
+        CHECK_EQ(l->region[i].end, end);
+        CHECK(!strcmp(l->region[i].name, name));
+    }
+}
+
+static void testLoad(void)
+{
+    static struct layout l;
+    char text[4096] = "";
+
+    CHECK_EQ(loadText(&l, "# flashrom layout\n"
+                "00000000:00000fff bootblock   # the first 4 KB\n"
+                "\n"
+                "  0x1000:0x3FFFF\trw_a\n"
+                "40000:7ffff ro_section_with_a_name_of_over_32_chars\n"), 0);
+    CHECK_EQ(l.count, 3);
+    checkRegion(&l, 0, 0, 0x1000, "bootblock");
+    checkRegion(&l, 1, 0x1000, 0x40000, "rw_a");
+    checkRegion(&l, 2, 0x40000, 0x80000, "ro_section_with_a_name_of_over_3");
+    CHECK(!l.region[0].included);
+
+    CHECK_EQ(loadText(&l, "0:fff\n"), -1);              // no name
+    CHECK_EQ(loadText(&l, "0-fff boot\n"), -1);         // no colon
+    CHECK_EQ(loadText(&l, "1000:fff boot\n"), -1);      // ends before it starts
+    CHECK_EQ(loadText(&l, "0:fffg boot\n"), -1);
+    CHECK_EQ(loadText(&l, "0:100000000 all\n"), -1);    // past 4 GB
+    CHECK_EQ(loadText(&l, "# nothing\n\n"), -1);
+    for (int i = 0; i <= LAYOUT_MAX_REGIONS; ++i)
+        snprintf(text + strlen(text), sizeof(text) - strlen(text), "%x:%x r%d\n", i * 16, i * 16 + 15, i);
+    CHECK_EQ(loadText(&l, text), -1);
+    remove(LAYOUT_PATH);
+    CHECK_EQ(layoutLoad(&l, LAYOUT_PATH), -1);
+}
+
+static void putLe(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = v >> (8 * i);
+}
+
+/* an FMAP at fmap with its own area and three more, over a chip of size bytes */
+static size_t fmapBuild(uint8_t *p, uint32_t fmap, uint32_t size)
+{
+    static const struct { uint32_t off, size; const char *name; } areas[] = {
+        { 0, 0x10000, "RO_SECTION" }, { 0, 0x1000, "FMAP" }, { 0x40000, 0x8000, "RW_A" },
+        { 0x48000, 0x8000, "RW_B" },
+    };
+    uint8_t *a;
+
+    memset(p, 0, 56 + 4 * 42);
+    memcpy(p, "__FMAP__", 8);
+    p[8] = 1;
+    p[9] = 1;
+    putLe(p + 18, size);
+    strcpy((char *)p + 22, "TEST");
+    p[54] = 4;
+    for (int i = 0; i < 4; ++i) {
+        uint32_t off = i == 1 ? fmap : areas[i].off;
+        a = p + 56 + i * 42;
+        putLe(a, off);
+        putLe(a + 4, areas[i].size);
+        strcpy((char *)a + 8, areas[i].name);
+    }
+    return 56 + 4 * 42;
+}
+
+static void checkFmap(const struct layout *l, uint32_t fmap)
+{
+    CHECK_EQ(l->count, 4);
+    checkRegion(l, 0, 0, 0x10000, "RO_SECTION");
+    checkRegion(l, 1, fmap, fmap + 0x1000, "FMAP");
+    checkRegion(l, 2, 0x40000, 0x48000, "RW_A");
+    checkRegion(l, 3, 0x48000, 0x50000, "RW_B");
+}
+
+static void testFmap(void)
+{
+    static uint8_t image[0x20000];
+    static struct layout l;
+    size_t n;
+
+    memset(image, 0xff, sizeof(image));
+    CHECK_EQ(layoutFmap(&l, image, sizeof(image)), -1);
+    /* a signature that is not an FMAP comes first */
+    memcpy(image + 0x100, "__FMAP__", 8);
+    n = fmapBuild(image + 0x10000, 0x10000, 0x100000);
+    CHECK_EQ(layoutFmap(&l, image, sizeof(image)), 0);
+    checkFmap(&l, 0x10000);
+    /* cut short within the areas */
+    CHECK_EQ(layoutFmap(&l, image, 0x10000 + n - 1), -1);
+    /* an area past 4 GB */
+    memset(image + 0x10000 + 56 + 3 * 42, 0xff, 8);
+    CHECK_EQ(layoutFmap(&l, image, sizeof(image)), -1);
+}
+
+/* a simulated W25Q80 with an FMAP at fmap, or none if it is 0 */
+static struct ch341_ctx *testChip(uint32_t fmap)
+{
+    uint8_t *chip = malloc(CHIP_SIZE);
+    struct ch341_ctx *ctx;
+    FILE *fp;
+
+    memset(chip, 0xff, CHIP_SIZE);
+    if (fmap)
+        fmapBuild(chip + fmap, fmap, CHIP_SIZE);
+    fp = fopen(CHIP_PATH, "wb");
+    if (fp != NULL) {
+        fwrite(chip, 1, CHIP_SIZE, fp);
+        fclose(fp);
+    }
+    free(chip);
+    if (fp == NULL || (ctx = ch341New()) == NULL)
+        return NULL;
+    if (ch341SimConfigure(ctx, "W25Q80,nobusy,file=" CHIP_PATH) < 0 || ch341SpiCapacity(ctx) < 0) {
+        ch341Free(ctx);
+        return NULL;
+    }
+    ch341SetLog(ctx, NULL, NULL, CH341_LOG_ERROR);
+    return ctx;
+}
+
+/* at 0, at an odd multiple of the largest stride and at the smallest one */
+static void testFmapChip(void)
+{
+    static const uint32_t at[] = { 0x80000, 0x3000, 0xff000 };
+    static struct layout l;
+    struct ch341_ctx *ctx;
+
+    for (uint32_t i = 0; i < sizeof(at) / sizeof(at[0]); ++i) {
+        CHECK((ctx = testChip(at[i])) != NULL);
+        if (ctx == NULL)
+            continue;
+        CHECK_EQ(layoutFmapChip(ctx, &l), 0);
+        checkFmap(&l, at[i]);
+        ch341Free(ctx);
+    }
+    CHECK((ctx = testChip(0)) != NULL);
+    if (ctx) {
+        CHECK_EQ(layoutFmapChip(ctx, &l), -1);
+        ch341Free(ctx);
+    }
+    remove(CHIP_PATH);
+}
+
+static void testInclude(void)
+{
+    static struct layout l;
+    const struct file_extent in[] = { { 0, 0x1200 }, { 0x1400, 0x1500 }, { 0x2f00, 0x5800 }, { 0x7000, 0x8000 } };
+    struct file_extent *out;
+    uint32_t count;
+
+    CHECK_EQ(loadText(&l, "1000:1fff a\n1800:2fff b\n5000:5fff c\n9000:9fff d\n"), 0);
+    remove(LAYOUT_PATH);
+    CHECK_EQ(layoutInclude(&l, "e"), -1);
+    CHECK_EQ(layoutInclude(&l, "A"), -1);
+
+    /* nothing included, nothing left */
+    out = layoutExtents(&l, in, 4, &count);
+    CHECK(out != NULL);
+    CHECK_EQ(count, 0);
+    free(out);
+
+    /* a and b overlap; d has no data */
+    CHECK_EQ(layoutInclude(&l, "c"), 2);
+    CHECK_EQ(layoutInclude(&l, "a"), 0);
+    CHECK_EQ(layoutInclude(&l, "b"), 1);
+    CHECK_EQ(layoutInclude(&l, "d"), 3);
+    CHECK(l.region[0].included && l.region[3].included);
+    out = layoutExtents(&l, in, 4, &count);
+    CHECK(out != NULL);
+    CHECK_EQ(count, 4);
+    if (out && count == 4) {
+        CHECK(out[0].start == 0x1000 && out[0].end == 0x1200);
+        CHECK(out[1].start == 0x1400 && out[1].end == 0x1500);
+        CHECK(out[2].start == 0x2f00 && out[2].end == 0x3000);
+        CHECK(out[3].start == 0x5000 && out[3].end == 0x5800);
+    }
+    free(out);
+
+    /* a raw image is one extent */
+    const struct file_extent all = { 0, 0x10000 };
+    out = layoutExtents(&l, &all, 1, &count);
+    CHECK(out != NULL);
+    CHECK_EQ(count, 3);
+    if (out && count == 3) {
+        CHECK(out[0].start == 0x1000 && out[0].end == 0x3000);
+        CHECK(out[1].start == 0x5000 && out[1].end == 0x6000);
+        CHECK(out[2].start == 0x9000 && out[2].end == 0xa000);
+    }
+    free(out);
+}
+
+int main(void)
+{
+    testLoad();
+    testFmap();
+    testFmapChip();
+    testInclude();
+    return CHECK_DONE();
+}
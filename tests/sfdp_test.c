@@ -0,0 +1,216 @@
+/*
+ * This file is part of the ch341prog project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* ch341ReadSfdp against SFDP tables of real parts, trimmed to the headers and tables the
+ * parser reads and served by the simulator in place of the one it makes up. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "ch341a.h"
+#include "ch341sim.h"
+#include "check.h"
+
+#define DUMP_PATH "sfdp_test.bin"
+
+/* W25Q128JV: SFDP 1.5, basic table only; 16 MB, 3-byte addresses */
+static const uint8_t w25q128jvHeader[] = {
+    0x53, 0x46, 0x44, 0x50, 0x05, 0x01, 0x00, 0xFF,
+    0x00, 0x05, 0x01, 0x10, 0x80, 0x00, 0x00, 0xFF,
+};
+static const uint8_t w25q128jvBfpt[] = {
+    0xE5, 0x20, 0xF9, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x44, 0xEB, 0x08, 0x6B, 0x08, 0x3B, 0x42, 0xBB,
+    0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0xFF, 0xFF, 0x40, 0xEB, 0x0C, 0x20, 0x0F, 0x52,
+    0x10, 0xD8, 0x00, 0x00, 0x36, 0x02, 0xA6, 0x00, 0x82, 0xEA, 0x14, 0xC9, 0xE9, 0x63, 0x76, 0x33,
+    0x7A, 0x75, 0x7A, 0x75, 0xF7, 0xA2, 0xD5, 0x5C, 0x19, 0xF7, 0x4D, 0xFF, 0xE9, 0x30, 0xF8, 0x80,
+};
+
+/* MX25L25645G: SFDP 1.6 with the 4-byte address instruction table; 32 MB */
+static const uint8_t mx25l25645gHeader[] = {
+    0x53, 0x46, 0x44, 0x50, 0x06, 0x01, 0x01, 0xFF,
+    0x00, 0x06, 0x01, 0x10, 0x30, 0x00, 0x00, 0xFF,
+    0x84, 0x00, 0x01, 0x02, 0xC0, 0x00, 0x00, 0xFF,
+};
+static const uint8_t mx25l25645gBfpt[] = {
+    0xE5, 0x20, 0xFB, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0x44, 0xEB, 0x08, 0x6B, 0x08, 0x3B, 0x04, 0xBB,
+    0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0xFF, 0xFF, 0x44, 0xEB, 0x0C, 0x20, 0x0F, 0x52,
+    0x10, 0xD8, 0x00, 0xFF, 0xD6, 0x49, 0xC5, 0x00, 0x82, 0xDF, 0x04, 0xE3, 0x44, 0x03, 0x67, 0x38,
+    0x30, 0xB0, 0x30, 0xB0, 0xF7, 0xBD, 0xD5, 0x5C, 0x4A, 0x9E, 0x29, 0xFF, 0xF0, 0x50, 0xF9, 0x85,
+};
+static const uint8_t mx25l25645g4bait[] = {
+    0x7F, 0xEF, 0xFF, 0xFF, 0x21, 0x5C, 0xDC, 0xFF,
+};
+
+/* MX25L25635E: SFDP 1.0, a 9 dword basic table and no 4-byte instructions; 32 MB */
+static const uint8_t mx25l25635eHeader[] = {
+    0x53, 0x46, 0x44, 0x50, 0x00, 0x01, 0x00, 0xFF,
+    0x00, 0x00, 0x01, 0x09, 0x30, 0x00, 0x00, 0xFF,
+};
+static const uint8_t mx25l25635eBfpt[] = {
+    0xE5, 0x20, 0xF3, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0x44, 0xEB, 0x08, 0x6B, 0x08, 0x3B, 0x04, 0xBB,
+    0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0xFF, 0xFF, 0xFF, 0x44, 0xEB, 0x0C, 0x20, 0x0F, 0x52,
+    0x10, 0xD8, 0x00, 0xFF,
+};
+
+/* write the tables at their offsets in an erased 512 byte dump and parse it */
+static struct ch341_ctx *sfdpParse(const uint8_t *hdr, size_t hdr_len, const uint8_t *bfpt, size_t bfpt_len,
+        uint32_t bfpt_at, const uint8_t *bait, uint32_t bait_at)
+{
+    uint8_t dump[512];
+    struct ch341_ctx *ctx;
+    FILE *fp;
+
+    memset(dump, 0xFF, sizeof(dump));
+    memcpy(dump, hdr, hdr_len);
+    memcpy(dump + bfpt_at, bfpt, bfpt_len);
+    if (bait)
+        memcpy(dump + bait_at, bait, 8);
+    if ((fp = fopen(DUMP_PATH, "wb")) == NULL || fwrite(dump, 1, sizeof(dump), fp) != sizeof(dump))
+        return NULL;
+    fclose(fp);
+    if ((ctx = ch341New()) == NULL)
+        return NULL;
+    if (ch341SimConfigure(ctx, "W25Q80,sfdp=" DUMP_PATH) < 0 || ch341ReadSfdp(ctx) < 0) {
+        ch341Free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static void checkErase(const struct spi_erase_type *e, uint32_t size, uint8_t opcode, uint8_t opcode4,
+        uint32_t typ_ms, uint32_t max_ms)
+{
+    CHECK_EQ(e->size, size);
+    CHECK_EQ(e->opcode, opcode);
+    CHECK_EQ(e->opcode4, opcode4);
+    CHECK_EQ(e->typ_ms, typ_ms);
+    CHECK_EQ(e->max_ms, max_ms);
+}
+
+static void testW25q128jv(void)
+{
+    struct ch341_ctx *ctx = sfdpParse(w25q128jvHeader, sizeof(w25q128jvHeader),
+            w25q128jvBfpt, sizeof(w25q128jvBfpt), 0x80, NULL, 0);
+
+    CHECK(ctx != NULL);
+    if (ctx == NULL)
+        return;
+    CHECK(ctx->flash.sfdp);
+    CHECK_EQ(ctx->flash.capacity, 16u << 20);
+    CHECK_EQ(ctx->flash.addr_mode, SPI_ADDR_3BYTE);
+    CHECK_EQ(ctx->flash.page_size, 256);
+    CHECK_EQ(ctx->flash.page_prog_us, 704);
+    CHECK_EQ(ctx->flash.page_prog_max_us, 4224);
+    CHECK_EQ(ctx->flash.chip_erase_ms, 40000);
+    CHECK_EQ(ctx->flash.chip_erase_max_ms, 240000);
+    CHECK_EQ(ctx->flash.erase_types, 3);
+    checkErase(&ctx->flash.erase[0], 4096, 0x20, 0, 64, 896);
+    checkErase(&ctx->flash.erase[1], 32768, 0x52, 0, 128, 1792);
+    checkErase(&ctx->flash.erase[2], 65536, 0xD8, 0, 160, 2240);
+    CHECK_EQ(ctx->flash.fast_read_112.opcode, 0x3B);
+    CHECK_EQ(ctx->flash.fast_read_112.dummy_clocks, 8);
+    CHECK_EQ(ctx->flash.fast_read_122.opcode, 0xBB);
+    CHECK_EQ(ctx->flash.fast_read_122.dummy_clocks, 2);
+    CHECK_EQ(ctx->flash.fast_read_122.mode_clocks, 2);
+    CHECK_EQ(ctx->flash.fast_read_144.opcode, 0xEB);
+    CHECK_EQ(ctx->flash.fast_read_114.opcode, 0x6B);
+    ch341Free(ctx);
+}
+
+static void testMx25l25645g(void)
+{
+    struct ch341_ctx *ctx = sfdpParse(mx25l25645gHeader, sizeof(mx25l25645gHeader),
+            mx25l25645gBfpt, sizeof(mx25l25645gBfpt), 0x30, mx25l25645g4bait, 0xC0);
+
+    CHECK(ctx != NULL);
+    if (ctx == NULL)
+        return;
+    CHECK_EQ(ctx->flash.capacity, 32u << 20);
+    CHECK_EQ(ctx->flash.addr_mode, SPI_ADDR_3OR4BYTE);
+    CHECK_EQ(ctx->flash.page_size, 256);
+    CHECK_EQ(ctx->flash.page_prog_us, 256);
+    CHECK_EQ(ctx->flash.chip_erase_ms, 256000);
+    CHECK_EQ(ctx->flash.read4_op, 0x13);
+    CHECK_EQ(ctx->flash.fast_read4_op, 0x0C);
+    CHECK_EQ(ctx->flash.prog4_op, 0x12);
+    CHECK_EQ(ctx->flash.erase_types, 3);
+    checkErase(&ctx->flash.erase[0], 4096, 0x20, 0x21, 30, 420);
+    checkErase(&ctx->flash.erase[1], 32768, 0x52, 0x5C, 160, 2240);
+    checkErase(&ctx->flash.erase[2], 65536, 0xD8, 0xDC, 288, 4032);
+    ch341Free(ctx);
+}
+
+/* the same part with the 32 KB 4-byte erase taken out of the table: that size must go */
+static void testMx25l25645gNo32k(void)
+{
+    uint8_t bait[sizeof(mx25l25645g4bait)];
+    struct ch341_ctx *ctx;
+
+    memcpy(bait, mx25l25645g4bait, sizeof(bait));
+    bait[1] &= ~(1 << 2);   // dword 1 bit 10, erase type 2
+    ctx = sfdpParse(mx25l25645gHeader, sizeof(mx25l25645gHeader),
+            mx25l25645gBfpt, sizeof(mx25l25645gBfpt), 0x30, bait, 0xC0);
+    CHECK(ctx != NULL);
+    if (ctx == NULL)
+        return;
+    CHECK_EQ(ctx->flash.erase_types, 2);
+    CHECK_EQ(ctx->flash.erase[0].opcode4, 0x21);
+    CHECK_EQ(ctx->flash.erase[1].size, 65536);
+    CHECK_EQ(ctx->flash.erase[1].opcode4, 0xDC);
+    ch341Free(ctx);
+}
+
+static void testMx25l25635e(void)
+{
+    struct ch341_ctx *ctx = sfdpParse(mx25l25635eHeader, sizeof(mx25l25635eHeader),
+            mx25l25635eBfpt, sizeof(mx25l25635eBfpt), 0x30, NULL, 0);
+
+    CHECK(ctx != NULL);
+    if (ctx == NULL)
+        return;
+    CHECK_EQ(ctx->flash.capacity, 32u << 20);
+    /* no 4-byte opcodes to take: the 3-byte ones after EN4B */
+    CHECK_EQ(ctx->flash.addr_mode, SPI_ADDR_EN4B);
+    CHECK_EQ(ctx->flash.read4_op, ctx->flash.read_op);
+    CHECK_EQ(ctx->flash.prog4_op, ctx->flash.prog_op);
+    CHECK_EQ(ctx->flash.page_size, 256);   // not in a 9 dword table, the default stays
+    CHECK_EQ(ctx->flash.erase_types, 3);
+    checkErase(&ctx->flash.erase[0], 4096, 0x20, 0x20, 45, 360);
+    checkErase(&ctx->flash.erase[1], 32768, 0x52, 0x52, 360, 2880);
+    checkErase(&ctx->flash.erase[2], 65536, 0xD8, 0xD8, 720, 5760);
+    ch341Free(ctx);
+}
+
+static void testNoSfdp(void)
+{
+    static const uint8_t blank[16];
+    struct ch341_ctx *ctx = sfdpParse(blank, sizeof(blank), blank, 4, 0x30, NULL, 0);
+
+    CHECK(ctx == NULL);
+}
+
+int main(void)
+{
+    testW25q128jv();
+    testMx25l25645g();
+    testMx25l25645gNo32k();
+    testMx25l25635e();
+    testNoSfdp();
+    remove(DUMP_PATH);
+    return CHECK_DONE();
+}
@@ -0,0 +1,369 @@
+# Drive ch341prog against the simulated programmer: cmake -DPROG=<ch341prog> -DCASE=<case>
+# [-DQUEUE=<n>] -DWORK=<dir> -P simtest.cmake, with case one of roundtrip, diff, erase, retry,
+# erase4 (erase above 16 MB on a part without a 4-byte 32 KB erase), en4b (4-byte
+# addresses through EN4B mode), checksum, resume (--journal runs cut short), tune, sparse, hex (a segmented image) and layout
+# (-I regions of a layout file).
+
+set(SIZE 262144)
+set(BLOCK 4096)
+if(NOT QUEUE)
+    set(QUEUE 4)
+endif()
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+set(CHIP "W25Q80,file=${WORK}/chip.bin")
+if(CASE STREQUAL "retry")
+    set(CHIP "${CHIP},fault=1000")
+elseif(CASE STREQUAL "erase4")
+    set(CHIP "W25Q256,file=${WORK}/chip.bin")
+elseif(CASE STREQUAL "en4b")
+    set(CHIP "MX25L25635F,file=${WORK}/chip.bin")
+endif()
+
+# SIZE bytes of text, a different block wherever seed_of(block) changes
+function(make_image path seed)
+    file(WRITE ${path} "")
+    math(EXPR blocks "${SIZE} / ${BLOCK} - 1")
+    foreach(b RANGE ${blocks})
+        math(EXPR s "${seed} + ${b}")
+        string(RANDOM LENGTH ${BLOCK} RANDOM_SEED ${s} data)
+        file(APPEND ${path} "${data}")
+    endforeach()
+endfunction()
+
+function(run)
+    execute_process(COMMAND ${PROG} -s ${CHIP} -q ${QUEUE} ${ARGN}
+        RESULT_VARIABLE rc OUTPUT_VARIABLE out ERROR_VARIABLE out)
+    if(NOT rc EQUAL 0)
+        message(FATAL_ERROR "ch341prog ${ARGN} failed (${rc}):\n${out}")
+    endif()
+    set(output "${out}" PARENT_SCOPE)
+endfunction()
+
+function(expect_same a b)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${a} ${b} RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 0)
+        message(FATAL_ERROR "${a} and ${b} differ")
+    endif()
+endfunction()
+
+function(expect_range path offset length hex)
+    file(READ ${path} data OFFSET ${offset} LIMIT ${length} HEX)
+    if(NOT data STREQUAL hex)
+        message(FATAL_ERROR "${path} at ${offset}: expected ${hex}")
+    endif()
+endfunction()
+
+make_image(${WORK}/a.bin 1000)
+
+if(CASE STREQUAL "roundtrip" OR CASE STREQUAL "retry")
+    run(-w ${WORK}/a.bin)
+    set(written "${output}")
+    run(-r ${WORK}/back.bin -l ${SIZE})
+    expect_same(${WORK}/a.bin ${WORK}/back.bin)
+    if(CASE STREQUAL "retry" AND NOT (written MATCHES "retrying" AND output MATCHES "retrying"))
+        message(FATAL_ERROR "fault= caused no retry:\n${written}\n${output}")
+    endif()
+elseif(CASE STREQUAL "diff")
+    # every fourth block changes
+    file(WRITE ${WORK}/b.bin "")
+    math(EXPR blocks "${SIZE} / ${BLOCK} - 1")
+    foreach(b RANGE ${blocks})
+        math(EXPR s "1000 + ${b}")
+        math(EXPR m "${b} % 4")
+        if(m EQUAL 0)
+            math(EXPR s "5000 + ${b}")
+        endif()
+        string(RANDOM LENGTH ${BLOCK} RANDOM_SEED ${s} data)
+        file(APPEND ${WORK}/b.bin "${data}")
+    endforeach()
+    run(-w ${WORK}/a.bin)
+    run(-f ${WORK}/b.bin)
+    run(-r ${WORK}/back.bin -l ${SIZE})
+    expect_same(${WORK}/b.bin ${WORK}/back.bin)
+elseif(CASE STREQUAL "erase")
+    run(-w ${WORK}/a.bin)
+    run(-e -o 65536 -l 65536)
+    run(-r ${WORK}/back.bin -l ${SIZE})
+    file(READ ${WORK}/a.bin before LIMIT 65536 HEX)
+    expect_range(${WORK}/back.bin 0 65536 "${before}")
+    string(REPEAT "ff" 65536 erased)
+    expect_range(${WORK}/back.bin 65536 65536 "${erased}")
+    file(READ ${WORK}/a.bin after OFFSET 131072 HEX)
+    expect_range(${WORK}/back.bin 131072 131072 "${after}")
+elseif(CASE STREQUAL "erase4")
+    # 32 KB would be a block of its own, but the part has no 4-byte opcode for it
+    run(-w ${WORK}/a.bin -o 0x1000000)
+    run(-e -o 0x1008000 -l 32768)
+    run(-r ${WORK}/back.bin -o 0x1000000 -l ${SIZE})
+    file(READ ${WORK}/a.bin before LIMIT 32768 HEX)
+    expect_range(${WORK}/back.bin 0 32768 "${before}")
+    string(REPEAT "ff" 32768 erased)
+    expect_range(${WORK}/back.bin 32768 32768 "${erased}")
+    file(READ ${WORK}/a.bin after OFFSET 65536 HEX)
+    expect_range(${WORK}/back.bin 65536 196608 "${after}")
+elseif(CASE STREQUAL "en4b")
+    # across the 16 MB line, then the regions below and above it in one run
+    run(-w ${WORK}/a.bin -o 0xFF0000)
+    run(-r ${WORK}/back.bin -o 0xFF0000 -l ${SIZE})
+    expect_same(${WORK}/a.bin ${WORK}/back.bin)
+    run(-w ${WORK}/a.bin)
+    file(WRITE ${WORK}/layout "0x000000:0x03ffff low\n0x1000000:0x103ffff high\n")
+    run(-r ${WORK}/regions.bin -p ${WORK}/layout -I high -I low)
+    file(READ ${WORK}/a.bin data HEX)
+    expect_range(${WORK}/regions.bin 0 ${SIZE} "${data}")
+    file(READ ${WORK}/a.bin data OFFSET 65536 HEX)
+    expect_range(${WORK}/regions.bin 16777216 196608 "${data}")
+    run(-e -p ${WORK}/layout -I low -I high)
+    run(-r ${WORK}/back.bin -o 0xFF0000 -l ${SIZE})
+    file(READ ${WORK}/a.bin data LIMIT 65536 HEX)
+    expect_range(${WORK}/back.bin 0 65536 "${data}")
+    string(REPEAT "ff" 196608 erased)
+    expect_range(${WORK}/back.bin 65536 196608 "${erased}")
+elseif(CASE STREQUAL "checksum")
+    # the digests printed by -c against cmake's own of the same bytes
+    file(SHA256 ${WORK}/a.bin image)
+    run(-w ${WORK}/a.bin -c)
+    if(NOT output MATCHES "SHA-256: ${image}")
+        message(FATAL_ERROR "write checksum is not ${image}:\n${output}")
+    endif()
+    run(-r ${WORK}/back.bin -l ${SIZE} --checksum=${image})
+    file(SHA256 ${WORK}/back.bin dump)
+    if(NOT dump STREQUAL image OR NOT output MATCHES "SHA-256: ${dump}\nChecksum matches")
+        message(FATAL_ERROR "read checksum is not ${dump}:\n${output}")
+    endif()
+    execute_process(COMMAND ${PROG} -s ${CHIP} -r ${WORK}/back.bin -l 4096 --checksum=${image}
+        RESULT_VARIABLE rc OUTPUT_QUIET ERROR_QUIET)
+    if(rc EQUAL 0)
+        message(FATAL_ERROR "a read with the wrong checksum succeeded")
+    endif()
+elseif(CASE STREQUAL "resume")
+    # four journal chunks; a stray block at 0x90000 fails the write verify in the third
+    set(SIZE 1048576)
+    make_image(${WORK}/full.bin 3000)
+    string(RANDOM LENGTH ${BLOCK} RANDOM_SEED 9 stray)
+    file(WRITE ${WORK}/stray.bin "${stray}")
+    run(-w ${WORK}/stray.bin -o 0x90000)
+    execute_process(COMMAND ${PROG} -s ${CHIP} -w ${WORK}/full.bin -j ${WORK}/jnl
+        RESULT_VARIABLE rc OUTPUT_QUIET ERROR_QUIET)
+    file(STRINGS ${WORK}/jnl lines)
+    list(LENGTH lines n)
+    if(rc EQUAL 0 OR NOT n EQUAL 3)
+        message(FATAL_ERROR "the stray block did not stop the write after two chunks (${rc}): ${lines}")
+    endif()
+    run(-e -o 0x80000 -l 0x80000)
+    run(-w ${WORK}/full.bin -j ${WORK}/jnl -R)
+    if(NOT output MATCHES "Skipped 2 of 4 chunks written" OR EXISTS ${WORK}/jnl)
+        message(FATAL_ERROR "the write did not resume after two chunks:\n${output}")
+    endif()
+    run(-r ${WORK}/back.bin)
+    expect_same(${WORK}/full.bin ${WORK}/back.bin)
+
+    # a read journal cut down by hand to chunk 0 and half a line, over a file whose
+    # chunk 0 is right and the rest is not
+    list(GET lines 0 header)
+    list(GET lines 1 chunk0)
+    list(GET lines 2 chunk1)
+    string(REPLACE " write " " read " header "${header}")
+    string(SUBSTRING "${chunk1}" 0 5 torn)
+    file(WRITE ${WORK}/jnl "${header}\n${chunk0}\n${torn}")
+    run(-r ${WORK}/part.bin -l 262144)
+    file(APPEND ${WORK}/part.bin "${stray}${stray}")
+    run(-r ${WORK}/part.bin -j ${WORK}/jnl -R)
+    if(NOT output MATCHES "Resuming from [^\n]*: 1 of 4 chunks done" OR NOT output MATCHES "Skipped 1 of 4 chunks read")
+        message(FATAL_ERROR "the read did not resume after chunk 0:\n${output}")
+    endif()
+    expect_same(${WORK}/full.bin ${WORK}/part.bin)
+
+    # journals for another range or chip are refused and left alone
+    function(expect_refused text)
+        file(WRITE ${WORK}/jnl "${text}")
+        execute_process(COMMAND ${PROG} -s ${CHIP} -r ${WORK}/part.bin -j ${WORK}/jnl -R ${ARGN}
+            RESULT_VARIABLE rc OUTPUT_VARIABLE out ERROR_VARIABLE out)
+        file(READ ${WORK}/jnl kept)
+        if(rc EQUAL 0 OR NOT out MATCHES "a journal for another job, chip or range" OR NOT kept STREQUAL text)
+            message(FATAL_ERROR "a mismatched journal was taken (${rc}):\n${out}")
+        endif()
+    endfunction()
+    expect_refused("${header}\n${chunk0}\n" -l 0x80000)
+    string(REPLACE " W25Q80 " " W25Q16 " other "${header}")
+    expect_refused("${other}\n${chunk0}\n")
+    expect_same(${WORK}/full.bin ${WORK}/part.bin)
+elseif(CASE STREQUAL "tune")
+    # the cache goes to the work directory; runs without -q take the tuned setting
+    set(ENV{XDG_CACHE_HOME} ${WORK}/cache)
+    set(cache ${WORK}/cache/ch341prog/tune)
+    function(tune chip)
+        execute_process(COMMAND ${PROG} -s ${chip} ${ARGN}
+            RESULT_VARIABLE rc OUTPUT_VARIABLE out ERROR_VARIABLE out)
+        if(NOT rc EQUAL 0)
+            message(FATAL_ERROR "ch341prog ${ARGN} failed (${rc}):\n${out}")
+        endif()
+        set(output "${out}" PARENT_SCOPE)
+    endfunction()
+    # "turbo 2, double, queue 8" as the cache has it
+    function(cache_line setting var)
+        string(REGEX MATCH "turbo ([0-3])(, double)?, queue ([0-9]+)" m "${setting}")
+        set(speed ${CMAKE_MATCH_1})
+        if(CMAKE_MATCH_2)
+            math(EXPR speed "${speed} | 4")
+        endif()
+        set(${var} "ef4014 simulator ${speed} ${CMAKE_MATCH_3}" PARENT_SCOPE)
+    endfunction()
+
+    run(-w ${WORK}/a.bin)
+    file(MAKE_DIRECTORY ${WORK}/cache/ch341prog)
+    file(WRITE ${cache} "c84017 1-1.2 5 2\n")
+    tune(${CHIP} -a)
+    string(REGEX MATCH "Tuned: ([^\n]*)" m "${output}")
+    set(tuned "${CMAKE_MATCH_1}")
+    cache_line("${tuned}" line)
+    file(READ ${cache} kept)
+    if(NOT kept STREQUAL "c84017 1-1.2 5 2\n${line}\n")
+        message(FATAL_ERROR "the cache does not hold ${tuned} next to the other programmer:\n${kept}")
+    endif()
+    tune(${CHIP} -r ${WORK}/back.bin -l ${SIZE})
+    if(NOT output MATCHES "Using the tuned setting: ${tuned}\n")
+        message(FATAL_ERROR "the cached ${tuned} was not used:\n${output}")
+    endif()
+    expect_same(${WORK}/a.bin ${WORK}/back.bin)
+    tune(${CHIP} -q 2 -r ${WORK}/back.bin -l ${SIZE})
+    if(output MATCHES "Using the tuned")
+        message(FATAL_ERROR "-q did not override the cache:\n${output}")
+    endif()
+
+    # every 5000th usb read stalls: settings that needed the retry are unstable and
+    # the one kept is either stable or the slowest
+    tune("${CHIP},fault=5000" -a)
+    string(REGEX MATCHALL "turbo [0-3][^\n]*: unstable" unstable "${output}")
+    string(REGEX MATCHALL "turbo [0-3][^\n]*: [0-9]+ bytes per second" stable "${output}")
+    string(REGEX MATCH "Tuned: ([^\n]*)" m "${output}")
+    set(tuned "${CMAKE_MATCH_1}")
+    string(REPLACE "queue " "queue +" pattern "${tuned}")
+    if(NOT unstable OR NOT stable OR (NOT tuned STREQUAL "turbo 0, queue 4" AND NOT stable MATCHES "${pattern}:"))
+        message(FATAL_ERROR "fault= did not reject settings or an unstable one was kept:\n${output}")
+    endif()
+    cache_line("${tuned}" line)
+    file(READ ${cache} kept)
+    if(NOT kept STREQUAL "c84017 1-1.2 5 2\n${line}\n")
+        message(FATAL_ERROR "the cache line for this chip was not replaced by ${tuned}:\n${kept}")
+    endif()
+elseif(CASE STREQUAL "sparse")
+    # the image then 768 KB erased: a sparse dump has it as a hole reading 00
+    run(-w ${WORK}/a.bin)
+    run(-r ${WORK}/dense.bin)
+    run(-r ${WORK}/sparse.bin --sparse=ff)
+    file(SIZE ${WORK}/dense.bin dense)
+    file(SIZE ${WORK}/sparse.bin sparse)
+    if(NOT dense EQUAL 1048576 OR NOT sparse EQUAL dense)
+        message(FATAL_ERROR "the sparse dump is ${sparse} bytes, the dense one ${dense}")
+    endif()
+    file(READ ${WORK}/a.bin data HEX)
+    expect_range(${WORK}/sparse.bin 0 ${SIZE} "${data}")
+    string(REPEAT "00" 786432 zero)
+    expect_range(${WORK}/sparse.bin ${SIZE} 786432 "${zero}")
+    string(REPEAT "ff" 786432 erased)
+    expect_range(${WORK}/dense.bin ${SIZE} 786432 "${erased}")
+
+    # written back to an erased chip, only the data is programmed and the holes stay ff
+    run(-e)
+    run(-w ${WORK}/sparse.bin -z)
+    if(NOT output MATCHES "262144 bytes of data, 786432 in holes left alone")
+        message(FATAL_ERROR "the sparse image was not written by its extents:\n${output}")
+    endif()
+    run(-r ${WORK}/back.bin)
+    expect_same(${WORK}/dense.bin ${WORK}/back.bin)
+elseif(CASE STREQUAL "hex")
+    # tests/images/xip.hex, moved from 0x08000000 to 0x1000: 40 bytes at 0 and 16 at 0x100
+    # of seed, seed + 3, ... as in imagefmt_test
+    function(pattern seed n var)
+        set(hex "")
+        math(EXPR last "${n} - 1")
+        foreach(i RANGE ${last})
+            math(EXPR v "(${seed} + 3 * ${i}) & 255 | 256" OUTPUT_FORMAT HEXADECIMAL)
+            string(SUBSTRING "${v}" 3 2 v)
+            string(APPEND hex "${v}")
+        endforeach()
+        set(${var} "${hex}" PARENT_SCOPE)
+    endfunction()
+    pattern(16 16 p0)
+    pattern(32 16 p1)
+    pattern(48 8 p2)
+    pattern(64 16 p3)
+    set(xip ${CMAKE_CURRENT_LIST_DIR}/images/xip.hex)
+
+    # --diff-write over data: the erase sectors around the segments keep the rest
+    run(-w ${WORK}/a.bin)
+    run(-f ${xip} -B 0x08000000 -o 0x1000)
+    if(NOT output MATCHES "2 segments from 0x1000 to 0x110f")
+        message(FATAL_ERROR "the image was not taken as two segments at 0x1000:\n${output}")
+    endif()
+    run(-r ${WORK}/back.bin -l ${SIZE})
+    file(READ ${WORK}/a.bin data LIMIT 4096 HEX)
+    expect_range(${WORK}/back.bin 0 4096 "${data}")
+    expect_range(${WORK}/back.bin 4096 40 "${p0}${p1}${p2}")
+    file(READ ${WORK}/a.bin data OFFSET 4136 LIMIT 216 HEX)
+    expect_range(${WORK}/back.bin 4136 216 "${data}")
+    expect_range(${WORK}/back.bin 4352 16 "${p3}")
+    file(READ ${WORK}/a.bin data OFFSET 4368 HEX)
+    expect_range(${WORK}/back.bin 4368 257776 "${data}")
+
+    # --write to erased flash: the gap between the segments stays erased
+    run(-w ${xip} -F ihex --base 0x08000000 -o 0x40000)
+    run(-r ${WORK}/back.bin -o 0x40000 -l 4096)
+    string(REPEAT "ff" 216 gap)
+    string(REPEAT "ff" 3824 rest)
+    expect_range(${WORK}/back.bin 0 4096 "${p0}${p1}${p2}${gap}${p3}${rest}")
+
+    # below the base, and not rebased at all
+    foreach(base 0x08000100 0)
+        execute_process(COMMAND ${PROG} -s ${CHIP} -w ${xip} -B ${base}
+            RESULT_VARIABLE rc OUTPUT_VARIABLE out ERROR_VARIABLE out)
+        if(rc EQUAL 0 OR NOT out MATCHES "below the base|beyond the chip")
+            message(FATAL_ERROR "xip.hex with base ${base} was taken:\n${out}")
+        endif()
+    endforeach()
+elseif(CASE STREQUAL "layout")
+    # one region of a 256 KB image, not 64 KB aligned, over other data and over erased flash
+    make_image(${WORK}/b.bin 7000)
+    file(WRITE ${WORK}/layout "# test layout\n0:fff boot\n11000:18fff rw\n19000:3ffff rest\n")
+    run(-w ${WORK}/b.bin)
+    run(-f ${WORK}/a.bin -p ${WORK}/layout -I rw)
+    if(NOT output MATCHES "Region rw: 0x011000-0x018fff")
+        message(FATAL_ERROR "the region was not reported:\n${output}")
+    endif()
+    run(-r ${WORK}/back.bin -l ${SIZE})
+    file(READ ${WORK}/b.bin data LIMIT 69632 HEX)
+    expect_range(${WORK}/back.bin 0 69632 "${data}")
+    file(READ ${WORK}/a.bin data OFFSET 69632 LIMIT 32768 HEX)
+    expect_range(${WORK}/back.bin 69632 32768 "${data}")
+    file(READ ${WORK}/b.bin data OFFSET 102400 HEX)
+    expect_range(${WORK}/back.bin 102400 159744 "${data}")
+
+    run(-e)
+    run(-w ${WORK}/a.bin -p ${WORK}/layout -I boot -I rw)
+    run(-r ${WORK}/back.bin -l ${SIZE})
+    file(READ ${WORK}/a.bin data LIMIT 4096 HEX)
+    string(REPEAT "ff" 65536 erased)
+    expect_range(${WORK}/back.bin 0 4096 "${data}")
+    expect_range(${WORK}/back.bin 4096 65536 "${erased}")
+    file(READ ${WORK}/a.bin data OFFSET 69632 LIMIT 32768 HEX)
+    expect_range(${WORK}/back.bin 69632 32768 "${data}")
+    string(REPEAT "ff" 159744 erased)
+    expect_range(${WORK}/back.bin 102400 159744 "${erased}")
+
+    # a name the layout does not have changes nothing
+    file(SHA256 ${WORK}/back.bin before)
+    execute_process(COMMAND ${PROG} -s ${CHIP} -w ${WORK}/b.bin -p ${WORK}/layout -I rw -I nosuch
+        RESULT_VARIABLE rc OUTPUT_VARIABLE out ERROR_VARIABLE out)
+    if(rc EQUAL 0 OR NOT out MATCHES "No region called nosuch in the layout")
+        message(FATAL_ERROR "an unknown region was taken (${rc}):\n${out}")
+    endif()
+    run(-r ${WORK}/back.bin -l ${SIZE})
+    file(SHA256 ${WORK}/back.bin after)
+    if(NOT after STREQUAL before)
+        message(FATAL_ERROR "the chip changed after the unknown region was refused")
+    endif()
+else()
+    message(FATAL_ERROR "unknown CASE ${CASE}")
+endif()